@@ -0,0 +1,53 @@
+#include "animation.h"
+#include "ofApp.h"
+
+glm::vec3 AnimTrack::eval(float t) const
+{
+	if (t <= times.front())
+		return positions.front();
+	if (t >= times.back())
+		return positions.back();
+	size_t k = std::upper_bound(times.begin(), times.end(), t) - times.begin();
+	float a = (t - times[k - 1]) / (times[k] - times[k - 1]);
+	return glm::mix(positions[k - 1], positions[k], a);
+}
+
+/*
+ * Add a key to the track of an object, keeping the keys sorted by time
+ *
+ * @param SceneObject* target - object, light or camera to move
+ * @param int kind - GEOMETRY, CAMERA or LIGHTS
+ * @param float time - seconds
+ * @param const glm::vec3& position - position of the target at that time
+ */
+void Animation::addKey(SceneObject* target, int kind, float time, const glm::vec3& position)
+{
+	AnimTrack* track = NULL;
+	for (auto& tr : tracks)
+		if (tr.target == target)
+			track = &tr;
+	if (track == NULL)
+	{
+		tracks.push_back(AnimTrack());
+		track = &tracks.back();
+		track->target = target;
+		track->kind = kind;
+	}
+	size_t k = std::upper_bound(track->times.begin(), track->times.end(), time) - track->times.begin();
+	track->times.insert(track->times.begin() + k, time);
+	track->positions.insert(track->positions.begin() + k, position);
+}
+
+int Animation::apply(float t)
+{
+	int changed = NOTHING;
+	for (auto& track : tracks)
+	{
+		glm::vec3 p = track.eval(t);
+		if (p == track.target->position)
+			continue;
+		track.target->setPosition(p);
+		changed |= track.kind;
+	}
+	return changed;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include "ofMain.h"
+
+class SceneObject;
+
+//  Keyframed position of one scene object, light or the render camera.
+//  Positions are interpolated linearly between keys and held before the
+//  first key and after the last.
+//
+struct AnimTrack {
+	SceneObject* target = NULL;
+	int kind = 0;					// Animation::GEOMETRY, CAMERA or LIGHTS, what moving it changes
+	vector<float> times;			// increasing
+	vector<glm::vec3> positions;
+
+	glm::vec3 eval(float t) const;
+};
+
+//  Keyframe animation of a scene, rendered a frame at a time by
+//  ofApp::renderSequenceFrame
+//
+class Animation {
+public:
+	enum Change { NOTHING = 0, GEOMETRY = 1, CAMERA = 2, LIGHTS = 4 };
+
+	void addKey(SceneObject* target, int kind, float time, const glm::vec3& position);
+	int apply(float t);			// move everything to time t, returns the Change flags of what moved
+	void clear() { tracks.clear(); }
+
+	bool empty() const { return tracks.empty(); }
+	int numFrames() const { return std::max(1, (int)floor((end - start) * fps + 0.5f) + 1); }
+	float frameTime(int frame) const { return start + frame / fps; }
+
+	vector<AnimTrack> tracks;
+	float start = 0, end = 0;		// seconds
+	float fps = 24;
+	string framePattern = "frame_%04d.png";		// printf pattern of the frame number
+};
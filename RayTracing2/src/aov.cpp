@@ -0,0 +1,167 @@
+#include <fstream>
+#include <algorithm>
+#include "aov.h"
+
+void AovBuffer::allocate(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	const char* names[] = { "R", "G", "B", "A", "Z", "N.X", "N.Y", "N.Z", "id",
+		"diffuse.R", "diffuse.G", "diffuse.B", "specular.R", "specular.G", "specular.B", "shadow" };
+	channels.clear();
+	for (const char* name : names)
+		channels.push_back({ name, vector<float>((size_t)width * height, 0.0f) });
+	std::sort(channels.begin(), channels.end(), [](const Channel& a, const Channel& b) { return a.name < b.name; });
+
+	r = channel("R"); g = channel("G"); b = channel("B"); a = channel("A");
+	z = channel("Z"); nx = channel("N.X"); ny = channel("N.Y"); nz = channel("N.Z");
+	id = channel("id");
+	dr = channel("diffuse.R"); dg = channel("diffuse.G"); db = channel("diffuse.B");
+	sr = channel("specular.R"); sg = channel("specular.G"); sb = channel("specular.B");
+	shadow = channel("shadow");
+}
+
+float* AovBuffer::channel(const string& name)
+{
+	for (auto& c : channels)
+		if (c.name == name)
+			return c.data.data();
+	return NULL;
+}
+
+/*
+ * Store every pass of one covered pixel, background pixels stay zero
+ *
+ * @param int i - pixel index
+ * @param const glm::vec3& color - beauty color
+ * @param float depth - distance from the camera
+ * @param const glm::vec3& normal - unit world normal
+ * @param int objectId - scene index + 1
+ * @param const ShadeComponents& c - diffuse, specular and shadow terms from shade()
+ */
+void AovBuffer::set(int i, const glm::vec3& color, float depth, const glm::vec3& normal, int objectId, const ShadeComponents& c)
+{
+	r[i] = color.x; g[i] = color.y; b[i] = color.z; a[i] = 1;
+	z[i] = depth;
+	nx[i] = normal.x; ny[i] = normal.y; nz[i] = normal.z;
+	id[i] = objectId;
+	dr[i] = c.diffuse.x; dg[i] = c.diffuse.y; db[i] = c.diffuse.z;
+	sr[i] = c.specular.x; sg[i] = c.specular.y; sb[i] = c.specular.z;
+	shadow[i] = c.shadow;
+}
+
+bool AovBuffer::save(const string& fname) const
+{
+	if (ofToLower(ofFilePath::getFileExt(fname)) == "exr")
+		return saveEXR(fname);
+
+	// PFM holds 1 or 3 channels, so group the passes: name.X/Y/Z or R/G/B
+	// triples become color files, the rest grey
+	string base = ofFilePath::removeExt(fname);
+	bool ok = true;
+	auto find = [&](const string& name) -> const Channel* {
+		for (auto& c : channels)
+			if (c.name == name)
+				return &c;
+		return NULL;
+	};
+	ok &= savePFM(base + ".pfm", { find("R"), find("G"), find("B") });
+	ok &= savePFM(base + "_normal.pfm", { find("N.X"), find("N.Y"), find("N.Z") });
+	ok &= savePFM(base + "_diffuse.pfm", { find("diffuse.R"), find("diffuse.G"), find("diffuse.B") });
+	ok &= savePFM(base + "_specular.pfm", { find("specular.R"), find("specular.G"), find("specular.B") });
+	ok &= savePFM(base + "_alpha.pfm", { find("A") });
+	ok &= savePFM(base + "_depth.pfm", { find("Z") });
+	ok &= savePFM(base + "_id.pfm", { find("id") });
+	ok &= savePFM(base + "_shadow.pfm", { find("shadow") });
+	return ok;
+}
+
+// PFM: text header, then little endian floats with the bottom row first,
+// which is already our row order
+bool AovBuffer::savePFM(const string& fname, const vector<const Channel*>& pass) const
+{
+	std::ofstream out(ofToDataPath(fname), std::ios::binary);
+	if (!out)
+		return false;
+	out << (pass.size() == 3 ? "PF" : "Pf") << "\n" << width << " " << height << "\n-1.0\n";
+	vector<float> row(width * pass.size());
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+			for (size_t c = 0; c < pass.size(); c++)
+				row[x * pass.size() + c] = pass[c]->data[y * width + x];
+		out.write((const char*)row.data(), row.size() * sizeof(float));
+	}
+	return (bool)out;
+}
+
+static void put32(std::ofstream& out, int32_t v) { out.write((const char*)&v, 4); }
+static void putFloat(std::ofstream& out, float v) { out.write((const char*)&v, 4); }
+
+// attribute: name, type, size, value
+static void attribute(std::ofstream& out, const char* name, const char* type, int32_t size)
+{
+	out.write(name, strlen(name) + 1);
+	out.write(type, strlen(type) + 1);
+	put32(out, size);
+}
+
+// Scanline OpenEXR with no compression and 32 bit float channels.  One
+// line per block; the offset table is known up front since every line has
+// the same size.
+bool AovBuffer::saveEXR(const string& fname) const
+{
+	std::ofstream out(ofToDataPath(fname), std::ios::binary);
+	if (!out)
+		return false;
+	put32(out, 20000630);		// magic
+	put32(out, 2);				// version 2, single part scanline
+
+	int32_t chlistSize = 1;
+	for (auto& c : channels)
+		chlistSize += c.name.size() + 1 + 16;
+	attribute(out, "channels", "chlist", chlistSize);
+	for (auto& c : channels)
+	{
+		out.write(c.name.c_str(), c.name.size() + 1);
+		put32(out, 2);			// FLOAT
+		put32(out, 0);			// pLinear and reserved
+		put32(out, 1);			// x sampling
+		put32(out, 1);			// y sampling
+	}
+	out.put(0);
+	attribute(out, "compression", "compression", 1);
+	out.put(0);					// NO_COMPRESSION
+	attribute(out, "dataWindow", "box2i", 16);
+	put32(out, 0); put32(out, 0); put32(out, width - 1); put32(out, height - 1);
+	attribute(out, "displayWindow", "box2i", 16);
+	put32(out, 0); put32(out, 0); put32(out, width - 1); put32(out, height - 1);
+	attribute(out, "lineOrder", "lineOrder", 1);
+	out.put(0);					// INCREASING_Y
+	attribute(out, "pixelAspectRatio", "float", 4);
+	putFloat(out, 1);
+	attribute(out, "screenWindowCenter", "v2f", 8);
+	putFloat(out, 0); putFloat(out, 0);
+	attribute(out, "screenWindowWidth", "float", 4);
+	putFloat(out, 1);
+	out.put(0);					// end of header
+
+	uint64_t lineBytes = (uint64_t)width * channels.size() * sizeof(float);
+	uint64_t offset = (uint64_t)out.tellp() + height * sizeof(uint64_t);
+	for (int y = 0; y < height; y++)
+	{
+		out.write((const char*)&offset, 8);
+		offset += 8 + lineBytes;
+	}
+
+	// EXR rows go top down, ours bottom up
+	for (int y = 0; y < height; y++)
+	{
+		int row = height - 1 - y;
+		put32(out, y);
+		put32(out, lineBytes);
+		for (auto& c : channels)
+			out.write((const char*)&c.data[(size_t)row * width], width * sizeof(float));
+	}
+	return (bool)out;
+}
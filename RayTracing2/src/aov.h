@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include "ofMain.h"
+
+//  Per hit shading components that shade() reports for the AOV buffer
+//
+struct ShadeComponents {
+	glm::vec3 diffuse = glm::vec3(0);	// lambert + ambient, [0, 1] per light
+	glm::vec3 specular = glm::vec3(0);	// phong highlights + mirror reflection
+	float shadow = 1;					// mean light visibility, 0 = fully shadowed
+};
+
+//  Arbitrary output variables of a render, kept as named float channels
+//  (structure of arrays, like GBuffer) so compositors can relight and grade
+//  without tracing the scene again.
+//  Pixel i = y * width + x, row 0 is the bottom of the image.
+//
+//  Channels (OpenEXR naming): R G B A beauty, Z camera distance, N.X N.Y N.Z
+//  world normal, id object index + 1 (0 = background), diffuse.R/G/B,
+//  specular.R/G/B and shadow.
+//
+class AovBuffer {
+public:
+	void allocate(int width, int height);
+	void set(int i, const glm::vec3& color, float depth, const glm::vec3& normal, int objectId, const ShadeComponents& c);
+
+	// .exr: one uncompressed multi-channel file, anything else: a PFM per pass
+	// named <base>_<pass>.pfm
+	bool save(const string& fname) const;
+
+	struct Channel {
+		string name;
+		vector<float> data;
+	};
+	vector<Channel> channels;		// sorted by name, as EXR requires
+	int width = 0, height = 0;
+
+protected:
+	float* channel(const string& name);
+	bool saveEXR(const string& fname) const;
+	bool savePFM(const string& fname, const vector<const Channel*>& pass) const;
+
+	// cached channel pointers for set()
+	float *r, *g, *b, *a, *z, *nx, *ny, *nz, *id, *dr, *dg, *db, *sr, *sg, *sb, *shadow;
+};
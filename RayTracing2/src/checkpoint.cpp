@@ -0,0 +1,144 @@
+#include "checkpoint.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+static const char checkpointMagic[4] = { 'R', 'C', 'K', '1' };
+static const size_t pageSize = 65536;		// covers the page and allocation granularity everywhere
+
+/*
+ * Map a checkpoint file.  An existing file is kept if it belongs to the same
+ * scene and snapshot size, else it is reset.
+ *
+ * @param const string& fname - checkpoint file, relative to the data folder
+ * @param uint64_t sceneHash - hash of everything that affects the render
+ * @param size_t snapshotBytes - size of one snapshot
+ * @return bool - false if the file could not be created or mapped
+ */
+bool RenderCheckpoint::open(const string& fname, uint64_t sceneHash, size_t snapshotBytes)
+{
+	close();
+	fileName = fname;
+	slotOffset = pageSize;
+	slotBytes = (snapshotBytes + pageSize - 1) / pageSize * pageSize;
+	mappedBytes = slotOffset + 2 * slotBytes;
+	string path = ofToDataPath(fname);
+
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		file = NULL;
+		cout << "could not open checkpoint " << fname << endl;
+		return false;
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)mappedBytes >> 32), (DWORD)mappedBytes, NULL);
+	if (mapping != NULL)
+		base = (char*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, mappedBytes);
+#else
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		cout << "could not open checkpoint " << fname << endl;
+		return false;
+	}
+	// growing the file leaves the new part zero, which reads as no snapshot
+	if (lseek(fd, 0, SEEK_END) < (off_t)mappedBytes && ftruncate(fd, mappedBytes) != 0)
+	{
+		close();
+		return false;
+	}
+	void* p = mmap(NULL, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p != MAP_FAILED)
+		base = (char*)p;
+#endif
+	if (base == NULL)
+	{
+		cout << "could not map checkpoint " << fname << endl;
+		close();
+		return false;
+	}
+
+	Header* h = header();
+	if (memcmp(h->magic, checkpointMagic, 4) != 0 || h->version != 1 || h->sceneHash != sceneHash
+		|| h->snapshotBytes != snapshotBytes || h->current < -1 || h->current > 1)
+	{
+		memcpy(h->magic, checkpointMagic, 4);
+		h->version = 1;
+		h->sceneHash = sceneHash;
+		h->snapshotBytes = snapshotBytes;
+		h->current = -1;
+		h->commits = 0;
+		flush(base, sizeof(Header));
+	}
+	lastCommit = ofGetElapsedTimef();
+	return true;
+}
+
+const char* RenderCheckpoint::current() const
+{
+	if (base == NULL || header()->current < 0)
+		return NULL;
+	return slot(header()->current);
+}
+
+char* RenderCheckpoint::next()
+{
+	return slot(header()->current == 0 ? 1 : 0);
+}
+
+// the snapshot has to be on disk before the header points at it
+void RenderCheckpoint::commit()
+{
+	Header* h = header();
+	int slotIndex = h->current == 0 ? 1 : 0;
+	flush(slot(slotIndex), h->snapshotBytes);
+	h->current = slotIndex;
+	h->commits++;
+	flush(base, sizeof(Header));
+	lastCommit = ofGetElapsedTimef();
+}
+
+void RenderCheckpoint::flush(void* p, size_t bytes)
+{
+#ifdef _WIN32
+	FlushViewOfFile(p, bytes);
+	FlushFileBuffers(file);
+#else
+	// msync needs a page aligned start; slots and the header are
+	size_t page = sysconf(_SC_PAGESIZE);
+	char* start = (char*)((uintptr_t)p / page * page);
+	msync(start, (char*)p + bytes - start, MS_SYNC);
+#endif
+}
+
+void RenderCheckpoint::close()
+{
+#ifdef _WIN32
+	if (base != NULL)
+		UnmapViewOfFile(base);
+	if (mapping != NULL)
+		CloseHandle(mapping);
+	if (file != NULL)
+		CloseHandle(file);
+	mapping = file = NULL;
+#else
+	if (base != NULL)
+		munmap(base, mappedBytes);
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+#endif
+	base = NULL;
+}
+
+void RenderCheckpoint::remove()
+{
+	close();
+	if (!fileName.empty())
+		ofFile::removeFile(fileName);
+}
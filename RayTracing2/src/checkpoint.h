@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include "ofMain.h"
+
+//  Progress of a long render in a memory mapped file, so a render that is
+//  killed (e.g. a preempted spot instance) continues where it left off
+//  instead of starting over.
+//
+//  The file holds a header and two snapshot slots.  A snapshot is written
+//  into the slot the header does not point at, flushed to disk, and only
+//  then made current by flipping the header, so a kill at any moment leaves
+//  the last complete snapshot intact.  The scene hash in the header keeps a
+//  checkpoint from being resumed into a different scene or settings.
+//
+class RenderCheckpoint {
+public:
+	~RenderCheckpoint() { close(); }
+
+	// map the checkpoint file, creating it if needed; returns false if it can't be mapped
+	bool open(const string& fname, uint64_t sceneHash, size_t snapshotBytes);
+	const char* current() const;		// last committed snapshot, NULL if there is none
+	char* next();						// slot to write the next snapshot into
+	void commit();						// flush next() and make it current
+	void close();
+	void remove();						// close and delete the file once the render is done
+
+	bool isOpen() const { return base != NULL; }
+	bool due(float seconds) const { return ofGetElapsedTimef() - lastCommit >= seconds; }
+
+protected:
+	struct Header {
+		char magic[4];
+		uint32_t version;
+		uint64_t sceneHash;
+		uint64_t snapshotBytes;
+		int32_t current;				// slot of the last committed snapshot, -1 = none
+		uint32_t commits;
+	};
+	Header* header() const { return (Header*)base; }
+	char* slot(int i) const { return base + slotOffset + i * slotBytes; }
+	void flush(void* p, size_t bytes);
+
+	char* base = NULL;
+	size_t mappedBytes = 0;
+	size_t slotOffset = 0, slotBytes = 0;	// page aligned so slots can be flushed on their own
+	string fileName;
+	float lastCommit = 0;
+#ifdef _WIN32
+	void* file = NULL;
+	void* mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+// 64 bit FNV-1a hash, for scene hashes
+inline void hashBytes(uint64_t& h, const void* data, size_t size)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++)
+		h = (h ^ p[i]) * 1099511628211ull;
+}
+template<typename T> inline void hashValue(uint64_t& h, const T& v) { hashBytes(h, &v, sizeof(T)); }
+const uint64_t hashSeed = 14695981039346656037ull;
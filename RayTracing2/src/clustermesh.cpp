@@ -0,0 +1,662 @@
+#include "clustermesh.h"
+#include "mesh.h"
+
+std::atomic<uint64_t> ClusteredMesh::pageIns(0);
+std::atomic<uint64_t> ClusteredMesh::pageInBytes(0);
+std::atomic<uint64_t> ClusteredMesh::lookups(0);
+
+// cluster file header, followed by the material names, the cluster table and
+// the cluster data
+struct ClusterFileHeader {
+	char magic[4];
+	uint32_t numClusters;
+	uint32_t numMaterials;
+	uint32_t flags;			// 1 = vertex normals, 2 = texture coordinates
+};
+
+static const char clusterFileMagic[4] = { 'C', 'L', 'M', '1' };
+
+size_t MeshCluster::bytes() const
+{
+	return pos.size() * sizeof(glm::vec3) + normal.size() * sizeof(glm::vec3) + uv.size() * sizeof(glm::vec2)
+		+ tri.size() * sizeof(glm::u16vec3) + material.size() * sizeof(uint16_t);
+}
+
+/*
+ * Split a mesh into clusters by recursive median splits of the triangle
+ * centroids along the longest axis, and write them to a cluster file
+ *
+ * Material ids are only valid in this session, so the file refers to
+ * materials by name (and diffuse color for unnamed ones).
+ *
+ * @param Mesh& mesh - loaded mesh, full or compact layout
+ * @param const string& fname - cluster file to write
+ * @param int maxTriangles - triangles per cluster, at most 21845 (16 bit local indices)
+ * @return bool - false if the file could not be written
+ */
+bool ClusteredMesh::build(Mesh& mesh, const string& fname, int maxTriangles)
+{
+	maxTriangles = ofClamp(maxTriangles, 1, 21845);
+	int numTris = mesh.numTriangles();
+	if (numTris == 0)
+		return false;
+	float startTime = ofGetElapsedTimef();
+
+	vector<glm::vec3> centroid(numTris);
+	vector<int> ids(numTris);
+	for (int t = 0; t < numTris; t++)
+	{
+		glm::ivec3 tri = mesh.triangle(t);
+		centroid[t] = (mesh.vertex(tri[0]) + mesh.vertex(tri[1]) + mesh.vertex(tri[2])) / 3.0f;
+		ids[t] = t;
+	}
+
+	// split into ranges of ids of at most maxTriangles
+	vector<pair<int, int>> ranges;
+	vector<pair<int, int>> stack;
+	stack.push_back(make_pair(0, numTris));
+	while (!stack.empty())
+	{
+		pair<int, int> r = stack.back();
+		stack.pop_back();
+		if (r.second - r.first <= maxTriangles)
+		{
+			ranges.push_back(r);
+			continue;
+		}
+		glm::vec3 cmin = centroid[ids[r.first]], cmax = cmin;
+		for (int i = r.first; i < r.second; i++)
+		{
+			cmin = glm::min(cmin, centroid[ids[i]]);
+			cmax = glm::max(cmax, centroid[ids[i]]);
+		}
+		glm::vec3 extent = cmax - cmin;
+		int axis = 0;
+		if (extent.y > extent[axis]) axis = 1;
+		if (extent.z > extent[axis]) axis = 2;
+		int mid = (r.first + r.second) / 2;
+		std::nth_element(ids.begin() + r.first, ids.begin() + mid, ids.begin() + r.second, [&](int a, int b) {
+			return centroid[a][axis] < centroid[b][axis];
+		});
+		stack.push_back(make_pair(r.first, mid));
+		stack.push_back(make_pair(mid, r.second));
+	}
+
+	// materials used by the mesh
+	vector<uint16_t> matIds;
+	map<uint16_t, uint16_t> matIndex;
+	for (int t = 0; t < numTris; t++)
+	{
+		uint16_t m = mesh.tMaterial.empty() ? mesh.materialId : mesh.tMaterial[t];
+		if (matIndex.find(m) == matIndex.end())
+		{
+			matIndex[m] = matIds.size();
+			matIds.push_back(m);
+		}
+	}
+
+	bool hasNormals = !mesh.tNormInd.empty();
+	bool hasUVs = !mesh.tUVInd.empty();
+	ClusterFileHeader header;
+	memcpy(header.magic, clusterFileMagic, 4);
+	header.numClusters = ranges.size();
+	header.numMaterials = matIds.size();
+	header.flags = (hasNormals ? 1 : 0) | (hasUVs ? 2 : 0);
+
+	std::ofstream out(ofToDataPath(fname), std::ios::binary);
+	out.write((const char*)&header, sizeof(header));
+	for (auto m : matIds)
+	{
+		const Material& mat = materials[m];
+		uint32_t len = mat.name.size();
+		out.write((const char*)&len, sizeof(len));
+		out.write(mat.name.data(), len);
+		unsigned char rgb[3] = { mat.diffuse.r, mat.diffuse.g, mat.diffuse.b };
+		out.write((const char*)rgb, 3);
+	}
+	uint64_t tablePos = out.tellp();
+	vector<ClusterInfo> table(ranges.size());
+	out.write((const char*)table.data(), table.size() * sizeof(ClusterInfo));
+
+	for (size_t c = 0; c < ranges.size(); c++)
+	{
+		// local vertices are the distinct (position, normal, uv) corners of the cluster;
+		// a face without vn gets its own corners with the face normal
+		MeshCluster cl;
+		map<tuple<int, int, int>, int> local;
+		for (int i = ranges[c].first; i < ranges[c].second; i++)
+		{
+			int t = ids[i];
+			glm::ivec3 tri = mesh.triangle(t);
+			glm::u16vec3 ltri;
+			for (int k = 0; k < 3; k++)
+			{
+				int vn = hasNormals ? mesh.tNormInd[t][k] : 0;
+				int vt = hasUVs ? mesh.tUVInd[t][k] : 0;
+				if (hasNormals && vn < 0)
+					vn = -1 - t;
+				auto key = make_tuple(tri[k], vn, vt);
+				auto found = local.find(key);
+				if (found == local.end())
+				{
+					found = local.insert(make_pair(key, (int)cl.pos.size())).first;
+					cl.pos.push_back(mesh.vertex(tri[k]));
+					if (hasNormals)
+						cl.normal.push_back(vn >= 0 ? mesh.vertexNormal(vn) : glm::normalize(mesh.faceNormal(t)));
+					if (hasUVs)
+						cl.uv.push_back(vt >= 0 ? mesh.uvs[vt] : glm::vec2(0, 0));
+				}
+				ltri[k] = found->second;
+			}
+			cl.tri.push_back(ltri);
+			cl.material.push_back(matIndex[mesh.tMaterial.empty() ? mesh.materialId : mesh.tMaterial[t]]);
+		}
+
+		ClusterInfo& info = table[c];
+		info.bmin = info.bmax = cl.pos[0];
+		for (auto& p : cl.pos)
+		{
+			info.bmin = glm::min(info.bmin, p);
+			info.bmax = glm::max(info.bmax, p);
+		}
+		info.offset = out.tellp();
+		info.numVerts = cl.pos.size();
+		info.numTris = cl.tri.size();
+		out.write((const char*)cl.pos.data(), cl.pos.size() * sizeof(glm::vec3));
+		out.write((const char*)cl.normal.data(), cl.normal.size() * sizeof(glm::vec3));
+		out.write((const char*)cl.uv.data(), cl.uv.size() * sizeof(glm::vec2));
+		out.write((const char*)cl.tri.data(), cl.tri.size() * sizeof(glm::u16vec3));
+		out.write((const char*)cl.material.data(), cl.material.size() * sizeof(uint16_t));
+	}
+	out.seekp(tablePos);
+	out.write((const char*)table.data(), table.size() * sizeof(ClusterInfo));
+	if (!out)
+	{
+		cout << "could not write cluster file " << fname << endl;
+		return false;
+	}
+	cout << "wrote " << ranges.size() << " clusters of " << numTris << " triangles to " << fname
+		<< " in " << ofGetElapsedTimef() - startTime << " seconds" << endl;
+	return true;
+}
+
+/*
+ * Convert an .obj file to a cluster file
+ *
+ * @param const string& objFile - mesh file in the data folder
+ * @param const string& fname - cluster file to write
+ * @param int maxTriangles - triangles per cluster
+ * @return bool - false if the mesh has no triangles or the file could not be written
+ */
+bool ClusteredMesh::build(const string& objFile, const string& fname, int maxTriangles)
+{
+	if (!ofFile::doesFileExist(objFile))
+	{
+		cout << "could not open mesh file " << objFile << endl;
+		return false;
+	}
+	Mesh mesh(glm::vec3(0, 0, 0), objFile.c_str(), materials[0].diffuse);
+	mesh.printStats();
+	return build(mesh, fname, maxTriangles);
+}
+
+/*
+ * Open a cluster file written by build(), reading only the cluster table
+ *
+ * @param const string& clusterFile - cluster file in the data folder
+ */
+ClusteredMesh::ClusteredMesh(const string& clusterFile)
+{
+	fileName = ofToDataPath(clusterFile);
+	stream.open(fileName, std::ios::binary);
+	ClusterFileHeader header;
+	if (!stream.read((char*)&header, sizeof(header)) || memcmp(header.magic, clusterFileMagic, 4) != 0)
+	{
+		cout << "could not read cluster file " << clusterFile << endl;
+		return;
+	}
+	hasNormals = header.flags & 1;
+	hasUVs = header.flags & 2;
+
+	// map the file's materials to this session's ids
+	vector<uint16_t> matIds(header.numMaterials);
+	for (uint32_t m = 0; m < header.numMaterials; m++)
+	{
+		uint32_t len = 0;
+		stream.read((char*)&len, sizeof(len));
+		string name(len, ' ');
+		stream.read(&name[0], len);
+		unsigned char rgb[3];
+		stream.read((char*)rgb, 3);
+		int id = name.empty() ? -1 : materials.find(name);
+		matIds[m] = id >= 0 ? id : materials.fromColor(ofColor(rgb[0], rgb[1], rgb[2]));
+	}
+	materialMap = matIds;
+
+	clusters.resize(header.numClusters);
+	stream.read((char*)clusters.data(), clusters.size() * sizeof(ClusterInfo));
+	if (!stream)
+	{
+		cout << "truncated cluster file " << clusterFile << endl;
+		clusters.clear();
+		return;
+	}
+	// primitives are triangle numbers in the whole mesh, they have to fit an int
+	firstTri.resize(clusters.size());
+	int64_t numTris = 0;
+	for (size_t i = 0; i < clusters.size(); i++)
+	{
+		firstTri[i] = numTris;
+		numTris += clusters[i].numTris;
+	}
+	if (numTris > std::numeric_limits<int>::max())
+	{
+		cout << "cluster file " << clusterFile << " has too many triangles (" << numTris << ")" << endl;
+		clusters.clear();
+		return;
+	}
+	resident.resize(clusters.size());
+	lruPos.resize(clusters.size());
+	bmin = clusters[0].bmin;
+	bmax = clusters[0].bmax;
+	for (auto& c : clusters)
+	{
+		bmin = glm::min(bmin, c.bmin);
+		bmax = glm::max(bmax, c.bmax);
+	}
+	vector<int> ids(clusters.size());
+	for (size_t i = 0; i < ids.size(); i++)
+		ids[i] = i;
+	nodes.reserve(2 * clusters.size());
+	buildNode(ids, 0, ids.size());
+	position = (bmin + bmax) * 0.5f;
+	if (!matIds.empty())
+		materialId = matIds[0];
+}
+
+// return a cluster from the cache, reading it from the file on a miss
+std::shared_ptr<const MeshCluster> ClusteredMesh::getCluster(int i)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	lookups++;
+	if (resident[i] != NULL)
+	{
+		lru.splice(lru.begin(), lru, lruPos[i]);
+		return resident[i];
+	}
+
+	const ClusterInfo& info = clusters[i];
+	std::shared_ptr<MeshCluster> c(new MeshCluster());
+	c->pos.resize(info.numVerts);
+	if (hasNormals)
+		c->normal.resize(info.numVerts);
+	if (hasUVs)
+		c->uv.resize(info.numVerts);
+	c->tri.resize(info.numTris);
+	c->material.resize(info.numTris);
+	stream.clear();
+	stream.seekg(info.offset);
+	stream.read((char*)c->pos.data(), c->pos.size() * sizeof(glm::vec3));
+	stream.read((char*)c->normal.data(), c->normal.size() * sizeof(glm::vec3));
+	stream.read((char*)c->uv.data(), c->uv.size() * sizeof(glm::vec2));
+	stream.read((char*)c->tri.data(), c->tri.size() * sizeof(glm::u16vec3));
+	stream.read((char*)c->material.data(), c->material.size() * sizeof(uint16_t));
+	for (auto& m : c->material)
+		m = m < materialMap.size() ? materialMap[m] : materialId;
+
+	size_t bytes = c->bytes();
+	pageIns++;
+	pageInBytes += bytes;
+	resident[i] = c;
+	lru.push_front(i);
+	lruPos[i] = lru.begin();
+	residentBytes += bytes;
+
+	// evict least recently used clusters, threads still using one keep it
+	// alive through their shared_ptr
+	while (residentBytes > cacheBytes && lru.size() > 1)
+	{
+		int old = lru.back();
+		lru.pop_back();
+		residentBytes -= resident[old]->bytes();
+		resident[old] = NULL;
+	}
+	return c;
+}
+
+// node of the hierarchy over clusters ids[begin, end), median split along
+// the longest axis like SceneBVH; returns its index
+int ClusteredMesh::buildNode(vector<int>& ids, int begin, int end)
+{
+	int index = nodes.size();
+	nodes.push_back(SceneNode());
+
+	SceneNode node;
+	node.bmin = clusters[ids[begin]].bmin;
+	node.bmax = clusters[ids[begin]].bmax;
+	for (int i = begin; i < end; i++)
+	{
+		node.bmin = glm::min(node.bmin, clusters[ids[i]].bmin);
+		node.bmax = glm::max(node.bmax, clusters[ids[i]].bmax);
+	}
+	if (end - begin == 1)
+		node.object = ids[begin];
+	else
+	{
+		glm::vec3 extent = node.bmax - node.bmin;
+		int axis = 0;
+		if (extent.y > extent[axis]) axis = 1;
+		if (extent.z > extent[axis]) axis = 2;
+		int mid = (begin + end) / 2;
+		std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end, [&](int a, int b) {
+			return clusters[a].bmin[axis] + clusters[a].bmax[axis] < clusters[b].bmin[axis] + clusters[b].bmax[axis];
+		});
+		node.left = buildNode(ids, begin, mid);
+		node.right = buildNode(ids, mid, end);
+	}
+	nodes[index] = node;
+	return index;
+}
+
+// clusters whose bounds the ray enters before tMax, nearest first
+void ClusteredMesh::clustersAlong(const Ray& ray, float tMax, vector<pair<float, int>>& order)
+{
+	order.clear();
+	if (nodes.empty())
+		return;
+	int stack[64];		// median splits keep the depth at log2(clusters)
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const SceneNode& node = nodes[stack[--top]];
+		float tEnter;
+		if (!rayBox(ray, node.bmin, node.bmax, tEnter) || tEnter > tMax)
+			continue;
+		if (node.object >= 0)
+			order.push_back(make_pair(tEnter, node.object));
+		else
+		{
+			stack[top++] = node.left;
+			stack[top++] = node.right;
+		}
+	}
+	std::sort(order.begin(), order.end());
+}
+
+// slab test, tEnter is clamped to 0 for rays starting inside the box
+bool ClusteredMesh::rayBox(const Ray& ray, const glm::vec3& bmin, const glm::vec3& bmax, float& tEnter)
+{
+	float t0 = 0, t1 = std::numeric_limits<float>::max();
+	for (int k = 0; k < 3; k++)
+	{
+		float inv = 1 / ray.d[k];
+		float tNear = (bmin[k] - ray.p[k]) * inv;
+		float tFar = (bmax[k] - ray.p[k]) * inv;
+		if (tNear > tFar)
+			std::swap(tNear, tFar);
+		t0 = std::max(t0, tNear);
+		t1 = std::min(t1, tFar);
+		if (t0 > t1)
+			return false;
+	}
+	tEnter = t0;
+	return true;
+}
+
+// closest hit in front of the ray among the cluster's triangles (Cramer's rule, as in Mesh)
+bool ClusteredMesh::intersectCluster(const MeshCluster& c, const Ray& ray, float& tBest, int& triBest,
+	float& betaBest, float& gammaBest)
+{
+	bool hit = false;
+	for (size_t i = 0; i < c.tri.size(); i++)
+	{
+		glm::vec3 v0 = c.pos[c.tri[i][0]];
+		glm::vec3 v1 = c.pos[c.tri[i][1]];
+		glm::vec3 v2 = c.pos[c.tri[i][2]];
+		glm::vec3 c0 = v0 - v1;
+		glm::vec3 c1 = v0 - v2;
+		glm::vec3 c3 = v0 - ray.p;
+		float dt = calcDet3x3(c0, c1, ray.d);
+		if (dt == 0)
+			continue;
+		float beta = calcDet3x3(c3, c1, ray.d) / dt;
+		float gamma = calcDet3x3(c0, c3, ray.d) / dt;
+		if (beta < 0 || gamma < 0 || beta + gamma > 1)
+			continue;
+		float t = calcDet3x3(c0, c1, c3) / dt;
+		if (t > 0 && t < tBest)
+		{
+			tBest = t;
+			triBest = i;
+			betaBest = beta;
+			gammaBest = gamma;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+// position, shading normal and material of a triangle hit
+void ClusteredMesh::hitInfo(const MeshCluster& c, int tri, float beta, float gamma, const Ray& ray, float t,
+	glm::vec3& point, glm::vec3& normal, uint16_t& material)
+{
+	glm::vec3 v0 = c.pos[c.tri[tri][0]];
+	glm::vec3 v1 = c.pos[c.tri[tri][1]];
+	glm::vec3 v2 = c.pos[c.tri[tri][2]];
+	point = v0 + beta * (v1 - v0) + gamma * (v2 - v0);
+	normal = glm::cross(v1 - v0, v2 - v1);
+	if (!c.normal.empty())
+	{
+		glm::vec3 n = (1 - beta - gamma) * c.normal[c.tri[tri][0]] + beta * c.normal[c.tri[tri][1]]
+			+ gamma * c.normal[c.tri[tri][2]];
+		if (glm::length(n) > 0)
+			normal = glm::dot(n, normal) < 0 ? -glm::normalize(n) : glm::normalize(n);
+	}
+	material = c.material[tri];
+}
+
+bool ClusteredMesh::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal)
+{
+	uint16_t material;
+	int primitive;
+	return intersect(ray, point, normal, material, primitive);
+}
+
+/*
+ * Intersect a single ray, walking the cluster hierarchy nearer child first
+ * and skipping clusters that start beyond the closest hit so far
+ *
+ * @param const Ray& worldRay - given ray, in world space
+ * @param glm::vec3& point - point of intersection
+ * @param glm::vec3& normal - normal at the intersection
+ * @param uint16_t& material - material of the hit triangle
+ * @param int& primitive - index of the hit triangle in the whole mesh
+ * @return bool - true if the ray hits the mesh
+ */
+bool ClusteredMesh::intersect(const Ray& worldRay, glm::vec3& point, glm::vec3& normal, uint16_t& material, int& primitive)
+{
+	if (nodes.empty())
+		return false;
+	Ray ray(worldRay.p - offset, worldRay.d);
+	float tBest = std::numeric_limits<float>::max();
+	int clusterBest = -1, triBest = 0;
+	float beta = 0, gamma = 0;
+	std::shared_ptr<const MeshCluster> best;
+
+	pair<float, int> stack[64];		// entry distance, node
+	int top = 0;
+	float tEnter;
+	if (rayBox(ray, nodes[0].bmin, nodes[0].bmax, tEnter))
+		stack[top++] = make_pair(tEnter, 0);
+	while (top > 0)
+	{
+		pair<float, int> entry = stack[--top];
+		if (entry.first > tBest)
+			continue;		// behind the closest hit
+		const SceneNode& node = nodes[entry.second];
+		if (node.object >= 0)
+		{
+			std::shared_ptr<const MeshCluster> c = getCluster(node.object);
+			if (intersectCluster(*c, ray, tBest, triBest, beta, gamma))
+			{
+				clusterBest = node.object;
+				best = c;
+			}
+			continue;
+		}
+		float tl, tr;
+		bool hitLeft = rayBox(ray, nodes[node.left].bmin, nodes[node.left].bmax, tl) && tl <= tBest;
+		bool hitRight = rayBox(ray, nodes[node.right].bmin, nodes[node.right].bmax, tr) && tr <= tBest;
+		if (hitLeft && hitRight && tl > tr)
+		{
+			stack[top++] = make_pair(tl, node.left);
+			stack[top++] = make_pair(tr, node.right);		// popped first
+		}
+		else
+		{
+			if (hitRight) stack[top++] = make_pair(tr, node.right);
+			if (hitLeft) stack[top++] = make_pair(tl, node.left);
+		}
+	}
+	if (clusterBest < 0)
+		return false;
+	hitInfo(*best, triBest, beta, gamma, ray, tBest, point, normal, material);
+	point += offset;
+	primitive = firstTri[clusterBest] + triBest;
+	return true;
+}
+
+/*
+ * Intersect many rays, queuing them by cluster so each cluster is paged in
+ * once per wave: wave k tests every ray against the k-th cluster along it
+ * (unless that cluster starts beyond the ray's closest hit so far).
+ *
+ * @param const vector<Ray>& worldRays - rays to trace
+ * @param vector<PrimaryHit>& hits - updated where this mesh is closer than the current hit
+ */
+void ClusteredMesh::intersectBatch(const vector<Ray>& worldRays, vector<PrimaryHit>& hits)
+{
+	size_t n = worldRays.size();
+	vector<Ray> rays;
+	rays.reserve(n);
+	for (auto& ray : worldRays)
+		rays.push_back(Ray(ray.p - offset, ray.d));
+	vector<vector<pair<float, int>>> order(n);
+	vector<float> tBest(n);
+	for (size_t r = 0; r < n; r++)
+	{
+		// an existing hit on another object bounds the search
+		tBest[r] = std::numeric_limits<float>::max();
+		if (hits[r].object != NULL)
+			tBest[r] = glm::length(hits[r].pos - worldRays[r].p) / glm::length(rays[r].d);
+		clustersAlong(rays[r], tBest[r], order[r]);
+	}
+
+	vector<int> clusterBest(n, -1), triBest(n, 0);
+	vector<float> beta(n, 0), gamma(n, 0);
+	vector<vector<int>> queue(clusters.size());
+	for (size_t wave = 0; ; wave++)
+	{
+		bool any = false;
+		for (size_t r = 0; r < n; r++)
+			if (wave < order[r].size() && order[r][wave].first <= tBest[r])
+			{
+				queue[order[r][wave].second].push_back(r);
+				any = true;
+			}
+		if (!any)
+			break;
+		for (size_t i = 0; i < clusters.size(); i++)
+		{
+			if (queue[i].empty())
+				continue;
+			std::shared_ptr<const MeshCluster> c = getCluster(i);
+			for (int r : queue[i])
+				if (intersectCluster(*c, rays[r], tBest[r], triBest[r], beta[r], gamma[r]))
+					clusterBest[r] = i;
+			queue[i].clear();
+		}
+	}
+
+	for (size_t r = 0; r < n; r++)
+	{
+		if (clusterBest[r] < 0)
+			continue;
+		std::shared_ptr<const MeshCluster> c = getCluster(clusterBest[r]);
+		PrimaryHit& hit = hits[r];
+		hitInfo(*c, triBest[r], beta[r], gamma[r], rays[r], tBest[r], hit.pos, hit.norm, hit.material);
+		hit.pos += offset;
+		hit.object = this;
+		hit.primitive = firstTri[clusterBest[r]] + triBest[r];
+	}
+}
+
+// texture coordinates on a hit triangle, interpolated like Mesh::getUV
+bool ClusteredMesh::getUV(const glm::vec3& point, int primitive, glm::vec2& uv, float& uvPerUnit)
+{
+	if (!hasUVs || primitive < 0 || clusters.empty())
+		return false;
+	int cluster = std::upper_bound(firstTri.begin(), firstTri.end(), primitive) - firstTri.begin() - 1;
+	std::shared_ptr<const MeshCluster> c = getCluster(cluster);
+	glm::u16vec3 tri = c->tri[primitive - firstTri[cluster]];
+	glm::vec3 v0 = c->pos[tri[0]];
+	glm::vec3 e1 = c->pos[tri[1]] - v0;
+	glm::vec3 e2 = c->pos[tri[2]] - v0;
+	glm::vec3 d = point - offset - v0;
+	float d11 = glm::dot(e1, e1), d12 = glm::dot(e1, e2), d22 = glm::dot(e2, e2);
+	float d1 = glm::dot(d, e1), d2 = glm::dot(d, e2);
+	float denom = d11 * d22 - d12 * d12;
+	if (denom == 0)
+		return false;
+	float beta = (d22 * d1 - d12 * d2) / denom;
+	float gamma = (d11 * d2 - d12 * d1) / denom;
+
+	glm::vec2 t0 = c->uv[tri[0]], t1 = c->uv[tri[1]], t2 = c->uv[tri[2]];
+	uv = (1 - beta - gamma) * t0 + beta * t1 + gamma * t2;
+	glm::vec2 u1 = t1 - t0, u2 = t2 - t0;
+	float uvArea = fabs(u1.x * u2.y - u1.y * u2.x);
+	float worldArea = glm::length(glm::cross(e1, e2));
+	uvPerUnit = worldArea > 0 ? sqrt(uvArea / worldArea) : 0;
+	return true;
+}
+
+bool ClusteredMesh::getBounds(glm::vec3& bmin, glm::vec3& bmax)
+{
+	if (clusters.empty())
+		return false;
+	bmin = this->bmin + offset;
+	bmax = this->bmax + offset;
+	return true;
+}
+
+void ClusteredMesh::setPosition(const glm::vec3& p)
+{
+	offset += p - position;
+	position = p;
+}
+
+void ClusteredMesh::draw()
+{
+	ofPushStyle();
+	ofNoFill();
+	for (auto& c : clusters)
+	{
+		glm::vec3 size = c.bmax - c.bmin;
+		ofDrawBox((c.bmin + c.bmax) * 0.5f + offset, size.x, size.y, size.z);
+	}
+	ofPopStyle();
+}
+
+void ClusteredMesh::resetStats()
+{
+	pageIns = pageInBytes = lookups = 0;
+}
+
+void ClusteredMesh::printStats()
+{
+	if (lookups == 0)
+		return;
+	cout << "mesh clusters: " << lookups << " lookups, " << pageIns << " paged in ("
+		<< pageInBytes / (1024.0 * 1024.0) << " MB)" << endl;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <glm/gtc/type_precision.hpp>
+#include "ofApp.h"
+#include "scenebvh.h"
+
+class Mesh;
+
+//  Geometry of one cluster, in its own local vertex numbering
+//
+struct MeshCluster {
+	vector<glm::vec3> pos;
+	vector<glm::vec3> normal;		// empty if the mesh has no vertex normals
+	vector<glm::vec2> uv;			// empty if the mesh has no texture coordinates
+	vector<glm::u16vec3> tri;
+	vector<uint16_t> material;		// per triangle
+	size_t bytes() const;
+};
+
+//  Entry of the cluster table at the start of a cluster file
+//
+struct ClusterInfo {
+	glm::vec3 bmin, bmax;
+	uint64_t offset;				// file position of the cluster data
+	uint32_t numVerts, numTris;
+};
+
+//  Mesh that is too large to keep in memory
+//
+//  The triangles are split into spatially coherent clusters stored in a file
+//  (see build(), or run the app with --cluster in.obj out.clm).  Only the
+//  cluster table with the bounds of each cluster is resident, with a
+//  hierarchy over those bounds so a ray only looks at the clusters it
+//  passes through; cluster geometry is paged in through a bounded LRU cache
+//  when a ray enters its bounds.  Rays visit clusters front to back and stop
+//  at the first cluster beyond their closest hit, so hidden geometry is not
+//  loaded.  intersectBatch() queues camera rays by cluster, so each cluster
+//  is read at most once per wave of rays instead of once per ray.
+//
+//  Moving the mesh only changes an offset: rays are moved into the file's
+//  space instead of touching the clusters, which may not even be loaded.
+//
+//  The primitive of a hit is the triangle's index in the whole mesh, which
+//  holds any mesh build() can write; getUV() finds the cluster again from
+//  the first triangle of every cluster.
+//
+class ClusteredMesh : public SceneObject {
+public:
+	ClusteredMesh(const string& clusterFile);
+
+	// split a loaded mesh into clusters of at most maxTriangles and write them to a file
+	static bool build(Mesh& mesh, const string& fname, int maxTriangles = 4096);
+	// same for an .obj file, which only needs to fit in memory while it is converted
+	static bool build(const string& objFile, const string& fname, int maxTriangles = 4096);
+
+	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal);
+	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal, uint16_t& material, int& primitive);
+	void intersectBatch(const vector<Ray>& rays, vector<PrimaryHit>& hits);
+	bool wantsBatches() { return true; }
+	bool getUV(const glm::vec3& point, int primitive, glm::vec2& uv, float& uvPerUnit);
+	bool getBounds(glm::vec3& bmin, glm::vec3& bmax);
+	void setPosition(const glm::vec3& p);	// translate, the clusters stay as they are in the file
+	void draw();		// cluster bounds only, drawing the triangles would page in everything
+
+	bool isLoaded() { return !clusters.empty(); }
+	const string& getFileName() { return fileName; }
+	size_t cacheBytes = 512 * 1024 * 1024;	// memory cap of the cluster cache
+
+	// page-in statistics over all clustered meshes since the last reset
+	static void resetStats();
+	static void printStats();
+	static std::atomic<uint64_t> pageIns, pageInBytes, lookups;
+
+protected:
+	std::shared_ptr<const MeshCluster> getCluster(int i);
+	int buildNode(vector<int>& ids, int begin, int end);
+	void clustersAlong(const Ray& ray, float tMax, vector<pair<float, int>>& order);
+	bool intersectCluster(const MeshCluster& c, const Ray& ray, float& tBest, int& triBest, float& beta, float& gamma);
+	void hitInfo(const MeshCluster& c, int tri, float beta, float gamma, const Ray& ray, float t,
+				 glm::vec3& point, glm::vec3& normal, uint16_t& material);
+	bool rayBox(const Ray& ray, const glm::vec3& bmin, const glm::vec3& bmax, float& tEnter);
+
+	string fileName;
+	std::ifstream stream;
+	bool hasNormals = false, hasUVs = false;
+	vector<uint16_t> materialMap;	// material index in the file to material id
+	vector<ClusterInfo> clusters;
+	vector<int> firstTri;			// index in the whole mesh of each cluster's first triangle
+	vector<SceneNode> nodes;		// hierarchy over the cluster bounds, leaves hold a cluster
+	glm::vec3 bmin, bmax;			// in file space, like the clusters and nodes
+	glm::vec3 offset = glm::vec3(0, 0, 0);	// file space to world, rays are moved back by it
+
+	// LRU cache, most recently used cluster at the front
+	vector<std::shared_ptr<const MeshCluster>> resident;	// indexed by cluster, NULL if not loaded
+	vector<list<int>::iterator> lruPos;
+	list<int> lru;
+	size_t residentBytes = 0;
+	std::mutex mutex;
+};
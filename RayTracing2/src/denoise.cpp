@@ -0,0 +1,187 @@
+#include <thread>
+#include "denoise.h"
+
+void GBuffer::allocate(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	size_t n = width * height;
+	nx.resize(n); ny.resize(n); nz.resize(n);
+	depth.resize(n);
+	ar.resize(n); ag.resize(n); ab.resize(n);
+	clear();
+}
+
+// background pixels have no normal, zero depth and unit albedo (so they are not demodulated)
+void GBuffer::clear()
+{
+	std::fill(nx.begin(), nx.end(), 0.0f);
+	std::fill(ny.begin(), ny.end(), 0.0f);
+	std::fill(nz.begin(), nz.end(), 0.0f);
+	std::fill(depth.begin(), depth.end(), 0.0f);
+	std::fill(ar.begin(), ar.end(), 1.0f);
+	std::fill(ag.begin(), ag.end(), 1.0f);
+	std::fill(ab.begin(), ab.end(), 1.0f);
+}
+
+void GBuffer::set(int i, const glm::vec3& normal, float depth, const glm::vec3& albedo)
+{
+	nx[i] = normal.x; ny[i] = normal.y; nz[i] = normal.z;
+	this->depth[i] = depth;
+	ar[i] = albedo.x; ag[i] = albedo.y; ab[i] = albedo.z;
+}
+
+// exp(x) for x <= 0 as (1 + x/256)^256; branch free so the filter loop vectorizes
+static inline float fastExpNeg(float x)
+{
+	float t = std::max(1.0f + x * (1.0f / 256), 0.0f);
+	t *= t; t *= t; t *= t; t *= t;
+	t *= t; t *= t; t *= t; t *= t;
+	return t;
+}
+
+/*
+ * Denoise a color buffer using the guide buffers from the primary hits
+ *
+ * @param const vector<glm::vec3>& color - noisy image, one color per pixel
+ * @param const GBuffer& guide - normal, depth and albedo of the same size
+ * @param vector<glm::vec3>& result - filtered image (may be the same as color)
+ */
+void Denoiser::denoise(const vector<glm::vec3>& color, const GBuffer& guide, vector<glm::vec3>& result)
+{
+	uint64_t start = ofGetElapsedTimeMicros();
+	this->guide = &guide;
+	width = guide.width;
+	height = guide.height;
+	size_t n = width * height;
+	inR.resize(n); inG.resize(n); inB.resize(n);
+	outR.resize(n); outG.resize(n); outB.resize(n);
+
+	// demodulate albedo, the filter works on irradiance
+	for (size_t i = 0; i < n; i++)
+	{
+		inR[i] = color[i].x / std::max(guide.ar[i], 0.001f);
+		inG[i] = color[i].y / std::max(guide.ag[i], 0.001f);
+		inB[i] = color[i].z / std::max(guide.ab[i], 0.001f);
+	}
+
+	int nThreads = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+	nThreads = std::min(nThreads, height);
+	float sigmaC = sigmaColor;
+	for (int it = 0; it < iterations; it++)
+	{
+		int step = 1 << it;
+		vector<std::thread> threads;
+		for (int t = 1; t < nThreads; t++)
+			threads.push_back(std::thread(&Denoiser::filterRows, this,
+				height * t / nThreads, height * (t + 1) / nThreads, step, sigmaC));
+		filterRows(0, height / nThreads, step, sigmaC);
+		for (auto& t : threads)
+			t.join();
+
+		inR.swap(outR); inG.swap(outG); inB.swap(outB);
+		sigmaC *= 0.5;	// finer color tolerance as the taps get further apart
+	}
+
+	// remodulate albedo
+	result.resize(n);
+	for (size_t i = 0; i < n; i++)
+		result[i] = glm::vec3(inR[i] * guide.ar[i], inG[i] * guide.ag[i], inB[i] * guide.ab[i]);
+
+	lastTime = (ofGetElapsedTimeMicros() - start) / 1000.0;
+}
+
+// one a-trous pass over rows [y0, y1) reading in*, writing out*
+//
+// The taps are looped outermost and the pixels of a row innermost, so each
+// inner loop reads contiguous memory with no branches and vectorizes.
+//
+void Denoiser::filterRows(int y0, int y1, int step, float sigmaC)
+{
+	static const float h[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+	const float invSigmaC2 = 1.0f / (sigmaC * sigmaC);
+	const float sigmaN = sigmaNormal;
+	const float invSigmaZ = 1.0f / sigmaDepth;
+	const float* nx = guide->nx.data();
+	const float* ny = guide->ny.data();
+	const float* nz = guide->nz.data();
+	const float* dz = guide->depth.data();
+	const float* r = inR.data();
+	const float* g = inG.data();
+	const float* b = inB.data();
+
+	vector<float> sum(width * 4);
+	float* sR = &sum[0];
+	float* sG = &sum[width];
+	float* sB = &sum[width * 2];
+	float* sW = &sum[width * 3];
+
+	for (int y = y0; y < y1; y++)
+	{
+		std::fill(sum.begin(), sum.end(), 0.0f);
+		int row = y * width;
+		for (int ky = 0; ky < 5; ky++)
+		{
+			int yy = y + (ky - 2) * step;
+			if (yy < 0 || yy >= height)
+				continue;
+			for (int kx = 0; kx < 5; kx++)
+			{
+				int off = (kx - 2) * step;
+				int xs = std::max(0, -off);
+				int xe = std::min(width, width - off);
+				int nrow = yy * width + off;
+				float w0 = h[ky] * h[kx];
+				for (int x = xs; x < xe; x++)
+				{
+					int i = row + x;
+					int j = nrow + x;
+					float li = 0.2126f * r[i] + 0.7152f * g[i] + 0.0722f * b[i];
+					float lj = 0.2126f * r[j] + 0.7152f * g[j] + 0.0722f * b[j];
+					float eC = (li - lj) * (li - lj) * invSigmaC2;
+					float nDot = nx[i] * nx[j] + ny[i] * ny[j] + nz[i] * nz[j];
+					float eN = sigmaN * (1.0f - std::max(nDot, 0.0f));
+					float eZ = fabsf(dz[i] - dz[j]) * invSigmaZ / (dz[i] + 0.001f);
+					float w = w0 * fastExpNeg(-(eC + eN + eZ));
+					sR[x] += w * r[j];
+					sG[x] += w * g[j];
+					sB[x] += w * b[j];
+					sW[x] += w;
+				}
+			}
+		}
+		// the center tap always has weight h[2]^2, so sW > 0
+		for (int x = 0; x < width; x++)
+		{
+			float inv = 1.0f / sW[x];
+			outR[row + x] = sR[x] * inv;
+			outG[row + x] = sG[x] * inv;
+			outB[row + x] = sB[x] * inv;
+		}
+	}
+}
+
+float psnr(const vector<glm::vec3>& img, const vector<glm::vec3>& ref)
+{
+	double mse = 0;
+	for (size_t i = 0; i < img.size(); i++)
+	{
+		glm::vec3 d = glm::clamp(img[i], 0.0f, 1.0f) - glm::clamp(ref[i], 0.0f, 1.0f);
+		mse += glm::dot(d, d);
+	}
+	mse /= 3.0 * img.size();
+	if (mse == 0)
+		return std::numeric_limits<float>::infinity();
+	return 10 * log10(1.0 / mse);
+}
+
+void colorBufferToImage(const vector<glm::vec3>& color, int width, int height, ofImage& image)
+{
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+		{
+			glm::vec3 c = glm::clamp(color[y * width + x], 0.0f, 1.0f) * 255.0f;
+			image.setColor(x, height - y - 1, ofColor(c.x, c.y, c.z));
+		}
+	image.update();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include "ofMain.h"
+
+//  Guide buffers from the primary hits, stored as separate float arrays
+//  (structure of arrays) so the filter loops vectorize.
+//  Pixel i = y * width + x, row 0 is the bottom of the image.
+//
+class GBuffer {
+public:
+	void allocate(int width, int height);
+	void clear();		// mark every pixel as background
+	void set(int i, const glm::vec3& normal, float depth, const glm::vec3& albedo);
+
+	int width = 0, height = 0;
+	vector<float> nx, ny, nz;		// unit surface normal
+	vector<float> depth;			// distance from camera, 0 for background
+	vector<float> ar, ag, ab;		// diffuse albedo in [0, 1]
+};
+
+//  Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010)
+//
+//  Repeated 5x5 B3-spline passes with the tap spacing doubling each pass.
+//  Taps are weighted down across normal, depth and color edges, so noise is
+//  smoothed inside surfaces without blurring silhouettes or shadow edges.
+//  The filter runs on irradiance (color / albedo) so texture detail survives.
+//
+class Denoiser {
+public:
+	void denoise(const vector<glm::vec3>& color, const GBuffer& guide, vector<glm::vec3>& result);
+
+	int iterations = 5;			// passes, the filter footprint is 4 * 2^iterations pixels wide
+	float sigmaColor = 0.6;		// luminance difference tolerance (relative, shrinks each pass)
+	float sigmaNormal = 32;		// exponent on the normal dot product
+	float sigmaDepth = 0.3;		// relative depth difference tolerance
+	int numThreads = 0;			// 0 = use all hardware threads
+
+	float lastTime = 0;			// milliseconds spent in the last denoise() call
+
+protected:
+	void filterRows(int y0, int y1, int step, float sigmaC);
+
+	const GBuffer* guide;
+	int width, height;
+	vector<float> inR, inG, inB, outR, outG, outB;	// ping-pong irradiance buffers
+};
+
+// peak signal to noise ratio of img against ref, colors in [0, 1]
+float psnr(const vector<glm::vec3>& img, const vector<glm::vec3>& ref);
+
+// write a float [0, 1] color buffer (row 0 at the bottom) into an 8 bit image
+void colorBufferToImage(const vector<glm::vec3>& color, int width, int height, ofImage& image);
@@ -0,0 +1,251 @@
+#include <cfloat>
+#include "dirtyregion.h"
+#include "ofApp.h"
+
+thread_local int32_t* DirtyRegions::current = NULL;
+
+void DirtyRegions::allocate(int n)
+{
+	numPixels = n;
+	deps.assign((size_t)n * maxDeps, -1);
+	valid = false;
+}
+
+void DirtyRegions::startPixel(int i)
+{
+	current = &deps[(size_t)i * maxDeps];
+	std::fill(current, current + maxDeps, -1);
+}
+
+void DirtyRegions::markUnknown(int i)
+{
+	deps[(size_t)i * maxDeps + maxDeps - 1] = unknown;
+}
+
+void DirtyRegions::record(const SceneObject* obj)
+{
+	if (current == NULL || obj == NULL || obj->sceneIndex < 0)
+		return;
+	for (int k = 0; k < maxDeps; k++)
+	{
+		if (current[k] == obj->sceneIndex || current[k] == unknown)
+			return;
+		if (current[k] < 0)
+		{
+			current[k] = obj->sceneIndex;
+			return;
+		}
+	}
+	current[maxDeps - 1] = unknown;		// out of slots
+}
+
+// settings, camera and lights; any change to these needs a full render
+uint64_t DirtyRegions::sceneHash(ofApp* app)
+{
+	uint64_t h = hashSeed;
+	RenderSettings s = app->getRenderSettings();
+	hashValue(h, s);
+	hashValue(h, app->scene.size());
+	for (auto light : app->lights)
+	{
+		glm::vec3 bmin, bmax;
+		light->getBounds(bmin, bmax);
+		hashValue(h, light->position);
+		hashValue(h, light->intensity);
+		hashValue(h, bmin);
+		hashValue(h, bmax);
+	}
+	return h;
+}
+
+// where an object is and whether it casts and receives shadows
+uint64_t DirtyRegions::geometryHash(SceneObject* obj)
+{
+	uint64_t h = hashSeed;
+	hashValue(h, obj->position);
+	hashValue(h, obj->castShadows);
+	hashValue(h, obj->receiveShadows);
+	glm::vec3 bmin, bmax;
+	if (obj->getBounds(bmin, bmax))
+	{
+		hashValue(h, bmin);
+		hashValue(h, bmax);
+	}
+	if (Plane* plane = dynamic_cast<Plane*>(obj))
+		hashValue(h, plane->normal);
+	return h;
+}
+
+uint64_t DirtyRegions::materialHash(int m)
+{
+	uint64_t h = hashSeed;
+	ofApp::hashMaterial(h, materials[m]);
+	return h;
+}
+
+void DirtyRegions::snapshot(ofApp* app)
+{
+	size_t n = app->scene.size();
+	renderedGeometry.resize(n);
+	renderedMin.resize(n);
+	renderedMax.resize(n);
+	renderedBounded.resize(n);
+	renderedMaterial.resize(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		SceneObject* obj = app->scene[i];
+		renderedGeometry[i] = geometryHash(obj);
+		renderedBounded[i] = obj->getBounds(renderedMin[i], renderedMax[i]);
+		renderedMaterial[i] = obj->materialId;
+	}
+	renderedMaterials.resize(materials.size());
+	for (size_t m = 0; m < materials.size(); m++)
+		renderedMaterials[m] = materialHash(m);
+	renderedHash = sceneHash(app);
+	valid = true;
+}
+
+bool DirtyRegions::canUpdate(ofApp* app)
+{
+	return valid && numPixels == app->imageWidth * app->imageHeight && app->primaryHits.size() == numPixels
+		&& renderedGeometry.size() == app->scene.size() && renderedHash == sceneHash(app);
+}
+
+// mark the pixels a box covers on screen, plus one pixel of margin; all of
+// them if part of the box is behind the camera
+void DirtyRegions::markScreenBounds(ofApp* app, const glm::vec3& bmin, const glm::vec3& bmax, vector<char>& dirty)
+{
+	RenderCam& cam = app->renderCam;
+	int width = app->imageWidth, height = app->imageHeight;
+	float d = cam.view.position.z - cam.position.z;
+	glm::vec2 lo(FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX);
+	for (int c = 0; c < 8; c++)
+	{
+		glm::vec3 corner((c & 1) ? bmax.x : bmin.x, (c & 2) ? bmax.y : bmin.y, (c & 4) ? bmax.z : bmin.z);
+		float dz = corner.z - cam.position.z;
+		if (dz * d <= 0)
+		{
+			lo = glm::vec2(0, 0);
+			hi = glm::vec2(1, 1);
+			break;
+		}
+		glm::vec3 p = cam.position + (corner - cam.position) * (d / dz);
+		glm::vec2 uv((p.x - cam.view.min.x) / cam.view.width(), (p.y - cam.view.min.y) / cam.view.height());
+		lo = glm::min(lo, uv);
+		hi = glm::max(hi, uv);
+	}
+	// pixel (x, y) is sampled at u = x / width, v = y / height
+	lo = glm::clamp(lo, glm::vec2(-1, -1), glm::vec2(2, 2));
+	hi = glm::clamp(hi, glm::vec2(-1, -1), glm::vec2(2, 2));
+	int x0 = std::max(0, (int)floor(lo.x * width) - 1), x1 = std::min(width - 1, (int)ceil(hi.x * width) + 1);
+	int y0 = std::max(0, (int)floor(lo.y * height) - 1), y1 = std::min(height - 1, (int)ceil(hi.y * height) + 1);
+	for (int y = y0; y <= y1; y++)
+		for (int x = x0; x <= x1; x++)
+			dirty[y * width + x] = 1;
+}
+
+// true if the segment from p to q crosses the box
+static bool segmentHitsBox(const glm::vec3& p, const glm::vec3& q, const glm::vec3& bmin, const glm::vec3& bmax)
+{
+	glm::vec3 dir = q - p;
+	float t0 = 0, t1 = 1;
+	for (int a = 0; a < 3; a++)
+	{
+		if (fabs(dir[a]) < 1e-12f)
+		{
+			if (p[a] < bmin[a] || p[a] > bmax[a])
+				return false;
+			continue;
+		}
+		float ta = (bmin[a] - p[a]) / dir[a], tb = (bmax[a] - p[a]) / dir[a];
+		t0 = std::max(t0, std::min(ta, tb));
+		t1 = std::min(t1, std::max(ta, tb));
+		if (t0 > t1)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Find the pixels the changes since the last snapshot can affect.
+ * canUpdate() must be true and prepareRender() called.
+ *
+ * @param ofApp* app - the app, its primary hits are those of the last render
+ * @param vector<char>& dirty - set to 1 for every pixel to re-trace
+ * @return int - number of dirty pixels
+ */
+int DirtyRegions::findDirty(ofApp* app, vector<char>& dirty)
+{
+	dirty.assign(numPixels, 0);
+	changedObjects = 0;
+	size_t n = app->scene.size();
+	vector<char> materialChanged(materials.size(), 1);
+	for (size_t m = 0; m < std::min(materials.size(), renderedMaterials.size()); m++)
+		materialChanged[m] = materialHash(m) != renderedMaterials[m];
+
+	// changed objects dirty their old and new screen bounds; the new bounds of
+	// moved ones are where they may now cast shadows
+	vector<char> changed(n, 0);
+	vector<glm::vec3> movedMin, movedMax;
+	for (size_t i = 0; i < n; i++)
+	{
+		SceneObject* obj = app->scene[i];
+		bool moved = geometryHash(obj) != renderedGeometry[i];
+		if (!moved && obj->materialId == renderedMaterial[i] && !materialChanged[obj->materialId])
+			continue;
+		changed[i] = 1;
+		changedObjects++;
+		glm::vec3 bmin, bmax;
+		bool bounded = obj->getBounds(bmin, bmax);
+		if (!bounded || !renderedBounded[i])
+		{
+			std::fill(dirty.begin(), dirty.end(), 1);		// planes cover everything
+			return numPixels;
+		}
+		markScreenBounds(app, renderedMin[i], renderedMax[i], dirty);
+		markScreenBounds(app, bmin, bmax, dirty);
+		if (moved)
+		{
+			movedMin.push_back(bmin);
+			movedMax.push_back(bmax);
+		}
+	}
+	if (changedObjects == 0)
+		return 0;
+
+	// shadow rays go from a hit to anywhere on a light; testing the segment to
+	// the light's center against boxes grown by the light's half size covers them
+	vector<glm::vec3> lightCenter, lightHalf;
+	for (auto light : app->lights)
+	{
+		glm::vec3 lmin, lmax;
+		light->getBounds(lmin, lmax);
+		lightCenter.push_back((lmin + lmax) * 0.5f);
+		lightHalf.push_back((lmax - lmin) * 0.5f);
+	}
+
+	int count = 0;
+	for (int i = 0; i < numPixels; i++)
+	{
+		const PrimaryHit& hit = app->primaryHits[i];
+		bool d = dirty[i];
+		for (int k = 0; k < maxDeps && !d; k++)
+		{
+			int32_t id = deps[(size_t)i * maxDeps + k];
+			d = id == unknown || (id >= 0 && id < n && changed[id]);
+		}
+		if (!d && hit.object != NULL)
+		{
+			d = hit.material < materialChanged.size() && materialChanged[hit.material];
+			// anything that moved may show up in a reflection
+			if (!d && !movedMin.empty() && materials[hit.material].reflectivity > 0 && app->maxReflectionDepth > 0)
+				d = true;
+			for (size_t l = 0; l < lightCenter.size() && !d; l++)
+				for (size_t b = 0; b < movedMin.size() && !d; b++)
+					d = segmentHitsBox(hit.pos, lightCenter[l], movedMin[b] - lightHalf[l], movedMax[b] + lightHalf[l]);
+		}
+		dirty[i] = d;
+		count += d;
+	}
+	return count;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "ofMain.h"
+
+class ofApp;
+class SceneObject;
+
+//  Which objects each pixel of the last render depends on, so an edit to a
+//  few objects only re-traces the pixels it can change.
+//
+//  While a pixel is shaded every object it touches is recorded: the primary
+//  object, the objects that blocked its shadow rays and those seen in its
+//  reflections.  The render also keeps the bounds and material of every
+//  object.  When objects have moved or changed material since, a pixel is
+//  dirty if it depended on one of them, falls inside the old or new screen
+//  bounds of one, or has a shadow ray that could now cross one.  Pixels that
+//  touched more objects than there are slots are always dirty.
+//
+//  Anything else (camera, image size, settings, lights, added or removed
+//  objects) changes too much and needs a full render.
+//
+class DirtyRegions {
+public:
+	static const int maxDeps = 4;		// objects recorded per pixel
+	static const int32_t unknown = -2;	// slot value of a pixel that depends on too much
+
+	void allocate(int numPixels);		// forget every dependency
+	void invalidate() { valid = false; }	// the scene was replaced
+	void startPixel(int i);				// record what the calling thread shades into pixel i
+	void markUnknown(int i);			// pixel i was not shaded with recording on
+	static void stopRecording() { current = NULL; }
+	static void record(const SceneObject* obj);		// on the recording thread, else a no-op
+
+	// remember the scene as rendered, after the render that recorded the pixels
+	void snapshot(ofApp* app);
+	// true if the last render can be updated with findDirty, false if it needs a full render
+	bool canUpdate(ofApp* app);
+	// mark the pixels that may differ from the last render, returns how many
+	int findDirty(ofApp* app, vector<char>& dirty);
+
+	int changedObjects = 0;				// found by the last findDirty
+
+protected:
+	uint64_t sceneHash(ofApp* app);		// what needs a full render when it changes
+	static uint64_t geometryHash(SceneObject* obj);
+	static uint64_t materialHash(int m);
+	void markScreenBounds(ofApp* app, const glm::vec3& bmin, const glm::vec3& bmax, vector<char>& dirty);
+
+	vector<int32_t> deps;				// maxDeps scene indices per pixel, -1 = unused
+	int numPixels = 0;
+	bool valid = false;
+	uint64_t renderedHash = 0;
+	vector<uint64_t> renderedGeometry;				// per scene index
+	vector<glm::vec3> renderedMin, renderedMax;
+	vector<char> renderedBounded;
+	vector<uint16_t> renderedMaterial;
+	vector<uint64_t> renderedMaterials;				// hash per material
+
+	static thread_local int32_t* current;			// slots of the pixel being shaded
+};
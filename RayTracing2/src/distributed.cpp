@@ -0,0 +1,370 @@
+#include "distributed.h"
+#include "ofApp.h"
+#ifdef _WIN32
+#include <windows.h>
+#define getpid GetCurrentProcessId
+#else
+#include <unistd.h>
+#endif
+
+static const uint32_t protocolVersion = 1;
+
+// host name and process id, to tell workers apart in the report
+static string workerName()
+{
+	char host[256] = "localhost";
+	gethostname(host, sizeof(host) - 1);
+	return string(host) + ":" + ofToString((int)getpid());
+}
+
+/*
+ * Render the app's scene into its image with worker processes.  Blocks
+ * until every tile is in or the render fails.
+ *
+ * @param int port - TCP port the workers connect to
+ * @param int localWorkers - workers to start on this machine, 0 = only remote ones
+ * @return bool - false if the render could not be finished
+ */
+bool RenderCoordinator::render(int port, int localWorkers)
+{
+	MessageListener listener;
+	if (!listener.listen(port))
+		return false;
+	float start = ofGetElapsedTimef();
+	app->prepareRender();
+	hash = app->sceneHash();
+	int width = app->imageWidth, height = app->imageHeight;
+	if (app->image.getWidth() != width || app->image.getHeight() != height)
+		app->image.allocate(width, height, OF_IMAGE_COLOR);
+
+	tiles.clear();
+	queue.clear();
+	workers.clear();
+	tilesDone = 0;
+	failed = false;
+	bool cache = app->useTileCache();
+	vector<unsigned char> rgb;
+	for (int y = 0; y < height; y += tileSize)
+		for (int x = 0; x < width; x += tileSize)
+		{
+			Tile t;
+			t.x0 = x;
+			t.y0 = y;
+			t.x1 = std::min(x + tileSize, width);
+			t.y1 = std::min(y + tileSize, height);
+			if (cache)
+			{
+				t.key = app->tileCache.key(app, t.x0, t.y0, t.x1, t.y1);
+				if (app->tileCache.load(t.key, t.x1 - t.x0, t.y1 - t.y0, rgb))
+				{
+					setPixels(t, rgb.data());
+					t.done = true;
+					tilesDone++;
+				}
+			}
+			if (!t.done)
+				queue.push_back(tiles.size());
+			tiles.push_back(t);
+		}
+	if (!queue.empty())
+		spawnLocalWorkers(port, localWorkers);
+	cout << "Rendering " << queue.size() << " of " << tiles.size() << " tiles on port " << port << endl;
+
+	float lastWorker = ofGetElapsedTimef();		// a worker was last connected
+	int lastPercent = 0;
+	while (tilesDone < tiles.size() && !failed)
+	{
+		for (MessageSocket s = listener.accept(0); s.isOpen(); s = listener.accept(0))
+		{
+			workers.push_back(Worker());
+			Worker& w = workers.back();
+			w.socket = s;
+			w.socket.setTimeout(tileTimeout);		// a worker stuck inside a message can't stall the render
+			w.name = "(connecting)";
+			w.lastHeard = ofGetElapsedTimef();
+		}
+
+		vector<MessageSocket*> sockets;
+		vector<Worker*> live;
+		for (auto& w : workers)
+			if (w.socket.isOpen())
+			{
+				sockets.push_back(&w.socket);
+				live.push_back(&w);
+			}
+		float now = ofGetElapsedTimef();
+		if (live.empty())
+		{
+			if (now - lastWorker > connectTimeout)
+			{
+				cout << "No workers connected in " << connectTimeout << " seconds" << endl;
+				failed = true;
+			}
+			ofSleepMillis(50);
+			continue;
+		}
+		lastWorker = now;
+
+		vector<bool> ready;
+		waitReadable(sockets, 50, ready);
+		for (size_t i = 0; i < live.size(); i++)
+			if (ready[i])
+				handleMessage(*live[i]);
+
+		now = ofGetElapsedTimef();
+		for (auto w : live)
+			if (w->socket.isOpen() && !w->tiles.empty() && now - w->lastHeard > tileTimeout)
+				dropWorker(*w, "no result in " + ofToString(tileTimeout) + " seconds");
+
+		int percent = 100 * tilesDone / tiles.size();
+		if (percent / 10 != lastPercent / 10)
+		{
+			cout << "Rendered " << percent << "%" << endl;
+			lastPercent = percent;
+		}
+	}
+
+	for (auto& w : workers)
+		if (w.socket.isOpen())
+		{
+			w.socket.send(MSG_DONE, NULL, 0);
+			w.socket.close();
+		}
+	listener.close();
+	app->image.update();
+	printThroughput();
+	app->tileCache.printStats();
+	int used = 0;
+	for (auto& w : workers)
+		used += w.ready;
+	if (!failed)
+		cout << "Rendered " << width << "x" << height << " on " << used << " workers in "
+			<< ofGetElapsedTimef() - start << " seconds" << endl;
+	return !failed;
+}
+
+// start workers on this machine, they connect back like remote ones
+void RenderCoordinator::spawnLocalWorkers(int port, int count)
+{
+	string exe = ofFilePath::getCurrentExePath();
+	for (int i = 0; i < count; i++)
+	{
+#ifdef _WIN32
+		string command = "start \"\" /b \"" + exe + "\" --worker 127.0.0.1:" + ofToString(port);
+#else
+		string command = "\"" + exe + "\" --worker 127.0.0.1:" + ofToString(port) + " &";
+#endif
+		if (std::system(command.c_str()) != 0)
+			cout << "could not start worker " << exe << endl;
+	}
+}
+
+// receive and act on one message of a worker
+bool RenderCoordinator::handleMessage(Worker& w)
+{
+	uint32_t type;
+	vector<char> payload;
+	if (!w.socket.receive(type, payload))
+	{
+		dropWorker(w, "connection lost");
+		return false;
+	}
+	w.lastHeard = ofGetElapsedTimef();
+	MessageReader in(payload);
+
+	if (type == MSG_HELLO)
+	{
+		uint32_t version;
+		if (!in.get(version) || !in.getString(w.name) || version != protocolVersion)
+		{
+			dropWorker(w, "wrong protocol version");
+			return false;
+		}
+		MessageWriter out;
+		out.putString(app->sceneFile);
+		out.put(app->getRenderSettings());
+		if (!w.socket.send(MSG_SCENE, out.data))
+		{
+			dropWorker(w, "connection lost");
+			return false;
+		}
+		return true;
+	}
+	if (type == MSG_READY)
+	{
+		uint64_t workerHash;
+		if (!in.get(workerHash) || workerHash != hash)
+		{
+			dropWorker(w, "its scene differs from this one");
+			return false;
+		}
+		w.ready = true;
+		w.readyTime = w.lastResult = ofGetElapsedTimef();
+		cout << "Worker " << w.name << " ready" << endl;
+		feed(w);
+		return true;
+	}
+	if (type == MSG_RESULT)
+	{
+		int32_t id, x0, y0, x1, y1;
+		if (!in.get(id) || !in.get(x0) || !in.get(y0) || !in.get(x1) || !in.get(y1)
+			|| id < 0 || id >= tiles.size() || x0 != tiles[id].x0 || y0 != tiles[id].y0 || x1 != tiles[id].x1
+			|| y1 != tiles[id].y1 || in.remaining() != (size_t)(x1 - x0) * (y1 - y0) * 3)
+		{
+			dropWorker(w, "bad result");
+			return false;
+		}
+		w.tiles.erase(std::remove(w.tiles.begin(), w.tiles.end(), id), w.tiles.end());
+		Tile& t = tiles[id];
+		if (!t.done)
+		{
+			vector<unsigned char> rgb(in.remaining());
+			in.getBytes(rgb.data(), rgb.size());
+			setPixels(t, rgb.data());
+			if (app->useTileCache())
+				app->tileCache.store(t.key, x1 - x0, y1 - y0, rgb);
+			t.done = true;
+			tilesDone++;
+			w.tilesDone++;
+			w.pixels += (x1 - x0) * (y1 - y0);
+		}
+		w.lastResult = ofGetElapsedTimef();
+		feed(w);
+		return true;
+	}
+	dropWorker(w, "unexpected message " + ofToString(type));
+	return false;
+}
+
+// copy a tile's pixels (rgb, top row first) into the image
+void RenderCoordinator::setPixels(const Tile& t, const unsigned char* rgb)
+{
+	for (int y = t.y0; y < t.y1; y++)
+		for (int x = t.x0; x < t.x1; x++, rgb += 3)
+			app->image.setColor(x, y, ofColor(rgb[0], rgb[1], rgb[2]));
+}
+
+// keep tilesInFlight tiles queued at a ready worker
+void RenderCoordinator::feed(Worker& w)
+{
+	while (w.ready && w.socket.isOpen() && w.tiles.size() < tilesInFlight && !queue.empty())
+	{
+		int id = queue.front();
+		queue.pop_front();
+		const Tile& t = tiles[id];
+		if (t.done)
+			continue;
+		int32_t msg[5] = { id, t.x0, t.y0, t.x1, t.y1 };
+		w.tiles.push_back(id);
+		if (!w.socket.send(MSG_TILE, msg, sizeof(msg)))
+			dropWorker(w, "connection lost");
+	}
+}
+
+// close a worker and put its tiles back at the front of the queue
+void RenderCoordinator::dropWorker(Worker& w, const string& why)
+{
+	cout << "Dropped worker " << w.name << ": " << why << endl;
+	for (int id : w.tiles)
+	{
+		Tile& t = tiles[id];
+		if (t.done)
+			continue;
+		if (++t.attempts >= maxAttempts)
+		{
+			cout << "Tile at " << t.x0 << "," << t.y0 << " was lost by " << t.attempts << " workers, giving up" << endl;
+			failed = true;
+		}
+		queue.push_front(id);
+	}
+	w.tiles.clear();
+	w.socket.send(MSG_DONE, NULL, 0);
+	w.socket.close();
+}
+
+void RenderCoordinator::printThroughput()
+{
+	for (auto& w : workers)
+	{
+		if (!w.ready)
+			continue;
+		float seconds = std::max(w.lastResult - w.readyTime, 0.001f);
+		cout << "  " << w.name << ": " << w.tilesDone << " tiles, " << w.pixels / seconds / 1000000
+			<< " Mpixels/s over " << seconds << " seconds" << endl;
+	}
+}
+
+/*
+ * Worker side of a distributed render: load the scene the coordinator
+ * names, render the tiles it sends and return their pixels.
+ *
+ * @param ofApp* app - app to load the scene into; its window is never opened
+ * @param const string& host - coordinator host
+ * @param int port - coordinator port
+ * @return bool - true if the coordinator ended the render normally
+ */
+bool runRenderWorker(ofApp* app, const string& host, int port)
+{
+	// remote workers may be started before the coordinator is listening
+	MessageSocket socket;
+	for (int i = 0; i < 50 && !socket.connect(host, port); i++)
+		ofSleepMillis(200);
+	if (!socket.isOpen())
+	{
+		cout << "could not connect to " << host << ":" << port << endl;
+		return false;
+	}
+	MessageWriter hello;
+	hello.put(protocolVersion);
+	hello.putString(workerName());
+	socket.send(MSG_HELLO, hello.data);
+
+	uint32_t type;
+	vector<char> payload;
+	vector<unsigned char> rgb;
+	int tilesDone = 0;
+	bool ok = false;
+	while (socket.receive(type, payload))
+	{
+		MessageReader in(payload);
+		if (type == MSG_SCENE)
+		{
+			string sceneFile;
+			RenderSettings settings;
+			if (!in.getString(sceneFile) || !in.get(settings))
+				break;
+			app->clearScene();
+			if (sceneFile.empty())
+				app->buildDefaultScene();
+			else if (!app->loadScene(sceneFile))
+				break;
+			app->applyRenderSettings(settings);
+			app->prepareRender();
+			uint64_t hash = app->sceneHash();
+			if (!socket.send(MSG_READY, &hash, sizeof(hash)))
+				break;
+		}
+		else if (type == MSG_TILE)
+		{
+			int32_t tile[5];
+			if (!in.get(tile))
+				break;
+			app->renderRegion(tile[1], tile[2], tile[3], tile[4], rgb);
+			MessageWriter out;
+			out.put(tile);
+			out.putBytes(rgb.data(), rgb.size());
+			if (!socket.send(MSG_RESULT, out.data))
+				break;
+			tilesDone++;
+		}
+		else
+		{
+			ok = type == MSG_DONE;
+			break;
+		}
+	}
+	socket.close();
+	app->printRenderStats();
+	cout << "Worker rendered " << tilesDone << " tiles" << endl;
+	return ok;
+}
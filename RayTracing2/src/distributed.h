@@ -0,0 +1,92 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstdint>
+#include "ofMain.h"
+#include "socketio.h"
+
+class ofApp;
+
+//  Everything besides the scene itself that changes the pixels of a render,
+//  i.e. the slider values, image size and camera, so another process can be
+//  set up to render exactly like this one.
+//
+struct RenderSettings {
+	int32_t width, height;
+	glm::vec3 cameraPos;
+	float viewZ;
+	glm::vec2 viewMin, viewMax;
+	float intensity, power, ambient, lightCullThreshold, textureCacheMB;
+	int32_t shadowSamplesMin, shadowSamplesMax, lightMode, lightSamples, maxReflectionDepth;
+};
+
+//  Messages between the coordinator and a worker
+//
+enum RenderMessage : uint32_t {
+	MSG_HELLO = 1,		// worker -> coordinator: protocol version, worker name
+	MSG_SCENE,			// coordinator -> worker: scene file, RenderSettings
+	MSG_READY,			// worker -> coordinator: scene hash after loading
+	MSG_TILE,			// coordinator -> worker: tile id, x0, y0, x1, y1
+	MSG_RESULT,			// worker -> coordinator: tile id, x0, y0, x1, y1, rgb rows
+	MSG_DONE			// coordinator -> worker: no more tiles, exit
+};
+
+//  Splits a render into tiles and hands them to worker processes, which
+//  connect over TCP: local ones started by the coordinator itself, remote
+//  ones started by hand with --worker host:port on machines that have the
+//  same data folder.
+//
+//  Workers load the scene file the coordinator names and get its settings,
+//  then report their scene hash; a worker whose scene differs is turned
+//  away.  Each worker has a couple of tiles in flight so it never waits on
+//  the network.  A worker that disconnects or stays silent for tileTimeout
+//  seconds is dropped and its tiles go back in the queue; a tile that has
+//  taken down maxAttempts workers ends the render instead of every worker.
+//  With the app's tile cache on, cached tiles are never sent out and the
+//  results of the others are added to the cache.
+//
+class RenderCoordinator {
+public:
+	RenderCoordinator(ofApp* app) : app(app) {}
+
+	// render the app's scene into its image; false if it could not be finished
+	bool render(int port, int localWorkers);
+
+	int tileSize = 64;
+	int tilesInFlight = 2;			// per worker
+	float tileTimeout = 120;		// seconds without a result before a worker counts as hung
+	float connectTimeout = 30;		// seconds to wait for a first worker
+	int maxAttempts = 3;
+
+protected:
+	struct Tile { int x0, y0, x1, y1; int attempts = 0; bool done = false; uint64_t key = 0; };
+	struct Worker {
+		MessageSocket socket;
+		string name;
+		bool ready = false;
+		vector<int> tiles;			// in flight
+		int tilesDone = 0;
+		uint64_t pixels = 0;
+		float readyTime = 0, lastHeard = 0, lastResult = 0;
+	};
+
+	void spawnLocalWorkers(int port, int count);
+	bool handleMessage(Worker& w);
+	void feed(Worker& w);
+	void setPixels(const Tile& t, const unsigned char* rgb);
+	void dropWorker(Worker& w, const string& why);
+	void printThroughput();
+
+	ofApp* app;
+	uint64_t hash = 0;
+	vector<Tile> tiles;
+	std::deque<int> queue;
+	vector<Worker> workers;			// finished and dropped ones too, for the report
+	int tilesDone = 0;
+	bool failed = false;
+};
+
+// worker side: connect to a coordinator and render tiles until it is done
+bool runRenderWorker(ofApp* app, const string& host, int port);
@@ -0,0 +1,349 @@
+#include <climits>
+#include <functional>
+#include <zlib.h>
+#include "imagewriter.h"
+
+/*
+ * Create the file and write its header
+ *
+ * @param const string& fname - output file, relative to the data folder
+ * @param int width, height - image size in pixels
+ * @return bool - false if the file can't be created or the image is too large for the format
+ */
+bool StreamImageWriter::open(const string& fname, int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	rowsWritten = 0;
+	fileName = fname;
+	string ext = ofToLower(ofFilePath::getFileExt(fname));
+	tiff = ext == "tif" || ext == "tiff";
+	if (tiff && (uint64_t)width * height * 3 > 0xffff0000ull)
+	{
+		cout << "image too large for TIFF, write a .ppm instead" << endl;
+		return false;
+	}
+
+	out.open(ofToDataPath(fname), std::ios::binary);
+	if (!out)
+	{
+		cout << "could not create " << fname << endl;
+		return false;
+	}
+	if (tiff)
+		writeTiffHeader();
+	else
+		out << "P6\n" << width << " " << height << "\n255\n";
+	return true;
+}
+
+static void put16(std::ofstream& out, uint16_t v) { out.write((const char*)&v, 2); }
+static void put32(std::ofstream& out, uint32_t v) { out.write((const char*)&v, 4); }
+
+// one IFD entry: tag, type (3 = SHORT, 4 = LONG), count, value or offset
+static void putEntry(std::ofstream& out, uint16_t tag, uint16_t type, uint32_t count, uint32_t value)
+{
+	put16(out, tag);
+	put16(out, type);
+	put32(out, count);
+	if (type == 3 && count == 1)
+	{
+		put16(out, value);
+		put16(out, 0);
+	}
+	else
+		put32(out, value);
+}
+
+// Baseline little endian TIFF with a single IFD.  Strip offsets and sizes
+// are all known up front because the strips are uncompressed.
+void StreamImageWriter::writeTiffHeader()
+{
+	uint32_t numStrips = (height + tiffRowsPerStrip - 1) / tiffRowsPerStrip;
+	uint32_t stripBytes = width * 3 * tiffRowsPerStrip;
+	const uint16_t numEntries = 10;
+	uint32_t ifdSize = 2 + numEntries * 12 + 4;
+	uint32_t bitsOffset = 8 + ifdSize;
+	uint32_t offsetsOffset = bitsOffset + 6;
+	uint32_t countsOffset = offsetsOffset + 4 * numStrips;
+	uint32_t dataOffset = countsOffset + 4 * numStrips;
+
+	out.write("II", 2);
+	put16(out, 42);
+	put32(out, 8);
+	put16(out, numEntries);
+	putEntry(out, 256, 4, 1, width);			// ImageWidth
+	putEntry(out, 257, 4, 1, height);			// ImageLength
+	putEntry(out, 258, 3, 3, bitsOffset);		// BitsPerSample 8, 8, 8
+	putEntry(out, 259, 3, 1, 1);				// no compression
+	putEntry(out, 262, 3, 1, 2);				// RGB
+	putEntry(out, 273, 4, numStrips, numStrips == 1 ? dataOffset : offsetsOffset);	// StripOffsets
+	putEntry(out, 277, 3, 1, 3);				// SamplesPerPixel
+	putEntry(out, 278, 4, 1, tiffRowsPerStrip);	// RowsPerStrip
+	putEntry(out, 279, 4, numStrips, numStrips == 1 ? (uint32_t)width * height * 3 : countsOffset);	// StripByteCounts
+	putEntry(out, 284, 3, 1, 1);				// chunky RGB
+	put32(out, 0);								// no next IFD
+
+	put16(out, 8); put16(out, 8); put16(out, 8);
+	for (uint32_t s = 0; s < numStrips; s++)
+		put32(out, dataOffset + s * stripBytes);
+	for (uint32_t s = 0; s < numStrips; s++)
+	{
+		uint32_t rows = std::min(tiffRowsPerStrip, height - (int)s * tiffRowsPerStrip);
+		put32(out, width * 3 * rows);
+	}
+}
+
+/*
+ * Append rows below the ones already written
+ *
+ * @param const unsigned char* rgb - rows * width pixels, 3 bytes each, top row first
+ * @param int rows - number of rows
+ * @return bool - false on a write error
+ */
+bool StreamImageWriter::writeRows(const unsigned char* rgb, int rows)
+{
+	rows = std::min(rows, height - rowsWritten);
+	out.write((const char*)rgb, (std::streamsize)rows * width * 3);
+	rowsWritten += rows;
+	return (bool)out;
+}
+
+bool StreamImageWriter::close()
+{
+	bool ok = out && rowsWritten == height;
+	out.close();
+	if (!ok)
+		cout << "incomplete image " << fileName << ": " << rowsWritten << " of " << height << " rows" << endl;
+	return ok;
+}
+
+static void putBE32(unsigned char* p, uint32_t v)
+{
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+// length, type, data, CRC of type and data
+static void writeChunk(std::ofstream& out, const char* type, const unsigned char* data, size_t size)
+{
+	unsigned char head[8];
+	putBE32(head, size);
+	memcpy(head + 4, type, 4);
+	uLong crc = crc32(0, head + 4, 4);
+	if (size > 0)
+		crc = crc32(crc, data, size);	// a NULL buffer would reset the crc
+	unsigned char tail[4];
+	putBE32(tail, crc);
+	out.write((const char*)head, 8);
+	out.write((const char*)data, size);
+	out.write((const char*)tail, 4);
+}
+
+static unsigned char paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Filter one row into out (filter byte first), picking the filter with the
+// smallest sum of absolute differences like libpng does.  prev is NULL on
+// the first row.
+static void filterRow(const unsigned char* row, const unsigned char* prev, int bytes, int bpp, unsigned char* out, vector<unsigned char>& trial)
+{
+	trial.resize(bytes);
+	long best = LONG_MAX;
+	for (int f = 0; f < 5; f++)
+	{
+		if (prev == NULL && (f == 2 || f == 4))
+			continue;		// same as None / Sub on the first row
+		long sum = 0;
+		for (int i = 0; i < bytes; i++)
+		{
+			int a = i >= bpp ? row[i - bpp] : 0;
+			int b = prev ? prev[i] : 0;
+			int c = prev && i >= bpp ? prev[i - bpp] : 0;
+			unsigned char v = row[i];
+			switch (f)
+			{
+			case 1: v -= a; break;
+			case 2: v -= b; break;
+			case 3: v -= (a + b) / 2; break;
+			case 4: v -= paeth(a, b, c); break;
+			}
+			trial[i] = v;
+			sum += v < 128 ? v : 256 - v;
+		}
+		if (sum < best)
+		{
+			best = sum;
+			out[0] = f;
+			memcpy(out + 1, trial.data(), bytes);
+		}
+	}
+}
+
+/*
+ * Write an 8 bit gray, RGB or RGBA PNG, compressing bands of rows in parallel
+ *
+ * @param const ofPixels& pixels - image, top row first
+ * @param const string& fname - output file, relative to the data folder
+ * @param int level - zlib compression level, 0 = uncompressed fast path
+ * @param int numThreads - 0 = use all hardware threads
+ * @return bool - false if the file could not be written
+ */
+bool savePNG(const ofPixels& pixels, const string& fname, int level, int numThreads)
+{
+	int width = pixels.getWidth(), height = pixels.getHeight();
+	int bpp = pixels.getNumChannels();
+	if (bpp != 1 && bpp != 3 && bpp != 4)
+		return false;
+	level = ofClamp(level, 0, 9);
+	size_t rowBytes = (size_t)width * bpp;
+	size_t lineBytes = rowBytes + 1;		// filter byte first
+
+	// bands of about 256K of pixels, at least one per thread
+	int n = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+	int bandRows = std::max(1, std::min((int)((1 << 18) / lineBytes), (height + n - 1) / n));
+	int numBands = (height + bandRows - 1) / bandRows;
+	const size_t window = 32768;
+
+	struct Band {
+		vector<unsigned char> filtered, compressed;
+		uLong adler = 1;
+		bool ok = false;
+	};
+	vector<Band> bands(numBands);
+
+	// every band is filtered first so its neighbour can use the tail as a dictionary
+	auto filterBand = [&](int b) {
+		Band& band = bands[b];
+		int y0 = b * bandRows, y1 = std::min(height, y0 + bandRows);
+		band.filtered.resize((y1 - y0) * lineBytes);
+		vector<unsigned char> trial;
+		const unsigned char* data = pixels.getData();
+		for (int y = y0; y < y1; y++)
+		{
+			unsigned char* out = &band.filtered[(y - y0) * lineBytes];
+			const unsigned char* row = data + y * rowBytes;
+			if (level == 0)
+			{
+				out[0] = 0;
+				memcpy(out + 1, row, rowBytes);
+			}
+			else
+				filterRow(row, y > 0 ? row - rowBytes : NULL, rowBytes, bpp, out, trial);
+		}
+		band.adler = adler32(1, band.filtered.data(), band.filtered.size());
+	};
+
+	// raw deflate of one band, ending on a byte boundary unless it is the last
+	auto compressBand = [&](int b) {
+		Band& band = bands[b];
+		z_stream z = {};
+		if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return;
+		if (b > 0 && level > 0)
+		{
+			const vector<unsigned char>& above = bands[b - 1].filtered;
+			size_t dict = std::min(window, above.size());
+			deflateSetDictionary(&z, above.data() + above.size() - dict, dict);
+		}
+		band.compressed.resize(deflateBound(&z, band.filtered.size()) + 16);
+		z.next_in = band.filtered.data();
+		z.avail_in = band.filtered.size();
+		z.next_out = band.compressed.data();
+		z.avail_out = band.compressed.size();
+		int rc = deflate(&z, b + 1 == numBands ? Z_FINISH : Z_SYNC_FLUSH);
+		band.ok = b + 1 == numBands ? rc == Z_STREAM_END : rc == Z_OK && z.avail_in == 0;
+		band.compressed.resize(z.total_out);
+		deflateEnd(&z);
+	};
+
+	// worker threads pull bands from a shared counter, once per stage
+	auto runStage = [&](std::function<void(int)> stage) {
+		std::atomic<int> next(0);
+		auto worker = [&]() {
+			int b;
+			while ((b = next++) < numBands)
+				stage(b);
+		};
+		vector<std::thread> threads;
+		for (int t = 1; t < std::min(n, numBands); t++)
+			threads.push_back(std::thread(worker));
+		worker();
+		for (auto& t : threads)
+			t.join();
+	};
+	runStage(filterBand);
+	runStage(compressBand);
+
+	std::ofstream out(ofToDataPath(fname), std::ios::binary);
+	if (!out)
+		return false;
+	const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	out.write((const char*)signature, 8);
+	unsigned char ihdr[13];
+	putBE32(ihdr, width);
+	putBE32(ihdr + 4, height);
+	ihdr[8] = 8;
+	ihdr[9] = bpp == 1 ? 0 : bpp == 3 ? 2 : 6;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	writeChunk(out, "IHDR", ihdr, 13);
+
+	// one IDAT per band, the zlib header goes in front of the first and the
+	// combined checksum after the last
+	uLong adler = 1;
+	for (int b = 0; b < numBands; b++)
+	{
+		Band& band = bands[b];
+		if (!band.ok)
+			return false;
+		adler = adler32_combine(adler, band.adler, band.filtered.size());
+		if (b == 0)
+		{
+			const unsigned char zlibHeader[2] = { 0x78, 0x01 };
+			band.compressed.insert(band.compressed.begin(), zlibHeader, zlibHeader + 2);
+		}
+		if (b + 1 == numBands)
+		{
+			unsigned char check[4];
+			putBE32(check, adler);
+			band.compressed.insert(band.compressed.end(), check, check + 4);
+		}
+		writeChunk(out, "IDAT", band.compressed.data(), band.compressed.size());
+		vector<unsigned char>().swap(band.compressed);
+	}
+	writeChunk(out, "IEND", NULL, 0);
+	return (bool)out;
+}
+
+void AsyncImageSaver::save(const ofPixels& pixels, const string& fname, int level)
+{
+	wait();
+	this->pixels = pixels;
+	running = true;
+	// the job gets its own copy of the settings, the caller may change them for the next save
+	int threads = numThreads;
+	job = std::thread([this, fname, level, threads]() {
+		uint64_t start = ofGetElapsedTimeMicros();
+		bool ok;
+		if (ofToLower(ofFilePath::getFileExt(fname)) == "png")
+			ok = savePNG(this->pixels, fname, level, threads);
+		else
+			ok = ofSaveImage(this->pixels, fname);
+		lastTime = (ofGetElapsedTimeMicros() - start) / 1000.0;
+		if (ok)
+			cout << "Saved " << fname << " in " << lastTime << " ms" << endl;
+		else
+			cout << "Save " << fname << " failed" << endl;
+		running = false;
+	});
+}
+
+// block until the image being saved is on disk
+void AsyncImageSaver::wait()
+{
+	if (job.joinable())
+		job.join();
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include "ofMain.h"
+
+//  Writes an 8 bit RGB image to disk a few rows at a time, top row first,
+//  so images far larger than memory can be produced
+//
+//  The format follows the file extension: .tif/.tiff is written as an
+//  uncompressed strip TIFF (up to 4 GB of pixels), anything else as binary
+//  PPM.  Both layouts are known before the first row arrives, so rows go
+//  straight to the file and nothing but the header is kept in memory.
+//
+class StreamImageWriter {
+public:
+	bool open(const string& fname, int width, int height);
+	bool writeRows(const unsigned char* rgb, int rows);	// rows * width * 3 bytes
+	bool close();		// false if the file could not be written completely
+
+	int width = 0, height = 0;
+	int rowsWritten = 0;
+
+protected:
+	void writeTiffHeader();
+
+	std::ofstream out;
+	string fileName;
+	bool tiff = false;
+	static const int tiffRowsPerStrip = 16;
+};
+
+//  PNG encoder that deflates horizontal bands of the image on separate
+//  threads and stitches them into one zlib stream, the way pigz does.  Each
+//  band is primed with the last 32K of the band above, so the output is
+//  only slightly larger than a single threaded encode.
+//
+//  Level 0 is the fast path: rows are not filtered and the bands are stored
+//  without compression, which costs little more than copying the pixels.
+//
+bool savePNG(const ofPixels& pixels, const string& fname, int level = 6, int numThreads = 0);
+
+//  Saves images on a background thread so the next render can start while
+//  the last one is encoded.  One save is in flight at a time, a new save
+//  waits for the previous one to finish.  PNG files go through savePNG,
+//  other formats through ofSaveImage.
+//
+class AsyncImageSaver {
+public:
+	~AsyncImageSaver() { wait(); }
+
+	// pixels are copied; level is the PNG compression, 0 = uncompressed ... 9 = smallest
+	void save(const ofPixels& pixels, const string& fname, int level = 6);
+	void wait();
+	bool busy() const { return running; }
+
+	int numThreads = 0;			// 0 = use all hardware threads, read when a save starts
+	float lastTime = 0;			// milliseconds spent encoding the last image
+
+protected:
+	std::thread job;
+	ofPixels pixels;
+	std::atomic<bool> running{ false };
+};
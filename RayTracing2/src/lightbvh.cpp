@@ -0,0 +1,166 @@
+#include "lightbvh.h"
+#include "ofApp.h"
+
+/*
+ * Build the hierarchy by recursive median splits along the longest axis
+ *
+ * @param const vector<Light*>& lights - scene lights, indices refer to this list
+ */
+void LightBVH::build(const vector<Light*>& lights)
+{
+	this->lights = &lights;
+	nodes.clear();
+	if (lights.empty())
+		return;
+
+	lmin.resize(lights.size());
+	lmax.resize(lights.size());
+	vector<int> ids(lights.size());
+	for (size_t i = 0; i < lights.size(); i++)
+	{
+		lights[i]->getBounds(lmin[i], lmax[i]);
+		ids[i] = i;
+	}
+	nodes.reserve(2 * lights.size());
+	buildNode(ids, 0, ids.size());
+}
+
+// build the node for lights ids[begin, end) and return its index
+int LightBVH::buildNode(vector<int>& ids, int begin, int end)
+{
+	int index = nodes.size();
+	nodes.push_back(LightNode());
+
+	LightNode node;
+	node.bmin = lmin[ids[begin]];
+	node.bmax = lmax[ids[begin]];
+	glm::vec3 cmin = (lmin[ids[begin]] + lmax[ids[begin]]) * 0.5f;
+	glm::vec3 cmax = cmin;
+	for (int i = begin; i < end; i++)
+	{
+		int id = ids[i];
+		node.bmin = glm::min(node.bmin, lmin[id]);
+		node.bmax = glm::max(node.bmax, lmax[id]);
+		glm::vec3 c = (lmin[id] + lmax[id]) * 0.5f;
+		cmin = glm::min(cmin, c);
+		cmax = glm::max(cmax, c);
+		node.power += (*lights)[id]->intensity;
+	}
+
+	if (end - begin == 1)
+		node.light = ids[begin];
+	else
+	{
+		// split at the median centroid along the longest axis
+		glm::vec3 extent = cmax - cmin;
+		int axis = 0;
+		if (extent.y > extent[axis]) axis = 1;
+		if (extent.z > extent[axis]) axis = 2;
+		int mid = (begin + end) / 2;
+		std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end, [&](int a, int b) {
+			return lmin[a][axis] + lmax[a][axis] < lmin[b][axis] + lmax[b][axis];
+		});
+		node.left = buildNode(ids, begin, mid);
+		node.right = buildNode(ids, mid, end);
+	}
+	nodes[index] = node;
+	return index;
+}
+
+// Estimated contribution of a node at surface point p with normal n:
+// power over (clamped) squared distance, times the largest cosine between n
+// and any direction into the node's bounding sphere.
+float LightBVH::importance(const LightNode& node, const glm::vec3& p, const glm::vec3& n) const
+{
+	glm::vec3 c = (node.bmin + node.bmax) * 0.5f;
+	float r = 0.5f * glm::length(node.bmax - node.bmin);
+	glm::vec3 d = c - p;
+	float d2 = glm::dot(d, d);
+	float r2 = std::max(r * r, 1e-6f);
+	if (d2 <= r2)
+		return node.power / r2;		// p is inside the bounds, anything is possible
+
+	float dist = sqrt(d2);
+	float cosTheta = glm::dot(n, d) / dist;
+	float sinSub = r / dist;
+	float cosSub = sqrt(1 - sinSub * sinSub);
+	float cosBound = 1;
+	if (cosTheta < cosSub)
+	{
+		// cos(theta - subtended angle)
+		float sinTheta = sqrt(std::max(0.0f, 1 - cosTheta * cosTheta));
+		cosBound = cosTheta * cosSub + sinTheta * sinSub;
+	}
+	if (cosBound <= 0)
+		return 0;
+	return node.power * cosBound / std::max(d2, r2);
+}
+
+/*
+ * Walk down the tree choosing a child with probability proportional to its importance
+ *
+ * @param const glm::vec3& p - surface point
+ * @param const glm::vec3& n - unit surface normal
+ * @param float u - uniform random number in [0, 1), reused at every level
+ * @param float& pdf - probability that this light was chosen
+ * @return int - light index, or -1 if no light can contribute
+ */
+int LightBVH::sample(const glm::vec3& p, const glm::vec3& n, float u, float& pdf) const
+{
+	pdf = 0;
+	if (nodes.empty() || importance(nodes[0], p, n) <= 0)
+		return -1;
+	pdf = 1;
+	int i = 0;
+	while (nodes[i].light < 0)
+	{
+		float wl = importance(nodes[nodes[i].left], p, n);
+		float wr = importance(nodes[nodes[i].right], p, n);
+		if (wl + wr <= 0)
+		{
+			pdf = 0;
+			return -1;
+		}
+		float pl = wl / (wl + wr);
+		if (u < pl)
+		{
+			u = std::min(u / pl, 0.99999994f);
+			pdf *= pl;
+			i = nodes[i].left;
+		}
+		else
+		{
+			u = std::min((u - pl) / (1 - pl), 0.99999994f);
+			pdf *= 1 - pl;
+			i = nodes[i].right;
+		}
+	}
+	return nodes[i].light;
+}
+
+void LightBVH::cull(const glm::vec3& p, float intensity, float threshold, vector<int>& result) const
+{
+	result.clear();
+	if (nodes.empty())
+		return;
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const LightNode& node = nodes[stack[--top]];
+		// squared distance from p to the node bounds
+		glm::vec3 d = glm::max(glm::max(node.bmin - p, p - node.bmax), glm::vec3(0, 0, 0));
+		float d2 = glm::dot(d, d);
+		if (d2 > 0 && intensity / (0.01 * d2) < threshold)
+			continue;	// every light in here is too far away to matter
+		if (node.light >= 0)
+			result.push_back(node.light);
+		else
+		{
+			// median splits keep the depth (and the stack) at log2(lights)
+			stack[top++] = node.left;
+			stack[top++] = node.right;
+		}
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include "ofMain.h"
+
+class Light;
+
+// how lambert/phong choose the lights to evaluate at a hit point
+enum LightSelection { LIGHTS_ALL = 0, LIGHTS_SAMPLE = 1, LIGHTS_CULL = 2 };
+
+//  Node of the light hierarchy.  Interior nodes bound the position and sum
+//  the power of all lights below them; leaves hold a single light.
+//
+struct LightNode {
+	glm::vec3 bmin, bmax;	// bounds of the lights (including area light extent)
+	float power = 0;		// total intensity of the lights below this node
+	int left = -1;			// child node indices, -1 for a leaf
+	int right = -1;
+	int light = -1;			// index into the light list for a leaf
+};
+
+//  Bounding volume hierarchy over the scene lights
+//
+//  Lets the shader pick a few important lights per hit point instead of
+//  looping over all of them (stochastic light selection), or skip every
+//  light whose contribution is provably below a threshold (culling).
+//
+class LightBVH {
+public:
+	void build(const vector<Light*>& lights);
+
+	// pick one light with probability proportional to its estimated importance at p
+	// u is a uniform random number in [0, 1); returns the light index and its pdf
+	int sample(const glm::vec3& p, const glm::vec3& n, float u, float& pdf) const;
+
+	// collect the lights whose unshadowed contribution bound is at least threshold
+	// (bound = intensity / (0.01 * dist^2), the falloff used by lambert/phong)
+	void cull(const glm::vec3& p, float intensity, float threshold, vector<int>& result) const;
+
+	int size() const { return nodes.size(); }
+
+	vector<LightNode> nodes;	// nodes[0] is the root
+
+protected:
+	int buildNode(vector<int>& ids, int begin, int end);
+	float importance(const LightNode& node, const glm::vec3& p, const glm::vec3& n) const;
+
+	const vector<Light*>* lights;
+	vector<glm::vec3> lmin, lmax;	// per light bounds used during build
+};
@@ -1,17 +1,57 @@
 #include "ofMain.h"
 #include "ofApp.h"
+#include "clustermesh.h"
 
 //========================================================================
-int main( ){
+int main(int argc, char* argv[]){
+
+	// RayTracing2 [myscene.scn] [--port n] [--workers n] [--server port]
+	// RayTracing2 --worker host:port		render tiles for a coordinator, no window
+	// RayTracing2 --cluster in.obj out.clm [triangles]	write a cluster file for "clustered", no window
+	auto app = make_shared<ofApp>();
+	string worker;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--worker" && i + 1 < argc)
+			worker = argv[++i];
+		else if (arg == "--cluster" && i + 2 < argc)
+		{
+			ofInit();
+			string objFile = argv[i + 1], clusterFile = argv[i + 2];
+			int triangles = i + 3 < argc ? ofToInt(argv[i + 3]) : 4096;
+			return ClusteredMesh::build(objFile, clusterFile, triangles > 0 ? triangles : 4096) ? 0 : 1;
+		}
+		else if (arg == "--port" && i + 1 < argc)
+			app->renderPort = ofToInt(argv[++i]);
+		else if (arg == "--workers" && i + 1 < argc)
+			app->localWorkers = ofToInt(argv[++i]);
+		else if (arg == "--server" && i + 1 < argc)
+		{
+			app->bServe = true;
+			app->serverPort = ofToInt(argv[++i]);
+		}
+		else
+			app->sceneFile = arg;
+	}
+	if (!worker.empty())
+	{
+		ofInit();
+		size_t colon = worker.rfind(':');
+		string host = colon == string::npos ? "127.0.0.1" : worker.substr(0, colon);
+		int port = colon == string::npos ? ofToInt(worker) : ofToInt(worker.substr(colon + 1));
+		return runRenderWorker(app.get(), host, port) ? 0 : 1;
+	}
 
 	//Use ofGLFWWindowSettings for more options like multi-monitor fullscreen
 	ofGLWindowSettings settings;
 	settings.setSize(1024, 768);
+	settings.setGLVersion(3, 2);	// programmable pipeline, for instanced drawing in the viewport
 	settings.windowMode = OF_WINDOW; //can also be OF_FULLSCREEN
 
 	auto window = ofCreateWindow(settings);
 
-	ofRunApp(window, make_shared<ofApp>());
+	ofRunApp(window, app);
 	ofRunMainLoop();
 
 }
@@ -0,0 +1,120 @@
+#include "material.h"
+#include "texture.h"
+
+MaterialTable materials;
+
+// add a material and return its id (0 if the table is full)
+uint16_t MaterialTable::add(const Material& m)
+{
+	if (materials.size() >= 0xffff)
+	{
+		cout << "material table full, using default for " << m.name << endl;
+		return 0;
+	}
+	materials.push_back(m);
+	return materials.size() - 1;
+}
+
+// objects constructed with just a color share one material per color
+uint16_t MaterialTable::fromColor(const ofColor& diffuse)
+{
+	for (size_t i = 1; i < materials.size(); i++)
+		if (materials[i].name.empty() && materials[i].diffuse == diffuse && materials[i].diffuseMap.empty())
+			return i;
+	Material m;
+	m.diffuse = diffuse;
+	return add(m);
+}
+
+int MaterialTable::find(const string& name)
+{
+	for (size_t i = 0; i < materials.size(); i++)
+		if (materials[i].name == name)
+			return i;
+	return -1;
+}
+
+// convert an .mtl color (three floats in [0, 1]) to ofColor
+static ofColor readColor(istringstream& lineSS)
+{
+	float r = 0, g = 0, b = 0;
+	lineSS >> r >> g >> b;
+	return ofColor(ofClamp(r, 0, 1) * 255, ofClamp(g, 0, 1) * 255, ofClamp(b, 0, 1) * 255);
+}
+
+/*
+ * Load materials from a Wavefront .mtl file
+ *
+ * @param const string& fname - path of the .mtl file
+ * @param map<string, uint16_t>& byName - output, material name to id
+ * @return bool - false if the file could not be read
+ */
+bool MaterialTable::loadMtl(const string& fname, map<string, uint16_t>& byName)
+{
+	ofFile file;
+	if (!file.open(fname, ofFile::ReadOnly, false) || !file.exists())
+	{
+		cout << "could not open material file " << fname << endl;
+		return false;
+	}
+	ofBuffer buff = file.readToBuffer();
+
+	Material m;
+	bool haveMaterial = false;
+	int illum = 2;
+	auto finish = [&]() {
+		if (!haveMaterial)
+			return;
+		// illumination models 3 and 5 turn on ray traced reflection
+		if ((illum == 3 || illum == 5) && m.reflectivity == 0)
+			m.reflectivity = std::max(m.specular.r, std::max(m.specular.g, m.specular.b)) / 255.0f;
+		byName[m.name] = add(m);
+	};
+
+	for (auto line : buff.getLines())
+	{
+		istringstream lineSS(line);
+		string lineType;
+		lineSS >> lineType;
+
+		if (lineType == "newmtl")
+		{
+			finish();
+			m = Material();
+			lineSS >> m.name;
+			illum = 2;
+			haveMaterial = true;
+		}
+		else if (lineType == "Kd")
+			m.diffuse = readColor(lineSS);
+		else if (lineType == "Ks")
+			m.specular = readColor(lineSS);
+		else if (lineType == "Ns")
+			lineSS >> m.exponent;
+		else if (lineType == "illum")
+			lineSS >> illum;
+		else if (lineType == "map_Kd")
+		{
+			// the file name is the last token, options like -s may come first
+			string token;
+			while (lineSS >> token)
+			{
+				if (token == "-s")
+					lineSS >> m.textureScale;
+				else
+					m.diffuseMap = token;
+			}
+			if (!m.diffuseMap.empty())
+				m.diffuseMap = ofFilePath::join(ofFilePath::getEnclosingDirectory(fname, false), m.diffuseMap);
+		}
+		// Ka, Ke, Ni, d, Tr, Tf and other maps are not used by this renderer
+	}
+	finish();
+	return true;
+}
+
+void MaterialTable::loadTextures()
+{
+	for (auto& m : materials)
+		m.texture = m.diffuseMap.empty() ? -1 : textures.load(m.diffuseMap);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <string>
+#include <cstdint>
+#include "ofMain.h"
+
+//  Surface material shared by scene objects and mesh triangles
+//
+struct Material {
+	string name;
+	ofColor diffuse = ofColor::grey;
+	ofColor specular = ofColor::lightGray;
+	float exponent = 0;			// Phong exponent, 0 = use the global "power" slider
+	float reflectivity = 0;		// fraction of light mirrored, 0 = not reflective
+	string diffuseMap;			// texture file for the diffuse color (map_Kd), empty = none
+	float textureScale = 1;		// texture repeats per uv unit (map_Kd -s)
+	int texture = -1;			// id in the texture cache, set by loadTextures()
+};
+
+//  Table of all materials in the scene, referenced by a 16 bit index so
+//  objects and per-triangle mesh data stay small.  Index 0 is the default.
+//
+class MaterialTable {
+public:
+	MaterialTable() { materials.push_back(Material()); materials[0].name = "default"; }
+
+	uint16_t add(const Material& m);
+	uint16_t fromColor(const ofColor& diffuse);	// shared unnamed material of a plain color
+	int find(const string& name);				// -1 if there is no material with that name
+
+	// load all materials of a Wavefront .mtl file, names are mapped to their ids
+	bool loadMtl(const string& fname, map<string, uint16_t>& byName);
+	// register the diffuse maps with the texture cache (builds tile files on first use)
+	void loadTextures();
+
+	Material& operator[](uint16_t id) { return materials[id]; }
+	size_t size() { return materials.size(); }
+
+	vector<Material> materials;
+};
+
+extern MaterialTable materials;		// the scene's material table
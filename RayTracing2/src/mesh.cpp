@@ -1,5 +1,8 @@
 #include <iostream>
+#include <unordered_map>
+#include <thread>
 #include "mesh.h"
+#include "simplify.h"
 
 // By: Aramina Lee
 
@@ -23,11 +26,14 @@ float calcDet3x3(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2)
 Mesh::Mesh(glm::vec3 p, const char* meshFile, ofColor diffuse)
 {
 	position = p;
-	diffuseColor = diffuse;
+	materialId = materials.fromColor(diffuse);
 	if( meshFile == NULL )
 		loadMesh();
 	else
+	{
+		fileName = meshFile;
 		loadFile(meshFile);
+	}
 	calcNormal();
 }
 
@@ -64,6 +70,10 @@ void Mesh::loadFile(const char* fname)
 	file.open(ofToDataPath(fname), ofFile::ReadWrite, false);
 	ofBuffer buff = file.readToBuffer();
 
+	map<string, uint16_t> mtlNames;		// materials from mtllib files
+	uint16_t currentMaterial = materialId;	// set by usemtl, applies to the following faces
+	bool usesMaterials = false;
+
 	for (auto line : buff.getLines())
 	{
 		istringstream lineSS(line);
@@ -78,14 +88,16 @@ void Mesh::loadFile(const char* fname)
 		}
 		else if (lineType == "vt")	// else if texture
 		{
-			// ignore for now
-			// float u, v, w;
-			// lineSS >> u >> v >> w;
+			float u = 0, v = 0;
+			lineSS >> u >> v;		// ignoring w
+			uvs.push_back(glm::vec2(u, v));
 		}
 		else if (lineType == "vn")	// else if normal
 		{
-			// float i, j, k;
-			// lineSS >> i >> j >> k;
+			float i = 0, j = 0, k = 1;
+			lineSS >> i >> j >> k;
+			glm::vec3 n(i, j, k);
+			normals.push_back(glm::length(n) > 0 ? glm::normalize(n) : glm::vec3(0, 0, 1));
 		}
 		else if (lineType == "f")	// else if face
 		{
@@ -118,6 +130,37 @@ void Mesh::loadFile(const char* fname)
 				continue;
 			}
 			tInd.push_back(glm::ivec3(vInd[0], vInd[1], vInd[2]));
+			tMaterial.push_back(currentMaterial);
+			// a missing vt or vn reads as index -1
+			tUVInd.push_back(glm::ivec3(vtInd[0], vtInd[1], vtInd[2]));
+			tNormInd.push_back(glm::ivec3(vnInd[0], vnInd[1], vnInd[2]));
+		}
+		else if (lineType == "mtllib")	// else if material library
+		{
+			// .mtl paths are relative to the .obj file
+			string mtlFile;
+			while (lineSS >> mtlFile)
+				materials.loadMtl(ofFilePath::join(ofFilePath::getEnclosingDirectory(ofToDataPath(fname), false), mtlFile), mtlNames);
+		}
+		else if (lineType == "usemtl")	// else if material change
+		{
+			string name;
+			lineSS >> name;
+			auto it = mtlNames.find(name);
+			if (it != mtlNames.end())
+			{
+				currentMaterial = it->second;
+				usesMaterials = true;
+			}
+			else
+			{
+				cout << "unknown material: " << name << endl;
+				currentMaterial = materialId;
+			}
+		}
+		else if (lineType == "o" || lineType == "g" || lineType == "s")	// else if object, group or smoothing
+		{
+			// ignore
 		}
 		else if (lineType == "l")	// else if line
 		{
@@ -129,6 +172,14 @@ void Mesh::loadFile(const char* fname)
 		}
 		else cout << "unknown line type: " << lineType << endl;
 	}
+	// a mesh without usemtl needs no per triangle materials
+	if (!usesMaterials)
+		tMaterial.clear();
+	// nor index streams for attributes the file does not have
+	if (uvs.empty())
+		tUVInd.clear();
+	if (normals.empty())
+		tNormInd.clear();
 }
 
 /*
@@ -136,9 +187,174 @@ void Mesh::loadFile(const char* fname)
  */
 void Mesh::printStats()
 {
-	cout << "Number of vertices: " << verts.size() << endl;
-	cout << "Number of faces: " << tInd.size() << endl;
-	cout << "Mesh size: " << ((verts.size() * sizeof(glm::vec3) + tInd.size() * sizeof(glm::ivec3)) / 1024) << " KB" << endl;
+	cout << "Number of vertices: " << numVertices() << (isCompact ? " (welded, quantized)" : "") << endl;
+	cout << "Number of faces: " << numTriangles() << (tInd16.empty() ? "" : " (16 bit indices)") << endl;
+	cout << "Number of normals: " << normals.size() + packedNormals.size() << (packedNormals.empty() ? "" : " (octahedral)") << endl;
+	cout << "Number of uvs: " << uvs.size() << endl;
+	size_t bytes = memoryBytes();
+	cout << "Mesh size: " << (bytes / 1024) << " KB, " << (float)bytes / std::max(numTriangles(), 1) << " bytes per triangle" << endl;
+}
+
+// heap memory actually allocated by the mesh arrays (capacity, not size)
+size_t Mesh::memoryBytes()
+{
+	size_t bytes = verts.capacity() * sizeof(glm::vec3) + qVerts.capacity() * sizeof(glm::u16vec3)
+		+ tInd.capacity() * sizeof(glm::ivec3) + tInd16.capacity() * sizeof(glm::u16vec3)
+		+ tCentroid.capacity() * sizeof(glm::vec3) + tNormal.capacity() * sizeof(glm::vec3)
+		+ tMaterial.capacity() * sizeof(uint16_t)
+		+ normals.capacity() * sizeof(glm::vec3) + packedNormals.capacity() * sizeof(uint32_t)
+		+ uvs.capacity() * sizeof(glm::vec2)
+		+ tNormInd.capacity() * sizeof(glm::ivec3) + tUVInd.capacity() * sizeof(glm::ivec3);
+	for (auto& lod : lods)
+		bytes += lod.verts.capacity() * sizeof(glm::vec3) + lod.tInd.capacity() * sizeof(glm::ivec3)
+			+ lod.tNormal.capacity() * sizeof(glm::vec3) + lod.tMaterial.capacity() * sizeof(uint16_t);
+	return bytes;
+}
+
+/*
+ * Convert the mesh to the compact layout
+ *
+ * Vertices are quantized to 16 bits per axis within the bounds, and vertices
+ * that quantize to the same position are welded into one (the error is at
+ * most half of extent / 65535 per axis).  Triangles that collapse are removed.
+ * Indices become 16 bit if the welded mesh has at most 65536 vertices, vertex
+ * normals are packed to octahedral, face normals are recomputed on demand
+ * and the unused centroids are dropped.
+ */
+void Mesh::compact()
+{
+	if (isCompact || verts.empty())
+		return;
+	size_t before = memoryBytes();
+
+	glm::vec3 bmin, bmax;
+	getBounds(bmin, bmax);
+	qMin = bmin;
+	qScale = (bmax - bmin) / 65535.0f;
+	glm::vec3 invScale;
+	for (int k = 0; k < 3; k++)
+		invScale[k] = qScale[k] > 0 ? 1 / qScale[k] : 0;
+
+	// weld: one vertex per distinct quantized position
+	unordered_map<uint64_t, int> welded;
+	vector<int> remap(verts.size());
+	for (size_t i = 0; i < verts.size(); i++)
+	{
+		glm::vec3 q = glm::clamp((verts[i] - qMin) * invScale + 0.5f, glm::vec3(0, 0, 0), glm::vec3(65535, 65535, 65535));
+		glm::u16vec3 qv((unsigned short)q.x, (unsigned short)q.y, (unsigned short)q.z);
+		uint64_t key = (uint64_t)qv.x | ((uint64_t)qv.y << 16) | ((uint64_t)qv.z << 32);
+		auto found = welded.find(key);
+		if (found == welded.end())
+		{
+			found = welded.insert(make_pair(key, (int)qVerts.size())).first;
+			qVerts.push_back(qv);
+		}
+		remap[i] = found->second;
+	}
+
+	// remap triangles and drop the ones welding made degenerate, along with
+	// their per triangle attributes
+	size_t kept = 0;
+	for (size_t t = 0; t < tInd.size(); t++)
+	{
+		glm::ivec3 tri(remap[tInd[t][0]], remap[tInd[t][1]], remap[tInd[t][2]]);
+		if (tri[0] == tri[1] || tri[1] == tri[2] || tri[0] == tri[2])
+			continue;
+		tInd[kept] = tri;
+		if (!tMaterial.empty()) tMaterial[kept] = tMaterial[t];
+		if (!tNormInd.empty()) tNormInd[kept] = tNormInd[t];
+		if (!tUVInd.empty()) tUVInd[kept] = tUVInd[t];
+		kept++;
+	}
+	size_t removed = tInd.size() - kept;
+	tInd.resize(kept);
+	if (!tMaterial.empty()) tMaterial.resize(kept);
+	if (!tNormInd.empty()) tNormInd.resize(kept);
+	if (!tUVInd.empty()) tUVInd.resize(kept);
+
+	if (qVerts.size() <= 65536)
+	{
+		tInd16.resize(tInd.size());
+		for (size_t t = 0; t < tInd.size(); t++)
+			tInd16[t] = glm::u16vec3(tInd[t]);
+		tInd.clear();
+	}
+
+	// release everything the compact layout replaces
+	vector<glm::vec3>().swap(verts);
+	vector<glm::vec3>().swap(tCentroid);
+	vector<glm::vec3>().swap(tNormal);
+	tInd.shrink_to_fit();
+	qVerts.shrink_to_fit();
+	tMaterial.shrink_to_fit();
+	tNormInd.shrink_to_fit();
+	tUVInd.shrink_to_fit();
+	packNormals();
+	isCompact = true;
+	vboDirty = true;
+
+	cout << "compacted mesh: " << remap.size() - qVerts.size() << " vertices welded, " << removed
+		<< " degenerate triangles removed, " << before / 1024 << " KB -> " << memoryBytes() / 1024 << " KB" << endl;
+}
+
+// triangle normal, stored or (in the compact layout) computed from the vertices;
+// like tNormal it is not unit length
+glm::vec3 Mesh::faceNormal(int t)
+{
+	if (!tNormal.empty())
+		return tNormal[t];
+	glm::ivec3 tri = triangle(t);
+	glm::vec3 v0 = vertex(tri[0]);
+	glm::vec3 v1 = vertex(tri[1]);
+	glm::vec3 v2 = vertex(tri[2]);
+	return glm::cross(v1 - v0, v2 - v1);
+}
+
+// octahedral normal encoding: project onto the octahedron |x|+|y|+|z| = 1,
+// fold the lower half over the upper and store x, y as two 16 bit snorms
+static uint32_t octEncode(glm::vec3 n)
+{
+	n /= fabs(n.x) + fabs(n.y) + fabs(n.z);
+	glm::vec2 e(n.x, n.y);
+	if (n.z < 0)
+		e = glm::vec2((1 - fabs(n.y)) * (n.x >= 0 ? 1 : -1), (1 - fabs(n.x)) * (n.y >= 0 ? 1 : -1));
+	int16_t x = (int16_t)round(glm::clamp(e.x, -1.0f, 1.0f) * 32767);
+	int16_t y = (int16_t)round(glm::clamp(e.y, -1.0f, 1.0f) * 32767);
+	return (uint32_t)(uint16_t)x | ((uint32_t)(uint16_t)y << 16);
+}
+
+static glm::vec3 octDecode(uint32_t bits)
+{
+	glm::vec2 e((int16_t)(bits & 0xffff) / 32767.0f, (int16_t)(bits >> 16) / 32767.0f);
+	glm::vec3 n(e.x, e.y, 1 - fabs(e.x) - fabs(e.y));
+	if (n.z < 0)
+	{
+		float x = n.x;
+		n.x = (1 - fabs(n.y)) * (x >= 0 ? 1 : -1);
+		n.y = (1 - fabs(x)) * (n.y >= 0 ? 1 : -1);
+	}
+	return glm::normalize(n);
+}
+
+// Replace the float vertex normals by 32 bit octahedral ones (12 -> 4 bytes
+// per normal, worst case error about 0.005 degrees)
+void Mesh::packNormals()
+{
+	if (normals.empty())
+		return;		// no vn in the file, or already packed
+	packedNormals.resize(normals.size());
+	for (size_t i = 0; i < normals.size(); i++)
+		packedNormals[i] = octEncode(normals[i]);
+	size_t bytes = normals.capacity() * sizeof(glm::vec3);
+	normals.clear();
+	normals.shrink_to_fit();
+	cout << "packed " << packedNormals.size() << " vertex normals: " << bytes / 1024 << " KB -> "
+		<< packedNormals.size() * sizeof(uint32_t) / 1024 << " KB" << endl;
+}
+
+glm::vec3 Mesh::vertexNormal(int i)
+{
+	return packedNormals.empty() ? normals[i] : octDecode(packedNormals[i]);
 }
 
 // calculate centroids and normals for every triangle in the mesh
@@ -162,12 +378,107 @@ void Mesh::calcNormal()
 	}
 }
 
-// draw every triangle in the mesh using ofDrawTriangle
+// bounding box of all vertices, computed on the first call (the viewport
+// asks for it every frame)
+bool Mesh::getBounds(glm::vec3& bmin, glm::vec3& bmax)
+{
+	if (numVertices() == 0)
+		return false;
+	if (isCompact)
+	{
+		bmin = qMin;
+		bmax = qMin + qScale * 65535.0f;
+		return true;
+	}
+	if (!boundsValid)
+	{
+		boundsMin = boundsMax = verts[0];
+		for (auto& v : verts)
+		{
+			boundsMin = glm::min(boundsMin, v);
+			boundsMax = glm::max(boundsMax, v);
+		}
+		boundsValid = true;
+	}
+	bmin = boundsMin;
+	bmax = boundsMax;
+	return true;
+}
+
+// draw the mesh from a vertex buffer that is filled once, instead of
+// sending every triangle to the GPU again each frame
 void Mesh::draw()
 {
-	// draw each triangle
-	for (int i = 0; i < tInd.size(); i++)
-		ofDrawTriangle(verts[tInd[i][0]], verts[tInd[i][1]], verts[tInd[i][2]]);
+	drawLevel(drawLod);
+}
+
+// Move the mesh so its reference point is at p.  The vertices are stored in
+// world space, so all of them move; in the compact layout only the
+// quantization origin does.
+void Mesh::setPosition(const glm::vec3& p)
+{
+	glm::vec3 delta = p - position;
+	if (delta == glm::vec3(0, 0, 0))
+		return;
+	position = p;
+	if (isCompact)
+		qMin += delta;
+	else
+		for (auto& v : verts)
+			v += delta;
+	for (auto& c : tCentroid)
+		c += delta;
+	for (auto& lod : lods)
+	{
+		for (auto& v : lod.verts)
+			v += delta;
+		lod.vbo.clear();		// uploaded again by drawLevel
+	}
+	vboDirty = true;
+	boundsValid = false;
+}
+
+// draw a level of detail, -1 = full detail
+void Mesh::drawLevel(int lod)
+{
+	if (lod >= 0 && lod < lods.size())
+	{
+		if (lods[lod].vbo.getNumVertices() == 0)
+		{
+			lods[lod].vbo.setMode(OF_PRIMITIVE_TRIANGLES);
+			lods[lod].vbo.addVertices(lods[lod].verts);
+			for (auto& tri : lods[lod].tInd)
+			{
+				lods[lod].vbo.addIndex(tri[0]);
+				lods[lod].vbo.addIndex(tri[1]);
+				lods[lod].vbo.addIndex(tri[2]);
+			}
+		}
+		if (ofGetFill() == OF_FILLED)
+			lods[lod].vbo.draw();
+		else
+			lods[lod].vbo.drawWireframe();
+		return;
+	}
+	if (vboDirty)
+	{
+		vbo.clear();
+		vbo.setMode(OF_PRIMITIVE_TRIANGLES);
+		for (int i = 0; i < numVertices(); i++)
+			vbo.addVertex(vertex(i));
+		for (int i = 0; i < numTriangles(); i++)
+		{
+			glm::ivec3 tri = triangle(i);
+			vbo.addIndex(tri[0]);
+			vbo.addIndex(tri[1]);
+			vbo.addIndex(tri[2]);
+		}
+		vboDirty = false;
+	}
+	if (ofGetFill() == OF_FILLED)
+		vbo.draw();
+	else
+		vbo.drawWireframe();
 }
 
 /*
@@ -180,25 +491,59 @@ void Mesh::draw()
  */
 bool Mesh::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal)
 {
+	uint16_t material;
+	int primitive;
+	return intersect(ray, point, normal, material, primitive);
+}
+
+/*
+ * Intersect Ray with Mesh and return the material of the hit triangle
+ *
+ * @param const Ray& ray - given ray
+ * @param glm::vec3& point - vector3 point
+ * @param glm::vec3& - normal Intersection
+ * @param uint16_t& material - material id of the closest triangle
+ * @param int& primitive - index of the closest triangle
+ * @return bool - true if ray intersects mesh, false if no intersection
+ */
+bool Mesh::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal, uint16_t& material, int& primitive)
+{
+	if (renderLod >= 0 && renderLod < lods.size())
+		return intersectLod(lods[renderLod], ray, point, normal, material, primitive);
+
 	// parameters for finding the intersection of the ray with closest surface of the pyramid
 	float tBest = numeric_limits<float>::max();		// best (min) t-value
 	float betaBest = 0;	// beta for best ray triangle intersection
 	float gammaBest = 0; // gamma for best ray triangle intersection
 	size_t iTriBest = 0; // index of tInd for best triangle
 
+	// in the compact layout the ray is moved into the quantized space instead
+	// of dequantizing every vertex; t and the barycentrics are the same there
+	glm::vec3 rayP = ray.p, rayD = ray.d;
+	if (isCompact)
+	{
+		glm::vec3 s;
+		for (int k = 0; k < 3; k++)
+			s[k] = qScale[k] > 0 ? qScale[k] : 1;	// flat axis, every vertex has q = 0
+		rayP = (ray.p - qMin) / s;
+		rayD = ray.d / s;
+	}
+
 	// for each of the triangles in the mesh
-	for (size_t i = 0; i < tInd.size(); i++)
+	int numTri = numTriangles();
+	for (int i = 0; i < numTri; i++)
 	{
 		// draw the triangle
-		glm::vec3 v0 = verts[tInd[i][0]];
-		glm::vec3 v1 = verts[tInd[i][1]];
-		glm::vec3 v2 = verts[tInd[i][2]];
+		glm::ivec3 tri = triangle(i);
+		glm::vec3 v0 = isCompact ? glm::vec3(qVerts[tri[0]]) : verts[tri[0]];
+		glm::vec3 v1 = isCompact ? glm::vec3(qVerts[tri[1]]) : verts[tri[1]];
+		glm::vec3 v2 = isCompact ? glm::vec3(qVerts[tri[2]]) : verts[tri[2]];
 
 		// determine if the ray intersects the triangle
 		glm::vec3 c0 = v0 - v1;
 		glm::vec3 c1 = v0 - v2;
-		glm::vec3 c2 = ray.d;
-		glm::vec3 c3 = v0 - ray.p;
+		glm::vec3 c2 = rayD;
+		glm::vec3 c3 = v0 - rayP;
 
 		// use Cramer's Rule to solve for the intersection
 		float dt = calcDet3x3(c0, c1, c2);		// determinant
@@ -230,14 +575,320 @@ bool Mesh::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal)
 	if (tBest < numeric_limits<float>::max())
 	{
 		// calculate position of intersection
-		glm::vec3 v0 = verts[tInd[iTriBest][0]];
-		glm::vec3 v1 = verts[tInd[iTriBest][1]];
-		glm::vec3 v2 = verts[tInd[iTriBest][2]];
+		glm::ivec3 tri = triangle(iTriBest);
+		glm::vec3 v0 = vertex(tri[0]);
+		glm::vec3 v1 = vertex(tri[1]);
+		glm::vec3 v2 = vertex(tri[2]);
 		point = v0 + betaBest * (v1 - v0) + gammaBest * (v2 - v0);
-		normal = tNormal[iTriBest];
+		normal = faceNormal(iTriBest);
+		// smooth shading: interpolate the vertex normals with the same barycentrics,
+		// keeping them on the side of the geometric normal
+		if (!tNormInd.empty() && tNormInd[iTriBest][0] >= 0 && tNormInd[iTriBest][1] >= 0 && tNormInd[iTriBest][2] >= 0)
+		{
+			glm::ivec3 ni = tNormInd[iTriBest];
+			glm::vec3 n = (1 - betaBest - gammaBest) * vertexNormal(ni[0]) + betaBest * vertexNormal(ni[1]) + gammaBest * vertexNormal(ni[2]);
+			if (glm::length(n) > 0)
+				normal = glm::dot(n, normal) < 0 ? -glm::normalize(n) : glm::normalize(n);
+		}
+		material = tMaterial.empty() ? materialId : tMaterial[iTriBest];
+		primitive = iTriBest;
 		return true;
 	}
 
 	return false;	// no intersection found
 }
 
+
+/*
+ * Texture coordinates at a point on a triangle, interpolated from its vertex uvs
+ *
+ * @param const glm::vec3& point - point on the triangle
+ * @param int primitive - triangle index returned by intersect()
+ * @param glm::vec2& uv - interpolated texture coordinates
+ * @param float& uvPerUnit - uv units per world unit on this triangle
+ * @return bool - false if the triangle has no texture coordinates
+ */
+bool Mesh::getUV(const glm::vec3& point, int primitive, glm::vec2& uv, float& uvPerUnit)
+{
+	if (primitive < 0 || primitive >= tUVInd.size())
+		return false;
+	glm::ivec3 ti = tUVInd[primitive];
+	if (ti[0] < 0 || ti[1] < 0 || ti[2] < 0)
+		return false;
+
+	// barycentrics of the point from the sub-triangle areas
+	glm::ivec3 tri = triangle(primitive);
+	glm::vec3 v0 = vertex(tri[0]);
+	glm::vec3 e1 = vertex(tri[1]) - v0;
+	glm::vec3 e2 = vertex(tri[2]) - v0;
+	glm::vec3 d = point - v0;
+	float d11 = glm::dot(e1, e1), d12 = glm::dot(e1, e2), d22 = glm::dot(e2, e2);
+	float d1 = glm::dot(d, e1), d2 = glm::dot(d, e2);
+	float denom = d11 * d22 - d12 * d12;
+	if (denom == 0)
+		return false;
+	float beta = (d22 * d1 - d12 * d2) / denom;
+	float gamma = (d11 * d2 - d12 * d1) / denom;
+
+	glm::vec2 t0 = uvs[ti[0]], t1 = uvs[ti[1]], t2 = uvs[ti[2]];
+	uv = (1 - beta - gamma) * t0 + beta * t1 + gamma * t2;
+
+	// ratio of the triangle's area in uv space to its area in world space
+	glm::vec2 u1 = t1 - t0, u2 = t2 - t0;
+	float uvArea = fabs(u1.x * u2.y - u1.y * u2.x);
+	float worldArea = glm::length(glm::cross(e1, e2));
+	uvPerUnit = worldArea > 0 ? sqrt(uvArea / worldArea) : 0;
+	return true;
+}
+
+map<string, std::weak_ptr<Mesh>> MeshInstance::loaded;
+
+/*
+ * MeshInstance constructor
+ *
+ * @param std::shared_ptr<Mesh> mesh - shared geometry in object space
+ * @param const glm::mat4& transform - object to world transform
+ */
+MeshInstance::MeshInstance(std::shared_ptr<Mesh> mesh, const glm::mat4& transform)
+{
+	this->mesh = mesh;
+	materialId = mesh->materialId;
+	hasBounds = mesh->getBounds(localMin, localMax);
+	setTransform(transform);
+}
+
+/*
+ * Load a mesh file in object space, or return the copy already loaded
+ *
+ * @param const char* meshFile - mesh file name
+ * @param ofColor diffuse - color of the faces without a material
+ * @return std::shared_ptr<Mesh> - geometry for MeshInstance
+ */
+std::shared_ptr<Mesh> MeshInstance::load(const char* meshFile, ofColor diffuse)
+{
+	std::shared_ptr<Mesh> mesh = loaded[meshFile].lock();
+	if (mesh == NULL)
+	{
+		mesh = std::make_shared<Mesh>(glm::vec3(0, 0, 0), meshFile, diffuse);
+		loaded[meshFile] = mesh;
+	}
+	return mesh;
+}
+
+void MeshInstance::setTransform(const glm::mat4& m)
+{
+	transform = m;
+	inverse = glm::inverse(m);
+	normalMatrix = glm::transpose(glm::inverse(glm::mat3(m)));
+	scale = cbrt(fabs(glm::determinant(glm::mat3(m))));
+	position = glm::vec3(m[3]);
+}
+
+void MeshInstance::setPosition(const glm::vec3& p)
+{
+	glm::mat4 m = transform;
+	m[3] = glm::vec4(p, 1);
+	setTransform(m);
+}
+
+void MeshInstance::draw()
+{
+	ofPushMatrix();
+	ofMultMatrix(transform);
+	mesh->drawLevel(drawLod);
+	ofPopMatrix();
+}
+
+bool MeshInstance::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal)
+{
+	uint16_t material;
+	int primitive;
+	return intersect(ray, point, normal, material, primitive);
+}
+
+/*
+ * Intersect Ray with the instance by intersecting the shared geometry with
+ * the ray in object space
+ *
+ * @param const Ray& ray - given ray in world space
+ * @param glm::vec3& point - world space point of intersection
+ * @param glm::vec3& normal - world space normal at the intersection
+ * @param uint16_t& material - material id of the hit triangle
+ * @param int& primitive - index of the hit triangle
+ * @return bool - true if ray intersects the instance
+ */
+bool MeshInstance::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal, uint16_t& material, int& primitive)
+{
+	// the direction is not renormalized, so hit points come out in the right place
+	Ray local(glm::vec3(inverse * glm::vec4(ray.p, 1)), glm::vec3(inverse * glm::vec4(ray.d, 0)));
+
+	// skip the triangles of instances the ray misses entirely
+	if (hasBounds)
+	{
+		float t0 = 0, t1 = std::numeric_limits<float>::max();
+		for (int k = 0; k < 3; k++)
+		{
+			float inv = 1 / local.d[k];
+			float tNear = (localMin[k] - local.p[k]) * inv;
+			float tFar = (localMax[k] - local.p[k]) * inv;
+			if (tNear > tFar)
+				std::swap(tNear, tFar);
+			t0 = std::max(t0, tNear);
+			t1 = std::min(t1, tFar);
+			if (t0 > t1)
+				return false;
+		}
+	}
+
+	glm::vec3 p, n;
+	if (!mesh->intersect(local, p, n, material, primitive))
+		return false;
+	point = glm::vec3(transform * glm::vec4(p, 1));
+	normal = normalMatrix * n;
+	return true;
+}
+
+// texture coordinates from the shared geometry; the footprint scale is
+// converted from object to world units
+bool MeshInstance::getUV(const glm::vec3& point, int primitive, glm::vec2& uv, float& uvPerUnit)
+{
+	if (!mesh->getUV(glm::vec3(inverse * glm::vec4(point, 1)), primitive, uv, uvPerUnit))
+		return false;
+	if (scale > 0)
+		uvPerUnit /= scale;
+	return true;
+}
+
+// world space box around the transformed corners of the object space bounds
+bool MeshInstance::getBounds(glm::vec3& bmin, glm::vec3& bmax)
+{
+	if (!hasBounds)
+		return false;
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner((i & 1) ? localMax.x : localMin.x, (i & 2) ? localMax.y : localMin.y, (i & 4) ? localMax.z : localMin.z);
+		glm::vec3 w = glm::vec3(transform * glm::vec4(corner, 1));
+		bmin = i == 0 ? w : glm::min(bmin, w);
+		bmax = i == 0 ? w : glm::max(bmax, w);
+	}
+	return true;
+}
+
+/*
+ * Build the levels of detail, each level simplified from the full mesh on its
+ * own thread.  Texture coordinates and vertex normals are not kept, the levels
+ * are flat shaded.
+ *
+ * @param int levels - number of levels, level k has about 1/2^(k+1) of the triangles
+ */
+void Mesh::buildLods(int levels)
+{
+	float startTime = ofGetElapsedTimef();
+	vector<glm::vec3> fullVerts(numVertices());
+	for (int i = 0; i < numVertices(); i++)
+		fullVerts[i] = vertex(i);
+	vector<glm::ivec3> fullTris(numTriangles());
+	for (int t = 0; t < numTriangles(); t++)
+		fullTris[t] = triangle(t);
+
+	lods.clear();
+	lods.resize(levels);
+	vector<std::thread> threads;
+	for (int k = 0; k < levels; k++)
+		threads.push_back(std::thread([&, k]() {
+			MeshLod& lod = lods[k];
+			lod.verts = fullVerts;
+			lod.tInd = fullTris;
+			vector<int> source;
+			lod.error = simplifyMesh(lod.verts, lod.tInd, source, fullTris.size() >> (k + 1));
+			for (size_t t = 0; t < lod.tInd.size(); t++)
+			{
+				glm::ivec3 tri = lod.tInd[t];
+				lod.tNormal.push_back(glm::cross(lod.verts[tri[1]] - lod.verts[tri[0]], lod.verts[tri[2]] - lod.verts[tri[1]]));
+				if (!tMaterial.empty())
+					lod.tMaterial.push_back(tMaterial[source[t]]);
+			}
+		}));
+	for (auto& t : threads)
+		t.join();
+
+	// a level that could not be simplified further than the one before is no use
+	while (lods.size() > 1 && lods.back().tInd.size() >= lods[lods.size() - 2].tInd.size())
+		lods.pop_back();
+	cout << "built " << lods.size() << " mesh levels of detail in " << ofGetElapsedTimef() - startTime << " seconds:";
+	for (auto& lod : lods)
+		cout << " " << lod.tInd.size();
+	cout << " triangles" << endl;
+}
+
+// the levels of detail, built the first time they are needed unless the
+// mesh is small or the scene turned them off
+bool Mesh::ensureLods()
+{
+	if (!lodsTried)
+	{
+		lodsTried = true;
+		if (allowLods && numTriangles() >= lodMinTriangles)
+			buildLods();
+	}
+	return !lods.empty();
+}
+
+/*
+ * Pick the coarsest level whose simplification error projects to at most
+ * maxPixelError pixels
+ *
+ * @param float distance - distance from the eye to the mesh
+ * @param float pixelsPerRadian - screen resolution of the view
+ * @param float maxPixelError - allowed error in pixels
+ * @return int - level of detail, -1 = full detail
+ */
+int Mesh::selectLod(float distance, float pixelsPerRadian, float maxPixelError)
+{
+	int best = -1;
+	for (int k = 0; k < lods.size(); k++)
+		if (lods[k].error / std::max(distance, 1e-4f) * pixelsPerRadian <= maxPixelError)
+			best = k;
+	return best;
+}
+
+// same as intersect(), against the triangles of a level of detail
+bool Mesh::intersectLod(const MeshLod& lod, const Ray& ray, glm::vec3& point, glm::vec3& normal,
+	uint16_t& material, int& primitive)
+{
+	float tBest = numeric_limits<float>::max();
+	float betaBest = 0, gammaBest = 0;
+	int iTriBest = -1;
+	for (size_t i = 0; i < lod.tInd.size(); i++)
+	{
+		glm::vec3 v0 = lod.verts[lod.tInd[i][0]];
+		glm::vec3 c0 = v0 - lod.verts[lod.tInd[i][1]];
+		glm::vec3 c1 = v0 - lod.verts[lod.tInd[i][2]];
+		glm::vec3 c3 = v0 - ray.p;
+		float dt = calcDet3x3(c0, c1, ray.d);
+		if (dt == 0)
+			continue;
+		float beta = calcDet3x3(c3, c1, ray.d) / dt;
+		float gamma = calcDet3x3(c0, c3, ray.d) / dt;
+		if (beta < 0 || gamma < 0 || beta + gamma > 1)
+			continue;
+		float t = calcDet3x3(c0, c1, c3) / dt;
+		if (t < tBest)
+		{
+			tBest = t;
+			betaBest = beta;
+			gammaBest = gamma;
+			iTriBest = i;
+		}
+	}
+	if (iTriBest < 0)
+		return false;
+	glm::vec3 v0 = lod.verts[lod.tInd[iTriBest][0]];
+	glm::vec3 v1 = lod.verts[lod.tInd[iTriBest][1]];
+	glm::vec3 v2 = lod.verts[lod.tInd[iTriBest][2]];
+	point = v0 + betaBest * (v1 - v0) + gammaBest * (v2 - v0);
+	normal = lod.tNormal[iTriBest];
+	material = lod.tMaterial.empty() ? materialId : lod.tMaterial[iTriBest];
+	primitive = -1;		// no texture coordinates on simplified levels
+	return true;
+}
@@ -1,13 +1,45 @@
 #pragma once
 
 #include <vector>
+#include <map>
+#include <memory>
 #include <glm/gtx/intersect.hpp>
+#include <glm/gtc/type_precision.hpp>
 #include "ofApp.h"
 
 // By: Aramina Lee
 
 using namespace std;
 
+// determinant of the 3x3 matrix with columns v0, v1, v2 (for Cramer's rule)
+float calcDet3x3(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2);
+
+//  Simplified copy of a mesh for the viewport and preview renders
+//
+struct MeshLod {
+	vector<glm::vec3> verts;
+	vector<glm::ivec3> tInd;
+	vector<glm::vec3> tNormal;
+	vector<uint16_t> tMaterial;		// empty = the mesh's materialId
+	float error = 0;				// largest distance to the full detail surface (approximate)
+	ofVboMesh vbo;
+};
+
+//  Triangle mesh with optional per-vertex normal and texture coordinate streams
+//
+//  Positions, normals and uvs are separate arrays, each with its own index
+//  triple per triangle as in the .obj file, so shared attributes are stored
+//  once.  Memory per triangle: 12 B tInd + 12 B tNormal + 12 B tCentroid
+//  + 2 B tMaterial (if usemtl is used) + 12 B tNormInd + 12 B tUVInd (if
+//  the file has vn/vt), plus 12 B per vertex, 12 B per normal (4 B when
+//  packed to octahedral) and 8 B per uv.
+//
+//  compact() trades a little precision for memory on very large meshes:
+//  vertices are welded and quantized to 16 bits per axis within the mesh
+//  bounds (6 B), indices drop to 16 bits when there are at most 65536
+//  vertices (6 B per triangle), face normals are computed on demand and
+//  centroids are dropped, leaving 6 B per vertex and 6-12 B per triangle.
+//
 class Mesh : public SceneObject
 {
 public:
@@ -15,6 +47,39 @@ public:
 	vector<glm::ivec3> tInd;		// triangle vertex indices
 	vector<glm::vec3> tCentroid;	// world position of triangle centroids
 	vector<glm::vec3> tNormal;		// unit vectors of triangle normals
+	vector<uint16_t> tMaterial;		// material id per triangle (from usemtl), empty = materialId for all
+
+	vector<glm::vec3> normals;		// vertex normals (vn), unit length
+	vector<uint32_t> packedNormals;	// same, octahedral encoded, used instead after packNormals()
+	vector<glm::vec2> uvs;			// texture coordinates (vt)
+	vector<glm::ivec3> tNormInd;	// normal indices per triangle, empty = flat shading, -1 = none for this face
+	vector<glm::ivec3> tUVInd;		// uv indices per triangle, empty = no texture coordinates
+
+	// compact storage, replaces verts (and tInd if it fits) after compact()
+	bool isCompact = false;
+	vector<glm::u16vec3> qVerts;	// positions quantized within the bounds
+	glm::vec3 qMin, qScale;			// position = qMin + q * qScale
+	vector<glm::u16vec3> tInd16;	// 16 bit triangle indices, empty = tInd is used
+
+	// viewport copy of the triangles on the GPU, rebuilt when vboDirty is set
+	ofVboMesh vbo;
+	bool vboDirty = true;
+	glm::vec3 boundsMin, boundsMax;	// cached by getBounds(), reset boundsValid after moving vertices
+	bool boundsValid = false;
+
+	// quadric simplified levels of detail, each with about half the triangles
+	// of the one before; meshes with at least lodMinTriangles get them when
+	// ensureLods() first asks for them.  Only the viewport and the preview
+	// render use them, so loading a scene or rendering it without a window
+	// never builds them.
+	vector<MeshLod> lods;
+	int drawLod = -1;				// level drawn by draw(), -1 = full detail
+	int renderLod = -1;				// level intersected by rays, -1 = full detail
+	bool allowLods = true;			// false = never build levels (scene option nolod)
+	bool lodsTried = false;			// ensureLods() has run
+	static const int lodMinTriangles = 10000;
+
+	string fileName;				// file the mesh was loaded from, empty for the built in pyramid
 
 	// p is world position, meshFile = name of meshFile or NULL
 	Mesh(glm::vec3 p, const char* meshFile, ofColor diffuse);
@@ -23,6 +88,62 @@ public:
 	void loadFile(const char* fname);	// load mesh file
 	void printStats();					// print mesh statistics
 	void calcNormal();					// calculate normal of every triangle
-	void draw();						// draw mesh
+	void packNormals();					// quantize vertex normals to 32 bit octahedral encoding
+	glm::vec3 vertexNormal(int i);		// vertex normal i from whichever stream is in use
+	void compact();						// weld and quantize vertices, shrink indices, drop derived data
+	size_t memoryBytes();				// heap memory held by the mesh arrays
+	void buildLods(int levels = 4);		// simplify in parallel, one thread per level
+	bool ensureLods();					// build the levels on first use, false if there are none
+	int selectLod(float distance, float pixelsPerRadian, float maxPixelError = 1);	// coarsest level that looks the same
+	void drawLevel(int lod);
+	void setPosition(const glm::vec3& p);	// translate the vertices
+
+	// accessors that work in both the full precision and the compact layout
+	int numTriangles() { return tInd16.empty() ? tInd.size() : tInd16.size(); }
+	int numVertices() { return isCompact ? qVerts.size() : verts.size(); }
+	glm::vec3 vertex(int i) { return isCompact ? qMin + glm::vec3(qVerts[i]) * qScale : verts[i]; }
+	glm::ivec3 triangle(int t) { return tInd16.empty() ? tInd[t] : glm::ivec3(tInd16[t]); }
+	glm::vec3 faceNormal(int t);
+	void draw();						// draw mesh (uploads it to the GPU on first use)
 	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal);	// determine if ray intersects mesh
+	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal, uint16_t& material, int& primitive);	// also return material and index of the hit triangle
+	bool getUV(const glm::vec3& point, int primitive, glm::vec2& uv, float& uvPerUnit);	// interpolated texture coordinates
+	bool getBounds(glm::vec3& bmin, glm::vec3& bmax);	// bounding box of the vertices
+
+protected:
+	bool intersectLod(const MeshLod& lod, const Ray& ray, glm::vec3& point, glm::vec3& normal, uint16_t& material, int& primitive);
+};
+
+//  A placement of shared mesh geometry in the scene
+//
+//  The geometry is loaded once, in its own object space, and referenced by
+//  any number of instances.  Each instance only stores its transform; rays
+//  are transformed into object space when they are intersected.
+//
+class MeshInstance : public SceneObject
+{
+public:
+	MeshInstance(std::shared_ptr<Mesh> mesh, const glm::mat4& transform);
+
+	// geometry of a mesh file, loaded once and shared by all instances of it
+	static std::shared_ptr<Mesh> load(const char* meshFile, ofColor diffuse);
+
+	void setTransform(const glm::mat4& m);
+	void setPosition(const glm::vec3& p);	// move the instance, keeping its rotation and scale
+	void draw();
+	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal);
+	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal, uint16_t& material, int& primitive);
+	bool getUV(const glm::vec3& point, int primitive, glm::vec2& uv, float& uvPerUnit);
+	bool getBounds(glm::vec3& bmin, glm::vec3& bmax);
+
+	std::shared_ptr<Mesh> mesh;
+	glm::mat4 transform, inverse;		// object to world and back
+	glm::mat3 normalMatrix;				// inverse transpose, for normals
+	float scale = 1;					// average scale factor, for uv footprints
+	int drawLod = -1;					// level of detail drawn by draw(), -1 = full detail
+
+protected:
+	glm::vec3 localMin, localMax;		// bounds of the shared geometry
+	bool hasBounds = false;
+	static map<string, std::weak_ptr<Mesh>> loaded;
 };
@@ -1,5 +1,12 @@
+#include <unordered_map>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <typeinfo>
 #include "ofApp.h"
 #include "mesh.h"
+#include "texture.h"
+#include "clustermesh.h"
 
 /*
  * Intersect Ray with Plane  (wrapper on glm::intersect)
@@ -15,10 +22,53 @@ bool Plane::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normalAtInter
 	if (hit) {
 		Ray r = ray;
 		point = r.evalPoint(dist);
+		normalAtIntersect = this->normal;
 	}
 	return (hit);
 }
 
+/*
+ * Planar texture coordinates: distances along two axes in the plane,
+ * measured from the plane's position
+ *
+ * @param const glm::vec3& point - point on the plane
+ * @param int primitive - unused, a plane is a single surface
+ * @param glm::vec2& uv - texture coordinates
+ * @param float& uvPerUnit - uv units per world unit (always 1)
+ * @return bool - true
+ */
+bool Plane::getUV(const glm::vec3& point, int primitive, glm::vec2& uv, float& uvPerUnit) {
+	glm::vec3 n = glm::normalize(normal);
+	glm::vec3 t = fabs(n.y) > 0.9 ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+	glm::vec3 u = glm::normalize(glm::cross(t, n));
+	glm::vec3 v = glm::cross(n, u);
+	glm::vec3 d = point - position;
+	uv = glm::vec2(glm::dot(d, u), glm::dot(d, v));
+	uvPerUnit = 1;
+	return true;
+}
+
+// default batch intersection: one ray at a time, keeping the closer hit
+void SceneObject::intersectBatch(const vector<Ray>& rays, vector<PrimaryHit>& hits)
+{
+	glm::vec3 p, n;
+	uint16_t m;
+	int prim;
+	for (size_t i = 0; i < rays.size(); i++)
+	{
+		if (!intersect(rays[i], p, n, m, prim))
+			continue;
+		PrimaryHit& hit = hits[i];
+		if (hit.object != NULL && glm::dot(p - rays[i].p, p - rays[i].p) >= glm::dot(hit.pos - rays[i].p, hit.pos - rays[i].p))
+			continue;
+		hit.object = this;
+		hit.pos = p;
+		hit.norm = n;
+		hit.material = m;
+		hit.primitive = prim;
+	}
+}
+
 // Convert (u, v) to (x, y, z)
 // We assume u,v is in [0, 1]
 //
@@ -110,6 +160,7 @@ void ofApp::setup(){
 
 	topCam.setPosition(0, 25, 0);
 	topCam.lookAt(glm::vec3(0, -1, 0));
+	setupViewportDrawing();
 
 	previewCam.setPosition(renderCam.position);
 	previewCam.setNearClip(.1);
@@ -119,7 +170,37 @@ void ofApp::setup(){
 	gui.setup(); // most of the time you don't need a name
 	gui.add(intensity.setup("intensity", 0.5, 0, 1));
 	gui.add(power.setup("power", 10, 10, 10000));
+	gui.add(ptThreshold.setup("path trace error", 0.02, 0.001, 0.2));
+	gui.add(ptMaxDepth.setup("path trace depth", 5, 1, 16));
+	gui.add(samplerType.setup("sampler", SAMPLER_SOBOL, SAMPLER_WHITE, SAMPLER_BLUE_NOISE));
+	gui.add(bDenoise.setup("denoise", false));
+	gui.add(shadowSamplesMin.setup("shadow samples min", 4, 1, 16));
+	gui.add(shadowSamplesMax.setup("shadow samples max", 32, 1, 256));
+	gui.add(lightMode.setup("lights (all/sample/cull)", LIGHTS_ALL, LIGHTS_ALL, LIGHTS_CULL));
+	gui.add(lightSamples.setup("light samples", 4, 1, 32));
+	gui.add(lightCullThreshold.setup("light cull threshold", 0.01, 0, 0.2));
+	gui.add(textureCacheMB.setup("texture cache MB", 256, 16, 4096));
+	gui.add(pngLevel.setup("png compression", 6, 0, 9));
+	gui.add(bAovs.setup("write AOVs", false));
+	gui.add(bHotReload.setup("reload scene on save", true));
+	gui.add(bCheckpoint.setup("checkpoint renders", true));
+	gui.add(bTileCache.setup("cache tiles on disk", true));
+
+	// the scene from the command line, or the built in one
+	if (sceneFile.empty() || !loadScene(sceneFile))
+		buildDefaultScene();
+
+	image.allocate(imageWidth, imageHeight, OF_IMAGE_COLOR);
+	imageFile = "3_spheres_pyramid.png";
+	pathTraceFile = "3_spheres_pyramid_pt.png";
 
+	if (bServe)
+		renderServer.start(serverPort);
+}
+
+// the hard coded scene used when no scene file is given
+void ofApp::buildDefaultScene()
+{
 	// add 3 spheres and a pyramidal mesh
 	scene.push_back(new Sphere(glm::vec3(-2, -2, 3), 0.6, ofColor::lightSeaGreen));
 	scene.push_back(new Sphere(glm::vec3(-1, -1, 0), 1.5, ofColor::ivory));
@@ -127,24 +208,461 @@ void ofApp::setup(){
 	scene.push_back(new Mesh(glm::vec3(-5, -1, -5), NULL, ofColor::darkBlue));
 	// ground plane
 	//
-	scene.push_back(new Plane(glm::vec3(0, -2, 0), glm::vec3(0, 1, 0), ofColor::brown));
+	Plane* ground = new Plane(glm::vec3(0, -2, 0), glm::vec3(0, 1, 0), ofColor::brown);
+	scene.push_back(ground);
+
+	// texture the ground if there is an image for it in the data folder
+	if (ofFile::doesFileExist("ground.jpg"))
+	{
+		Material m;
+		m.name = "ground";
+		m.diffuse = ofColor::white;
+		m.diffuseMap = "ground.jpg";
+		m.textureScale = 0.25;		// one repeat every 4 units
+		ground->materialId = materials.add(m);
+	}
 	
 	// vertical plane
 	scene.push_back(new Plane(glm::vec3(0, -2, -10), glm::vec3(0, 0, 1), ofColor::greenYellow));
 
-	image.allocate(imageWidth, imageHeight, OF_IMAGE_COLOR);
-	imageFile = "3_spheres_pyramid.png";
-
 	// add 3 point light sources; light intensities are overridden by ofxFloatSlider
-	lights.push_back(new Light(glm::vec3(0, 10, 0), 0.5));
+	// the center light is a spherical area light and casts soft shadows
+	lights.push_back(new SphereLight(glm::vec3(0, 10, 0), 1.0, 0.5));
 	lights.push_back(new Light(glm::vec3(5, 10, 5), 0.5));
 	lights.push_back(new Light(glm::vec3(-7, 10, -7), 0.5));
 	ambientIntensity = 0.10;
 }
 
+/*
+ * Replace the scene with the contents of a scene file.  The file is parsed
+ * completely first, so a file with errors leaves the current scene alone.
+ *
+ * @param const string& fname - .scn or .scnb file, see SceneFile
+ * @return bool - false if the file could not be loaded
+ */
+bool ofApp::loadScene(const string& fname)
+{
+	uint64_t start = ofGetElapsedTimeMillis();
+	SceneFile desc;
+	if (!desc.load(fname))
+		return false;
+	uint64_t parsed = ofGetElapsedTimeMillis();
+
+	clearScene();
+	sceneFile = fname;
+	sceneStamp = fileStamp(fname);
+
+	// files named in the scene are looked up next to it first
+	string dir = ofFilePath::getEnclosingDirectory(fname);
+	auto resolve = [&](const string& file) {
+		string nextTo = ofFilePath::join(dir, file);
+		return ofFile::doesFileExist(nextTo) ? nextTo : file;
+	};
+
+	// material -1 is the default material 0
+	vector<uint16_t> ids(desc.materials.size() + 1, 0);
+	for (size_t i = 0; i < desc.materials.size(); i++)
+	{
+		Material m = desc.materials[i];
+		if (!m.diffuseMap.empty())
+			m.diffuseMap = resolve(m.diffuseMap);
+		ids[i + 1] = materials.add(m);
+	}
+	auto material = [&](int32_t m) { return ids[m + 1]; };
+
+	scene.reserve(desc.spheres.size() + desc.planes.size() + desc.meshes.size());
+	for (auto& rec : desc.spheres)
+	{
+		Sphere* s = new Sphere();
+		s->position = rec.center;
+		s->radius = rec.radius;
+		s->materialId = material(rec.material);
+		scene.push_back(s);
+	}
+	for (auto& rec : desc.planes)
+	{
+		Plane* p = new Plane(rec.point, rec.normal);
+		p->materialId = material(rec.material);
+		scene.push_back(p);
+	}
+	for (auto& rec : desc.meshes)
+	{
+		string file = rec.file == "pyramid" ? "" : resolve(rec.file);
+		SceneObject* obj;
+		if (rec.kind == SceneFile::MESH_CLUSTERED)
+			obj = new ClusteredMesh(file);
+		else
+		{
+			// instances of a file share one Mesh, the options apply to all of them
+			Mesh* mesh;
+			if (rec.kind == SceneFile::MESH_INSTANCE)
+			{
+				MeshInstance* instance = new MeshInstance(MeshInstance::load(file.c_str(), materials[0].diffuse), rec.transform);
+				mesh = instance->mesh.get();
+				obj = instance;
+			}
+			else
+				obj = mesh = new Mesh(glm::vec3(rec.transform[3]), file.empty() ? NULL : file.c_str(), materials[0].diffuse);
+			if (rec.flags & SceneFile::MESH_PACK_NORMALS)
+				mesh->packNormals();
+			if (rec.flags & SceneFile::MESH_COMPACT)
+				mesh->compact();
+			if (rec.flags & SceneFile::MESH_NO_LOD)
+				mesh->allowLods = false;
+		}
+		if (rec.material >= 0)
+			obj->materialId = material(rec.material);
+		scene.push_back(obj);
+	}
+	for (auto& rec : desc.lights)
+	{
+		if (rec.type == SceneFile::LIGHT_SPHERE)
+			lights.push_back(new SphereLight(rec.position, rec.radius, rec.intensity));
+		else if (rec.type == SceneFile::LIGHT_RECT)
+			lights.push_back(new RectLight(rec.position, rec.u, rec.v, rec.intensity));
+		else
+			lights.push_back(new Light(rec.position, rec.intensity));
+	}
+
+	// keys refer to the records in file order, objects were added spheres,
+	// planes, meshes
+	animation.start = desc.animStart;
+	animation.end = desc.animEnd;
+	animation.fps = desc.fps;
+	animation.framePattern = desc.framePattern;
+	for (auto& key : desc.keys)
+	{
+		switch (key.target)
+		{
+		case SceneFile::KEY_SPHERE:
+			animation.addKey(scene[key.index], Animation::GEOMETRY, key.time, key.position);
+			break;
+		case SceneFile::KEY_PLANE:
+			animation.addKey(scene[desc.spheres.size() + key.index], Animation::GEOMETRY, key.time, key.position);
+			break;
+		case SceneFile::KEY_MESH:
+			animation.addKey(scene[desc.spheres.size() + desc.planes.size() + key.index], Animation::GEOMETRY, key.time, key.position);
+			break;
+		case SceneFile::KEY_LIGHT:
+			animation.addKey(lights[key.index], Animation::LIGHTS, key.time, key.position);
+			break;
+		case SceneFile::KEY_CAMERA:
+			animation.addKey(&renderCam, Animation::CAMERA, key.time, key.position);
+			break;
+		}
+	}
+
+	if (desc.hasCamera)
+	{
+		renderCam.position = desc.cameraPos;
+		renderCam.view.position.z = desc.viewZ;
+		renderCam.view.setSize(desc.viewMin, desc.viewMax);
+		previewCam.setPosition(renderCam.position);
+	}
+	if (desc.width > 0)
+	{
+		imageWidth = desc.width;
+		imageHeight = desc.height;
+	}
+	ambientIntensity = desc.ambient;
+
+	cout << "Loaded " << fname << ": " << scene.size() << " objects, " << lights.size() << " lights, "
+		<< desc.materials.size() << " materials in " << ofGetElapsedTimeMillis() - start << " ms ("
+		<< parsed - start << " ms parsing)" << endl;
+	return true;
+}
+
+// delete every object, light and material of the current scene
+void ofApp::clearScene()
+{
+	pathTracer.stop();
+	for (auto obj : scene)
+		delete obj;
+	for (auto light : lights)
+		delete light;
+	scene.clear();
+	lights.clear();
+	primaryHits.clear();
+	shadowCasters.clear();
+	sceneGeneration++;		// cached occluders point at deleted objects
+	sceneBVHDirty = true;
+	dirtyRegions.invalidate();
+	animation.clear();
+	sequenceFrame = -1;
+	materials = MaterialTable();
+}
+
+// modification time of a file, 0 if it does not exist
+uint64_t ofApp::fileStamp(const string& fname)
+{
+	std::error_code error;
+	auto time = std::filesystem::last_write_time(ofToDataPath(fname), error);
+	return error ? 0 : (uint64_t)time.time_since_epoch().count();
+}
+
+// reload the scene file when it has been saved since it was loaded
+void ofApp::checkSceneReload()
+{
+	if (sceneFile.empty() || !bHotReload || ofGetElapsedTimef() - lastReloadCheck < 0.5)
+		return;
+	lastReloadCheck = ofGetElapsedTimef();
+	uint64_t stamp = fileStamp(sceneFile);
+	if (stamp == 0 || stamp == sceneStamp)
+		return;
+	sceneStamp = stamp;		// a file with errors is not retried until it changes again
+	cout << "Reloading " << sceneFile << endl;
+	loadScene(sceneFile);
+}
+
+// render every frame of the scene's animation, see renderSequenceFrame
+void ofApp::startSequence()
+{
+	if (animation.empty())
+	{
+		cout << "The scene has no animation keys" << endl;
+		return;
+	}
+	pathTracer.stop();
+	sequenceFrame = 0;
+	sequenceStart = ofGetElapsedTimeMillis();
+	framesReused = 0;
+	cout << "Rendering " << animation.numFrames() << " frames" << endl;
+}
+
+// Move the scene to the time of the next frame and render it.  The object
+// hierarchy is refit to the moved objects rather than rebuilt, and when only
+// lights moved the primary hits of the previous frame are shaded again
+// without tracing the camera rays.
+void ofApp::renderSequenceFrame()
+{
+	int changed = animation.apply(animation.frameTime(sequenceFrame));
+	bool reuseHits = sequenceFrame > 0 && (changed & (Animation::GEOMETRY | Animation::CAMERA)) == 0;
+	if (reuseHits)
+		framesReused++;
+	drawImage(false, reuseHits);
+
+	// written in the background while the next frame renders
+	char fname[1024];
+	snprintf(fname, sizeof(fname), animation.framePattern.c_str(), sequenceFrame);
+	imageSaver.save(image.getPixels(), fname, pngLevel);
+
+	if (++sequenceFrame < animation.numFrames())
+		return;
+	imageSaver.wait();
+	cout << "Rendered " << sequenceFrame << " frames in " << (ofGetElapsedTimeMillis() - sequenceStart) / 1000.0
+		<< " seconds, " << framesReused << " reused the primary hits" << endl;
+	sequenceFrame = -1;
+	animation.apply(animation.start);
+}
+
 //--------------------------------------------------------------
 void ofApp::update(){
+	checkSceneReload();
+	renderServer.poll();
+
+	// animation: one frame per update so the window shows the progress
+	if (sequenceFrame >= 0)
+		renderSequenceFrame();
+
+	// progressive path trace: one sample per active pixel each frame
+	if (pathTracer.isRunning())
+	{
+		if (pathTracer.renderPass())
+		{
+			pathTracer.toImage(image);
+			if (pathTracer.pass % 16 == 0)
+				pathTracer.printStats();
+		}
+		else
+		{
+			if (bDenoise)
+			{
+				pathTracer.getEstimate(colorBuffer);
+				denoiser.denoise(colorBuffer, pathTracer.gbuffer, colorBuffer);
+				colorBufferToImage(colorBuffer, imageWidth, imageHeight, image);
+				cout << "Denoised in " << denoiser.lastTime << " ms" << endl;
+			}
+			imageSaver.save(image.getPixels(), pathTraceFile, pngLevel);
+		}
+	}
+}
+
+// start a new progressive path trace with the current slider settings
+void ofApp::startPathTrace()
+{
+	pathTracer.threshold = ptThreshold;
+	pathTracer.maxDepth = ptMaxDepth;
+	pathTracer.samplerType = (SamplerType)(int)samplerType;
+	pathTracer.start(imageWidth, imageHeight);
+	bShowImage = true;
+}
+
+// vertex shader for instanced spheres: each instance scales and moves the
+// unit sphere and has its own color
+static const string sphereVertexShader = R"(#version 150
+uniform mat4 modelViewProjectionMatrix;
+in vec4 position;
+in vec4 instance;		// center xyz, radius w
+in vec4 instanceColor;
+out vec4 color;
+void main() {
+	color = instanceColor;
+	gl_Position = modelViewProjectionMatrix * vec4(position.xyz * instance.w + instance.xyz, 1.0);
+}
+)";
+
+static const string sphereFragmentShader = R"(#version 150
+in vec4 color;
+out vec4 outputColor;
+void main() {
+	outputColor = color;
+}
+)";
+
+// attribute locations after the ones openFrameworks uses (position, color, normal, texcoord)
+static const int instanceLocation = 4;
+static const int instanceColorLocation = 5;
+
+void ofApp::setupViewportDrawing()
+{
+	sphereMesh = ofMesh::sphere(1, 12);
+	instanceShader.setupShaderFromSource(GL_VERTEX_SHADER, sphereVertexShader);
+	instanceShader.setupShaderFromSource(GL_FRAGMENT_SHADER, sphereFragmentShader);
+	instanceShader.bindDefaults();
+	instanceShader.bindAttribute(instanceLocation, "instance");
+	instanceShader.bindAttribute(instanceColorLocation, "instanceColor");
+	if (!instanceShader.linkProgram())
+		cout << "instanced sphere shader failed, drawing spheres one at a time" << endl;
+}
+
+// draw the spheres with one instanced draw call of the unit sphere mesh
+void ofApp::drawSpheres(const vector<Sphere*>& spheres)
+{
+	if (spheres.empty())
+		return;
+	if (!instanceShader.isLoaded())
+	{
+		for (auto s : spheres)
+		{
+			ofSetColor(s->getMaterial().diffuse);
+			s->draw();
+		}
+		return;
+	}
+
+	sphereInstances.resize(spheres.size());
+	sphereColors.resize(spheres.size());
+	for (size_t i = 0; i < spheres.size(); i++)
+	{
+		const ofColor& c = spheres[i]->getMaterial().diffuse;
+		sphereInstances[i] = glm::vec4(spheres[i]->position, spheres[i]->radius);
+		sphereColors[i] = glm::vec4(c.r, c.g, c.b, c.a) / 255.0f;
+	}
+	ofVbo& vbo = sphereMesh.getVbo();
+	vbo.setAttributeData(instanceLocation, &sphereInstances[0].x, 4, sphereInstances.size(), GL_DYNAMIC_DRAW);
+	vbo.setAttributeDivisor(instanceLocation, 1);
+	vbo.setAttributeData(instanceColorLocation, &sphereColors[0].x, 4, sphereColors.size(), GL_DYNAMIC_DRAW);
+	vbo.setAttributeDivisor(instanceColorLocation, 1);
+
+	instanceShader.begin();
+	sphereMesh.drawInstanced(ofGetFill() == OF_FILLED ? OF_MESH_FILL : OF_MESH_WIREFRAME, spheres.size());
+	instanceShader.end();
+}
+
+/*
+ * Test an object's bounds against the view frustum planes, which are
+ * extracted from the rows of the view projection matrix
+ *
+ * @param const glm::mat4& viewProjection - camera view projection matrix
+ * @param SceneObject* obj - object to test
+ * @return bool - false if the object is certainly outside; unbounded objects are always inside
+ */
+bool ofApp::inFrustum(const glm::mat4& viewProjection, SceneObject* obj)
+{
+	glm::vec3 bmin, bmax;
+	if (!obj->getBounds(bmin, bmax))
+		return true;
+	glm::vec4 row[4];
+	for (int i = 0; i < 4; i++)
+		row[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+	for (int p = 0; p < 6; p++)
+	{
+		glm::vec4 plane = (p & 1) ? row[3] - row[p / 2] : row[3] + row[p / 2];
+		// the box corner furthest along the plane normal
+		glm::vec3 corner(plane.x > 0 ? bmax.x : bmin.x, plane.y > 0 ? bmax.y : bmin.y, plane.z > 0 ? bmax.z : bmin.z);
+		if (plane.x * corner.x + plane.y * corner.y + plane.z * corner.z + plane.w < 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Choose each mesh's level of detail from its distance to the eye, so the
+ * simplification error stays under a pixel
+ *
+ * @param const glm::vec3& eye - camera position
+ * @param float pixelsPerRadian - angular resolution of the view
+ * @param bool forRender - set the level rays intersect instead of the drawn one
+ */
+void ofApp::selectMeshLods(const glm::vec3& eye, float pixelsPerRadian, bool forRender)
+{
+	map<Mesh*, int> shared;		// finest level any instance of shared geometry needs
+	for (auto obj : scene)
+	{
+		Mesh* mesh = dynamic_cast<Mesh*>(obj);
+		MeshInstance* instance = dynamic_cast<MeshInstance*>(obj);
+		if (instance != NULL)
+			mesh = instance->mesh.get();
+		glm::vec3 bmin, bmax;
+		if (mesh == NULL || !mesh->ensureLods() || !obj->getBounds(bmin, bmax))
+			continue;
+		float distance = glm::length((bmin + bmax) * 0.5f - eye) - 0.5f * glm::length(bmax - bmin);
+		// error bounds are in object space, instances may be scaled
+		float scale = instance != NULL ? instance->scale : 1;
+		int lod = mesh->selectLod(distance / scale, pixelsPerRadian);
+
+		if (!forRender)
+		{
+			if (instance != NULL)
+				instance->drawLod = lod;
+			else
+				mesh->drawLod = lod;
+		}
+		else if (shared.find(mesh) == shared.end())
+			shared[mesh] = lod;
+		else if (lod < 0 || shared[mesh] < 0)
+			shared[mesh] = -1;
+		else
+			shared[mesh] = std::min(shared[mesh], lod);
+	}
+	for (auto& m : shared)
+		m.first->renderLod = m.second;
+}
 
+// quick low resolution render with simplified meshes, shown but not saved
+void ofApp::previewImage()
+{
+	int fullWidth = imageWidth, fullHeight = imageHeight;
+	imageWidth = std::max(1, fullWidth / previewScale);
+	imageHeight = std::max(1, fullHeight / previewScale);
+	selectMeshLods(renderCam.position, 1 / pixelSpread(), true);
+	float startTime = ofGetElapsedTimef();
+	drawImage(false);
+	cout << "Preview " << imageWidth << "x" << imageHeight << " in " << ofGetElapsedTimef() - startTime << " seconds" << endl;
+
+	// back to full detail for everything else
+	for (auto obj : scene)
+	{
+		Mesh* mesh = dynamic_cast<Mesh*>(obj);
+		MeshInstance* instance = dynamic_cast<MeshInstance*>(obj);
+		if (instance != NULL)
+			mesh = instance->mesh.get();
+		if (mesh != NULL)
+			mesh->renderLod = -1;
+	}
+	imageWidth = fullWidth;
+	imageHeight = fullHeight;
+	bShowImage = true;
 }
 
 //--------------------------------------------------------------
@@ -162,16 +680,28 @@ void ofApp::draw(){
 	ofSetColor(ofColor::green);
 	ofNoFill();
 
-	//  draw objects in scene
+	//  draw objects in scene, spheres are collected and drawn together
 	//
+	glm::mat4 viewProjection = theCam->getModelViewProjectionMatrix();
+	selectMeshLods(theCam->getPosition(), ofGetHeight() / ofDegToRad(theCam->getFov()), false);
+	vector<Sphere*> spheres;
 	for (int i = 0; i < scene.size(); i++) {
-		ofSetColor(scene[i]->diffuseColor);
+		if (!inFrustum(viewProjection, scene[i]))
+			continue;
+		Sphere* sphere = dynamic_cast<Sphere*>(scene[i]);
+		if (sphere != NULL)
+		{
+			spheres.push_back(sphere);
+			continue;
+		}
+		ofSetColor(scene[i]->getMaterial().diffuse);
 		scene[i]->draw();
 	}
+	drawSpheres(spheres);
 	
 	// draw light sources in scene
 	for (int i = 0; i < lights.size(); i++) {
-		ofSetColor(lights[i]->diffuseColor);
+		ofSetColor(lights[i]->getMaterial().diffuse);
 		lights[i]->draw();
 	}
 
@@ -185,6 +715,12 @@ void ofApp::draw(){
 	theCam->end();
 
 	ofDisableDepthTest();
+	// show the render (e.g. the converging path trace) scaled into the window
+	if (bShowImage)
+	{
+		ofSetColor(ofColor::white);
+		image.draw(0, 0, ofGetWidth(), ofGetWidth() * imageHeight / imageWidth);
+	}
 	/*if (!bHide)
 		ofEnableDepthTest();
 	else
@@ -193,62 +729,716 @@ void ofApp::draw(){
 }
 
 // draw image in ViewFinder using Lambertian Shading, Phong Shading, and ambient lighting
-void ofApp::drawImage()
+void ofApp::drawImage(bool save, bool reuseHits)
 {
 	// for each pixel in image
-	float u = 0;
-	float v = 0;
 	float pixelWidth = 1.0 / imageWidth;
 	float pixelHeight = 1.0 / imageHeight;
-	for (size_t x = 0; x < imageWidth; x++, u += pixelWidth) {
-		v = 0;
-		for (size_t y = 0; y < imageHeight; y++, v += pixelHeight) {
-			ofColor L = ofColor::black;
+	int numPixels = imageWidth * imageHeight;
+	if (image.getWidth() != imageWidth || image.getHeight() != imageHeight)
+		image.allocate(imageWidth, imageHeight, OF_IMAGE_COLOR);	// after a preview
+	gbuffer.allocate(imageWidth, imageHeight);
+	colorBuffer.resize(numPixels);
+	std::unordered_map<SceneObject*, int> objectIds;		// scene index + 1 for the id pass
+	if (bAovs)
+	{
+		aovs.allocate(imageWidth, imageHeight);
+		for (size_t k = 0; k < scene.size(); k++)
+			objectIds[scene[k]] = k + 1;
+	}
+	vector<float> visibility;
+	uint64_t start = ofGetElapsedTimeMillis();
+	prepareRender();
+	dirtyRegions.allocate(numPixels);
+
+	// first pass: find the closest object and its material for every pixel,
+	// one object at a time so objects can group the rays by the data they touch
+	vector<Ray> cameraRays;
+	cameraRays.reserve(numPixels);
+	for (size_t y = 0; y < imageHeight; y++)
+		for (size_t x = 0; x < imageWidth; x++)
+			cameraRays.push_back(renderCam.getRay(x * pixelWidth, y * pixelHeight));	// camera to image pixel
+	if (!reuseHits || primaryHits.size() != numPixels)
+		findIntersections(cameraRays, primaryHits);
+
+	// group the pixels by material (counting sort) so each batch is shaded
+	// with the same material parameters
+	vector<int> batchStart(materials.size() + 1, 0);
+	for (auto& hit : primaryHits)
+		if (hit.object != NULL)
+			batchStart[hit.material + 1]++;
+	for (size_t m = 1; m < batchStart.size(); m++)
+		batchStart[m] += batchStart[m - 1];
+	vector<int> order(batchStart.back());
+	vector<int> fill(batchStart.begin(), batchStart.end() - 1);
+	for (int i = 0; i < numPixels; i++)
+		if (primaryHits[i].object != NULL)
+			order[fill[primaryHits[i].material]++] = i;
+
+	// second pass: shade one material at a time, background stays black
+	std::fill(colorBuffer.begin(), colorBuffer.end(), glm::vec3(0, 0, 0));
+	for (int x = 0; x < imageWidth; x++)
+		for (int y = 0; y < imageHeight; y++)
+			image.setColor(x, imageHeight - y - 1, ofColor::black);
+
+	// Saved renders keep a checkpoint: the number of pixels shaded (in the
+	// material order, which is the same every run) and their colors.  A run
+	// of the same render that was killed is picked up where it stopped.
+	RenderCheckpoint checkpoint;
+	int64_t resumed = 0;
+	size_t snapshotBytes = sizeof(int64_t) + numPixels * sizeof(glm::vec3);
+	if (save && bCheckpoint && !bAovs)
+	{
+		uint64_t hash = sceneHash();
+		if (checkpoint.open(checkpointFile("image", hash), hash, snapshotBytes) && checkpoint.current() != NULL)
+		{
+			const char* snapshot = checkpoint.current();
+			memcpy(&resumed, snapshot, sizeof(int64_t));
+			memcpy(colorBuffer.data(), snapshot + sizeof(int64_t), numPixels * sizeof(glm::vec3));
+			cout << "Resuming from checkpoint, " << 100 * resumed / std::max(1, batchStart.back()) << "% already shaded" << endl;
+		}
+	}
 
-			// translate (u,v) position to 3D world position
-			glm::vec3 pixelPos = renderCam.view.toWorld(u, v);
-			
-			// create ray from camera position to image pixel position
-			Ray cameraToImage = renderCam.getRay(u, v);
-
-			// find intersection point and normal of closest object to camera/image
-			glm::vec3 intersectPos;
-			glm::vec3 intersectNorm;
-			SceneObject* intersectScene = NULL;
-			if ((intersectScene = findIntersection(cameraToImage, intersectPos, intersectNorm)) != NULL)
+	for (size_t m = 0; m + 1 < batchStart.size(); m++)
+	{
+		const Material& mat = materials[m];
+		for (int k = batchStart[m]; k < batchStart[m + 1]; k++)
+		{
+			int i = order[k];
+			int x = i % imageWidth;
+			int y = i / imageWidth;
+			const PrimaryHit& hit = primaryHits[i];
+			Ray cameraToImage = renderCam.getRay(x * pixelWidth, y * pixelHeight);
+
+			// save the primary hit for the denoiser
+			float width = glm::length(hit.pos - renderCam.position) * pixelSpread();
+			glm::vec3 albedo = surfaceDiffuse(hit, mat, cameraToImage.d, width);
+			gbuffer.set(i, glm::normalize(hit.norm), glm::length(hit.pos - renderCam.position), albedo);
+			if (k < resumed)
 			{
-				// Calculate lambert shading
-				L = L + lambert(intersectPos, intersectNorm, intersectScene->diffuseColor);
-				
-				// Calculate Phong shading
-				L = L + phong(intersectPos, intersectNorm, intersectScene->diffuseColor, intersectScene->specularColor, power);
-
-				// Calculate the ambient shading, set ambient color same as diffuse
-				ofColor ambientCoef = intersectScene->diffuseColor;
-				ofColor La = ambientCoef * ambientIntensity;	// La = ambient coefficient * Ia
-				L = L + La;
-
-				// Calculate distance from image to intersection point
-				glm::vec3 pixelToIntersect = intersectPos - pixelPos;
-				float dist2 = glm::dot(pixelToIntersect, pixelToIntersect);
-
-				// Scale the combined shading intensity by distance
-				//L = L / dist2 * 20;
+				dirtyRegions.markUnknown(i);
+				glm::vec3 c = colorBuffer[i] * 255.0f;
+				image.setColor(x, imageHeight - y - 1, ofColor(c.x, c.y, c.z));
+				continue;
 			}
+
+			// remember the objects the pixel depends on, for redrawDirty
+			dirtyRegions.startPixel(i);
+			DirtyRegions::record(hit.object);
+			ShadeComponents parts;
+			ofColor L = shade(cameraToImage, hit, mat, x, y, visibility, 0, bAovs ? &parts : NULL);
+			colorBuffer[i] = glm::vec3(L.r, L.g, L.b) / 255.0f;
+			if (bAovs)
+				aovs.set(i, colorBuffer[i], glm::length(hit.pos - renderCam.position), glm::normalize(hit.norm),
+						 objectIds[hit.object], parts);
 			// Store in image pixel
 			image.setColor(x, imageHeight - y - 1, L);		// invert image
+
+			if (checkpoint.isOpen() && k % 1024 == 0 && checkpoint.due(checkpointSeconds))
+			{
+				char* snapshot = checkpoint.next();
+				int64_t done = k + 1;
+				memcpy(snapshot, &done, sizeof(int64_t));
+				memcpy(snapshot + sizeof(int64_t), colorBuffer.data(), numPixels * sizeof(glm::vec3));
+				checkpoint.commit();
+			}
 		}
 	}
+	DirtyRegions::stopRecording();
+	dirtyRegions.snapshot(this);
+	if (checkpoint.isOpen())
+		checkpoint.remove();		// finished, nothing to resume
+	cout << "Rendered in " << ofGetElapsedTimeMillis() - start << " ms" << endl;
+	printRenderStats();
+	if (bDenoise)
+	{
+		denoiser.denoise(colorBuffer, gbuffer, colorBuffer);
+		colorBufferToImage(colorBuffer, imageWidth, imageHeight, image);
+		cout << "Denoised in " << denoiser.lastTime << " ms" << endl;
+	}
 	// Save image to file
 	image.update();
 	//image.draw(0,0,0);
+	if (!save)
+		return;
 
-	cout << "Save image " << imageFile;
-	bool saved = image.save(imageFile);
-	if (saved)
-		cout << "... done" << endl;
+	// encoded in the background while the next render runs
+	imageSaver.save(image.getPixels(), imageFile, pngLevel);
+
+	// the passes come from the same trace, the beauty pass is not denoised
+	if (bAovs)
+	{
+		uint64_t saveStart = ofGetElapsedTimeMillis();
+		if (aovs.save(aovFile))
+			cout << "Saved AOVs " << aovFile << " in " << ofGetElapsedTimeMillis() - saveStart << " ms" << endl;
+		else
+			cout << "Save AOVs " << aovFile << " failed" << endl;
+	}
+}
+
+/*
+ * Update the image of the last drawImage after objects moved or changed
+ * material, re-tracing only the pixels those changes can reach (see
+ * DirtyRegions).  The result is not denoised and has no AOVs.
+ *
+ * @return bool - false if nothing was rendered because the changes need a full render
+ */
+bool ofApp::redrawDirty()
+{
+	if (bAovs || bDenoise || !dirtyRegions.canUpdate(this))
+		return false;
+	uint64_t start = ofGetElapsedTimeMillis();
+	prepareRender();
+	vector<char> dirty;
+	int numPixels = imageWidth * imageHeight;
+	int count = dirtyRegions.findDirty(this, dirty);
+
+	float pixelWidth = 1.0 / imageWidth;
+	float pixelHeight = 1.0 / imageHeight;
+	vector<float> visibility;
+	for (int i = 0; i < numPixels; i++)
+	{
+		if (!dirty[i])
+			continue;
+		int x = i % imageWidth;
+		int y = i / imageWidth;
+		Ray cameraToImage = renderCam.getRay(x * pixelWidth, y * pixelHeight);
+		PrimaryHit& hit = primaryHits[i];
+		findIntersection(cameraToImage, hit);
+		dirtyRegions.startPixel(i);
+		ofColor L = ofColor::black;
+		if (hit.object != NULL)
+		{
+			DirtyRegions::record(hit.object);
+			const Material& mat = materials[hit.material];
+			float width = glm::length(hit.pos - renderCam.position) * pixelSpread();
+			gbuffer.set(i, glm::normalize(hit.norm), glm::length(hit.pos - renderCam.position),
+						surfaceDiffuse(hit, mat, cameraToImage.d, width));
+			L = shade(cameraToImage, hit, mat, x, y, visibility);
+		}
+		else
+			gbuffer.set(i, glm::vec3(0, 0, 0), 0, glm::vec3(0, 0, 0));
+		colorBuffer[i] = glm::vec3(L.r, L.g, L.b) / 255.0f;
+		image.setColor(x, imageHeight - y - 1, L);
+	}
+	DirtyRegions::stopRecording();
+	dirtyRegions.snapshot(this);
+	image.update();
+	cout << "Re-rendered " << count << " of " << numPixels << " pixels (" << 100.0 * count / numPixels << "%), "
+		<< dirtyRegions.changedObjects << " objects changed, in " << ofGetElapsedTimeMillis() - start << " ms" << endl;
+	printRenderStats();
+	return true;
+}
+
+// build the per render acceleration data and reset the statistics
+void ofApp::prepareRender()
+{
+	for (size_t k = 0; k < scene.size(); k++)
+		scene[k]->sceneIndex = k;
+	updateSceneBVH();
+	shadowLookups = shadowRays = 0;
+	lightBVH.build(lights);
+	buildShadowCasters();
+	resetOccluderStats();
+	materials.loadTextures();
+	textures.setMemoryCap((size_t)(textureCacheMB * 1024 * 1024));
+	textures.resetStats();
+	ClusteredMesh::resetStats();
+	tileCache.resetStats();
+}
+
+/*
+ * Hash of everything that changes the pixels of drawImage, so a checkpoint
+ * is only resumed into the render it was taken from.  Meshes contribute
+ * their file (name, size and a content hash, see hashFile), triangle
+ * count, level of detail and bounds rather than every vertex.
+ *
+ * @return uint64_t - 64 bit FNV-1a hash
+ */
+uint64_t ofApp::sceneHash()
+{
+	uint64_t h = hashSeed;
+	hashValue(h, imageWidth);
+	hashValue(h, imageHeight);
+	hashValue(h, renderCam.position);
+	hashValue(h, renderCam.view.position);
+	hashValue(h, renderCam.view.min);
+	hashValue(h, renderCam.view.max);
+	for (auto obj : scene)
+		hashObject(h, obj);
+	for (auto light : lights)
+	{
+		glm::vec3 bmin, bmax;
+		light->getBounds(bmin, bmax);
+		hashValue(h, light->position);
+		hashValue(h, light->intensity);
+		hashValue(h, bmin);
+		hashValue(h, bmax);
+	}
+	for (auto& m : materials.materials)
+		hashMaterial(h, m);
+	float settings[] = { intensity, power, ambientIntensity, lightCullThreshold };
+	int modes[] = { shadowSamplesMin, shadowSamplesMax, lightMode, lightSamples, maxReflectionDepth };
+	hashValue(h, settings);
+	hashValue(h, modes);
+	return h;
+}
+
+// add what an object looks like to a hash: type, placement, size and material id
+void ofApp::hashObject(uint64_t& h, SceneObject* obj)
+{
+	hashBytes(h, typeid(*obj).name(), strlen(typeid(*obj).name()));
+	hashValue(h, obj->position);
+	hashValue(h, obj->materialId);
+	hashValue(h, obj->castShadows);
+	hashValue(h, obj->receiveShadows);
+	glm::vec3 bmin, bmax;
+	if (obj->getBounds(bmin, bmax))
+	{
+		hashValue(h, bmin);
+		hashValue(h, bmax);
+	}
+	if (Plane* plane = dynamic_cast<Plane*>(obj))
+		hashValue(h, plane->normal);
+	if (Mesh* mesh = dynamic_cast<Mesh*>(obj))
+	{
+		hashValue(h, mesh->numTriangles());
+		hashValue(h, mesh->renderLod);
+		hashFile(h, mesh->fileName);
+	}
+	if (MeshInstance* instance = dynamic_cast<MeshInstance*>(obj))
+		hashFile(h, instance->mesh->fileName);
+	if (ClusteredMesh* clustered = dynamic_cast<ClusteredMesh*>(obj))
+		hashFile(h, clustered->getFileName());
+}
+
+void ofApp::hashMaterial(uint64_t& h, const Material& m)
+{
+	hashValue(h, m.diffuse);
+	hashValue(h, m.specular);
+	hashValue(h, m.exponent);
+	hashValue(h, m.reflectivity);
+	hashValue(h, m.textureScale);
+	hashFile(h, m.diffuseMap);
+}
+
+/*
+ * Add a file's name, size and contents to a hash, so editing a mesh or
+ * texture in place changes the hash.  The name without its directory and
+ * the contents rather than the modification time, so workers with a copy
+ * of the data folder elsewhere agree; the contents are only read again
+ * when the size or modification time changed.
+ *
+ * @param uint64_t& h - hash to add to
+ * @param const string& fname - file, relative to the data folder; empty = no file
+ */
+void ofApp::hashFile(uint64_t& h, const string& fname)
+{
+	if (fname.empty())
+		return;
+	string name = ofFilePath::getFileName(fname);
+	hashBytes(h, name.data(), name.size());
+	struct Stamp { uint64_t size, time, hash; };
+	static map<string, Stamp> stamps;
+	static std::mutex mutex;
+
+	string path = ofToDataPath(fname);
+	std::error_code error;
+	Stamp stamp;
+	stamp.size = std::filesystem::file_size(path, error);
+	if (error)
+		stamp.size = 0;
+	auto time = std::filesystem::last_write_time(path, error);
+	stamp.time = error ? 0 : (uint64_t)time.time_since_epoch().count();
+	stamp.hash = hashSeed;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = stamps.find(path);
+	if (found != stamps.end() && found->second.size == stamp.size && found->second.time == stamp.time)
+		stamp.hash = found->second.hash;
 	else
-		cout << " failed" << endl;
+	{
+		std::ifstream in(path, std::ios::binary);
+		vector<char> buffer(1 << 20);
+		while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0)
+			hashBytes(stamp.hash, buffer.data(), in.gcount());
+		stamps[path] = stamp;
+	}
+	hashValue(h, stamp.size);
+	hashValue(h, stamp.hash);
+}
+
+// checkpoint file of a render kind ("image", "pathtrace") and scene hash
+string ofApp::checkpointFile(const string& kind, uint64_t hash)
+{
+	return kind + "_" + ofToHex(hash) + ".ckpt";
+}
+
+// build the object hierarchy after the scene changed, else refit it to
+// wherever the objects have moved
+void ofApp::updateSceneBVH()
+{
+	if (sceneBVHDirty || sceneBVH.numObjects() + sceneBVH.others.size() != scene.size())
+	{
+		sceneBVH.build(scene);
+		sceneBVHDirty = false;
+	}
+	else
+		sceneBVH.refit();
+}
+
+void ofApp::printRenderStats()
+{
+	size_t casters = 0;
+	for (auto& list : shadowCasters)
+		casters += list.size();
+	if (!shadowCasters.empty())
+		cout << "Shadow casters: " << casters << " of " << scene.size() * lights.size()
+			 << " light/object pairs" << endl;
+	if (shadowLookups > 0)
+		cout << "Area light shadow rays per lookup: " << (float)shadowRays / shadowLookups << endl;
+	printOccluderStats();
+	textures.printStats();
+	ClusteredMesh::printStats();
+	tileCache.printStats();
+}
+
+/*
+ * Render an image of any size straight to disk, a strip of rows at a time,
+ * so memory use depends on the strip and not on the image size.  The result
+ * is not denoised, the denoiser needs the whole frame.
+ *
+ * @param const string& fname - .tif or .ppm file, see StreamImageWriter
+ * @param int width, height - image size in pixels
+ * @param int stripRows - rows rendered and written together
+ */
+void ofApp::renderToFile(const string& fname, int width, int height, int stripRows)
+{
+	StreamImageWriter writer;
+	if (!writer.open(fname, width, height))
+		return;
+	float startTime = ofGetElapsedTimef();
+
+	// the pixel footprint for texture filtering follows the output size
+	int fullWidth = imageWidth, fullHeight = imageHeight;
+	imageWidth = width;
+	imageHeight = height;
+	prepareRender();
+
+	// each strip is rendered as square tiles, so unchanged ones come from the tile cache
+	vector<unsigned char> rgb((size_t)stripRows * width * 3), tile;
+	int lastPercent = -1;
+	for (int top = 0; top < height; top += stripRows)
+	{
+		int rows = std::min(stripRows, height - top);
+		for (int left = 0; left < width; left += stripRows)
+		{
+			int cols = std::min(stripRows, width - left);
+			renderTile(left, top, left + cols, top + rows, tile);
+			for (int r = 0; r < rows; r++)
+				memcpy(&rgb[((size_t)r * width + left) * 3], &tile[(size_t)r * cols * 3], cols * 3);
+		}
+		if (!writer.writeRows(rgb.data(), rows))
+			break;
+
+		int percent = 100 * (top + rows) / height;
+		if (percent / 10 != lastPercent / 10)
+		{
+			cout << "Rendered " << percent << "%" << endl;
+			lastPercent = percent;
+		}
+	}
+	bool ok = writer.close();
+	imageWidth = fullWidth;
+	imageHeight = fullHeight;
+	printRenderStats();
+	if (ok)
+		cout << "Wrote " << width << "x" << height << " " << fname << " in " << ofGetElapsedTimef() - startTime << " seconds" << endl;
+}
+
+/*
+ * Render a rectangle of the image on its own, without the material batching
+ * and denoising of drawImage, for renders that are split into pieces.
+ * prepareRender() must have been called.
+ *
+ * @param int x0, y0, x1, y1 - pixels [x0, x1) x [y0, y1), rows counted from the top
+ * @param vector<unsigned char>& rgb - the pixels, top row first
+ */
+void ofApp::renderRegion(int x0, int y0, int x1, int y1, vector<unsigned char>& rgb)
+{
+	// output rows go top down, camera rows bottom up
+	int width = x1 - x0;
+	vector<Ray> rays;
+	vector<PrimaryHit> hits;
+	vector<float> visibility;
+	rays.reserve((size_t)width * (y1 - y0));
+	for (int r = y0; r < y1; r++)
+		for (int x = x0; x < x1; x++)
+			rays.push_back(renderCam.getRay((float)x / imageWidth, (float)(imageHeight - 1 - r) / imageHeight));
+	findIntersections(rays, hits);
+
+	rgb.resize(hits.size() * 3);
+	for (size_t i = 0; i < hits.size(); i++)
+	{
+		ofColor L = ofColor::black;
+		if (hits[i].object != NULL)
+			L = shade(rays[i], hits[i], materials[hits[i].material], x0 + i % width, imageHeight - 1 - (y0 + i / width), visibility);
+		rgb[i * 3] = L.r;
+		rgb[i * 3 + 1] = L.g;
+		rgb[i * 3 + 2] = L.b;
+	}
+}
+
+// true if the tile cache is on and its directory can be used
+bool ofApp::useTileCache()
+{
+	return bTileCache && (tileCache.isOpen() || tileCache.open(tileCacheDir));
+}
+
+void ofApp::renderTile(int x0, int y0, int x1, int y1, vector<unsigned char>& rgb)
+{
+	if (!useTileCache())
+	{
+		renderRegion(x0, y0, x1, y1, rgb);
+		return;
+	}
+	uint64_t key = tileCache.key(this, x0, y0, x1, y1);
+	if (tileCache.load(key, x1 - x0, y1 - y0, rgb))
+		return;
+	renderRegion(x0, y0, x1, y1, rgb);
+	tileCache.store(key, x1 - x0, y1 - y0, rgb);
+}
+
+// render the image with worker processes and save it, see RenderCoordinator
+void ofApp::renderDistributed()
+{
+	pathTracer.stop();
+	RenderCoordinator coordinator(this);
+	int workers = localWorkers >= 0 ? localWorkers : std::max(1u, std::thread::hardware_concurrency());
+	if (!coordinator.render(renderPort, workers))
+		return;
+	imageSaver.save(image.getPixels(), distributedFile, pngLevel);
+	bShowImage = true;
+}
+
+// the slider values, image size and camera, for another process to render with
+RenderSettings ofApp::getRenderSettings()
+{
+	RenderSettings s;
+	s.width = imageWidth;
+	s.height = imageHeight;
+	s.cameraPos = renderCam.position;
+	s.viewZ = renderCam.view.position.z;
+	s.viewMin = renderCam.view.min;
+	s.viewMax = renderCam.view.max;
+	s.intensity = intensity;
+	s.power = power;
+	s.ambient = ambientIntensity;
+	s.lightCullThreshold = lightCullThreshold;
+	s.textureCacheMB = textureCacheMB;
+	s.shadowSamplesMin = shadowSamplesMin;
+	s.shadowSamplesMax = shadowSamplesMax;
+	s.lightMode = lightMode;
+	s.lightSamples = lightSamples;
+	s.maxReflectionDepth = maxReflectionDepth;
+	return s;
+}
+
+void ofApp::applyRenderSettings(const RenderSettings& s)
+{
+	imageWidth = s.width;
+	imageHeight = s.height;
+	renderCam.position = s.cameraPos;
+	renderCam.view.position.z = s.viewZ;
+	renderCam.view.setSize(s.viewMin, s.viewMax);
+	intensity = s.intensity;
+	power = s.power;
+	ambientIntensity = s.ambient;
+	lightCullThreshold = s.lightCullThreshold;
+	textureCacheMB = s.textureCacheMB;
+	shadowSamplesMin = s.shadowSamplesMin;
+	shadowSamplesMax = s.shadowSamplesMax;
+	lightMode = s.lightMode;
+	lightSamples = s.lightSamples;
+	maxReflectionDepth = s.maxReflectionDepth;
+}
+
+// A/B test for the denoiser: path trace a high sample count reference, then
+// a low sample count image, denoise it and report time saved against PSNR
+void ofApp::denoiseCompare()
+{
+	const int refSpp = 256;
+	const int lowSpp = 8;
+	vector<glm::vec3> reference, noisy, denoised;
+
+	uint64_t start = ofGetElapsedTimeMillis();
+	pathTracer.renderSamples(imageWidth, imageHeight, refSpp);
+	float refTime = ofGetElapsedTimeMillis() - start;
+	pathTracer.getEstimate(reference);
+
+	start = ofGetElapsedTimeMillis();
+	pathTracer.renderSamples(imageWidth, imageHeight, lowSpp);
+	float lowTime = ofGetElapsedTimeMillis() - start;
+	pathTracer.getEstimate(noisy);
+	denoiser.denoise(noisy, pathTracer.gbuffer, denoised);
+
+	float totalTime = lowTime + denoiser.lastTime;
+	cout << "Denoise A/B at " << imageWidth << "x" << imageHeight << endl;
+	cout << "  reference  " << refSpp << " spp: " << refTime << " ms" << endl;
+	cout << "  noisy      " << lowSpp << " spp: " << lowTime << " ms, PSNR " << psnr(noisy, reference) << " dB" << endl;
+	cout << "  denoised   " << lowSpp << " spp: " << totalTime << " ms (filter " << denoiser.lastTime
+		 << " ms), PSNR " << psnr(denoised, reference) << " dB" << endl;
+	cout << "  time saved " << refTime - totalTime << " ms (" << 100 * (1 - totalTime / refTime) << "%)" << endl;
+
+	colorBufferToImage(denoised, imageWidth, imageHeight, image);
+	bShowImage = true;
+}
+
+// Measure the error of stochastic light selection and light culling against
+// the exhaustive loop over all lights, and the time each one takes
+void ofApp::lightSelectionError()
+{
+	int savedMode = lightMode;
+	cout << "Light selection error with " << lights.size() << " lights" << endl;
+
+	lightMode = LIGHTS_ALL;
+	uint64_t start = ofGetElapsedTimeMillis();
+	drawImage(false);
+	float allTime = ofGetElapsedTimeMillis() - start;
+	vector<glm::vec3> reference = colorBuffer;
+	cout << "  all lights: " << allTime << " ms" << endl;
+
+	const char* names[] = { "all", "sample", "cull" };
+	for (int mode = LIGHTS_SAMPLE; mode <= LIGHTS_CULL; mode++)
+	{
+		lightMode = mode;
+		start = ofGetElapsedTimeMillis();
+		drawImage(false);
+		float time = ofGetElapsedTimeMillis() - start;
+		double se = 0;
+		for (size_t i = 0; i < reference.size(); i++)
+		{
+			glm::vec3 d = colorBuffer[i] - reference[i];
+			se += glm::dot(d, d);
+		}
+		cout << "  " << names[mode] << ": " << time << " ms, RMSE " << sqrt(se / (3 * reference.size()))
+			 << ", PSNR " << psnr(colorBuffer, reference) << " dB" << endl;
+	}
+	lightMode = savedMode;
+}
+
+/*
+ * Shade a ray/surface hit with Lambert, Blinn-Phong and ambient terms, plus a
+ * mirror reflection for reflective materials
+ *
+ * @param const Ray& ray - ray that found the hit
+ * @param const PrimaryHit& hit - hit position, normal and object
+ * @param const Material& mat - material at the hit
+ * @param int x, y - pixel, selects the shadow sample pattern
+ * @param vector<float>& visibility - scratch buffer for the light visibility
+ * @param int depth - reflection depth, 0 for camera rays
+ * @param ShadeComponents* parts - optional output, diffuse/specular/shadow split for the AOVs
+ * @return ofColor - shaded color
+ */
+ofColor ofApp::shade(const Ray& ray, const PrimaryHit& hit, const Material& mat, int x, int y,
+	vector<float>& visibility, int depth, ShadeComponents* parts)
+{
+	ofColor L = ofColor::black;
+	float exponent = mat.exponent > 0 ? mat.exponent : (float)power;
+
+	// textured materials look up the diffuse color at the mip level of the
+	// pixel footprint; reflections are treated as if seen from the camera
+	ofColor diffuse = mat.diffuse;
+	if (mat.texture >= 0)
+	{
+		float width = glm::length(hit.pos - renderCam.position) * pixelSpread();
+		glm::vec3 d = surfaceDiffuse(hit, mat, ray.d, width) * 255.0f;
+		diffuse = ofColor(d.x, d.y, d.z);
+	}
+
+	// Trace shadow rays once for both shading models
+	lightVisibility(hit.pos, hit.norm, hit.object, x, y, visibility);
+
+	// Calculate lambert shading
+	ofColor Ld = lambert(hit.pos, hit.norm, diffuse, visibility);
+	L = L + Ld;
+
+	// Calculate Phong shading
+	ofColor Ls = phong(hit.pos, hit.norm, diffuse, mat.specular, exponent, visibility);
+	L = L + Ls;
+
+	// Calculate the ambient shading, set ambient color same as diffuse
+	ofColor ambientCoef = diffuse;
+	ofColor La = ambientCoef * ambientIntensity;	// La = ambient coefficient * Ia
+	L = L + La;
+
+	if (parts != NULL)
+	{
+		ofColor D = Ld + La;
+		parts->diffuse = glm::vec3(D.r, D.g, D.b) / 255.0f;
+		parts->specular = glm::vec3(Ls.r, Ls.g, Ls.b) / 255.0f;
+
+		// shadow mask: direct diffuse light relative to the same light unoccluded
+		vector<float> unshadowed(lights.size(), 1.0f);
+		ofColor open = lambert(hit.pos, hit.norm, diffuse, unshadowed);
+		float full = (float)open.r + open.g + open.b;
+		parts->shadow = full > 0 ? std::min(1.0f, ((float)Ld.r + Ld.g + Ld.b) / full) : 1.0f;
+	}
+
+	// Mirror reflection: blend with the color seen along the reflected ray
+	if (mat.reflectivity > 0 && depth < maxReflectionDepth)
+	{
+		glm::vec3 n = glm::normalize(hit.norm);
+		if (glm::dot(n, ray.d) > 0)
+			n = -n;
+		Ray reflected(hit.pos + n * 0.01, ray.d - 2 * glm::dot(ray.d, n) * n);
+		PrimaryHit next;
+		ofColor R = ofColor::black;
+		if (findIntersection(reflected, next) != NULL)
+		{
+			DirtyRegions::record(next.object);
+			R = shade(reflected, next, materials[next.material], x, y, visibility, depth + 1);
+		}
+		L = L * (1 - mat.reflectivity) + R * mat.reflectivity;
+		if (parts != NULL)
+		{
+			// the reflection counts as specular
+			parts->diffuse *= 1 - mat.reflectivity;
+			parts->specular = parts->specular * (1 - mat.reflectivity) + glm::vec3(R.r, R.g, R.b) / 255.0f * mat.reflectivity;
+		}
+	}
+	return L;
+}
+
+// world size of a pixel at unit distance from the render camera
+float ofApp::pixelSpread()
+{
+	float dist = fabs(renderCam.position.z - renderCam.view.position.z);
+	return renderCam.view.width() / imageWidth / std::max(dist, 1e-4f);
+}
+
+/*
+ * Diffuse color at a hit, modulated by the material's texture if it has one
+ *
+ * @param const PrimaryHit& hit - surface hit
+ * @param const Material& mat - material at the hit
+ * @param const glm::vec3& dir - direction of the ray that found the hit
+ * @param float width - width of the ray's pixel cone at the hit
+ * @return glm::vec3 - color in [0, 1]
+ */
+glm::vec3 ofApp::surfaceDiffuse(const PrimaryHit& hit, const Material& mat, const glm::vec3& dir, float width)
+{
+	glm::vec3 diffuse = glm::vec3(mat.diffuse.r, mat.diffuse.g, mat.diffuse.b) / 255.0f;
+	glm::vec2 uv;
+	float uvPerUnit;
+	if (mat.texture < 0 || hit.object == NULL || !hit.object->getUV(hit.pos, hit.primitive, uv, uvPerUnit))
+		return diffuse;
+
+	// the footprint stretches on surfaces seen at grazing angles
+	float cosTheta = fabs(glm::dot(glm::normalize(hit.norm), glm::normalize(dir)));
+	float footprint = width / std::max(cosTheta, 0.05f);
+	float scale = mat.textureScale * uvPerUnit;
+	return diffuse * textures.sample(mat.texture, uv * scale, footprint * scale);
 }
 
 // Returns pointer to closest object that ray intersects among all SceneObjects in vector scenes
@@ -256,14 +1446,52 @@ void ofApp::drawImage()
 // Returns NULL if no object intersects ray
 SceneObject* ofApp::findIntersection(const Ray& ray, glm::vec3& intersectPos, glm::vec3& intersectNorm)
 {
-	SceneObject* intersectScene = NULL;
+	PrimaryHit hit;
+	if (findIntersection(ray, hit) == NULL)
+		return NULL;
+	intersectPos = hit.pos;
+	intersectNorm = hit.norm;
+	return hit.object;
+}
+
+// closest hit of every ray, with each object testing all rays at once
+void ofApp::findIntersections(const vector<Ray>& rays, vector<PrimaryHit>& hits)
+{
+	hits.assign(rays.size(), PrimaryHit());
+	if (sceneBVHDirty)
+	{
+		for (auto obj : scene)
+			obj->intersectBatch(rays, hits);
+		return;
+	}
+	for (size_t i = 0; i < rays.size(); i++)
+		sceneBVH.intersect(rays[i], hits[i]);
+	for (auto obj : sceneBVH.others)
+		obj->intersectBatch(rays, hits);
+}
+
+// Same as above, but fills in a hit record that also has the material and primitive
+SceneObject* ofApp::findIntersection(const Ray& ray, PrimaryHit& hit)
+{
+	hit.object = NULL;
+	uint16_t m;
+	int prim;
 	float minDist2 = std::numeric_limits<float>::max();
 	glm::vec3 p;
 	glm::vec3 n;
+	// bounded objects through the hierarchy, the rest one by one below
+	const vector<SceneObject*>* objects = &scene;
+	if (!sceneBVHDirty)
+	{
+		sceneBVH.intersect(ray, hit);
+		if (hit.object != NULL)
+			minDist2 = glm::dot(hit.pos - ray.p, hit.pos - ray.p);
+		objects = &sceneBVH.others;
+	}
 	// for each object in the scene
-	for (int i = 0; i < scene.size(); i++) {
+	for (auto obj : *objects) {
 		// if ray intersects object
-		if (scene[i]->intersect(ray, p, n))
+		if (obj->intersect(ray, p, n, m, prim))
 		{
 			// calculate squared distance from ray to intersection point
 			glm::vec3 rayToPoint = p - ray.p;
@@ -273,18 +1501,65 @@ SceneObject* ofApp::findIntersection(const Ray& ray, glm::vec3& intersectPos, gl
 			{
 				// save the new closest object, intersection position, and normal
 				minDist2 = dist2;
-				intersectScene = scene[i];
-				intersectPos = p;
-				intersectNorm = n;
+				hit.object = obj;
+				hit.pos = p;
+				hit.norm = n;
+				hit.material = m;
+				hit.primitive = prim;
 			}
 		}
 	}
-	return intersectScene;
+	return hit.object;
 }
 
 // Check if there is any other object in scene between two pos1 and pos2,
 // Return true if there is a clear line of sight (i.e., no object) between pos1 and pos2
 bool ofApp::isClearLineOfSight(const glm::vec3& pos1, const glm::vec3& pos2)
+{
+	return isClearLineOfSight(pos1, pos2, scene);
+}
+
+//  Per thread cache of the last object that blocked a shadow ray to each light.
+//  Neighboring pixels are usually shadowed by the same object, so testing it
+//  first resolves most blocked shadow rays with a single intersection.
+//  Counters of finished threads are folded into the global totals.
+//
+struct OccluderCache {
+	vector<SceneObject*> last;		// indexed by light
+	int generation = -1;
+	uint64_t lookups = 0;			// shadow rays that consulted the cache
+	uint64_t blocked = 0;			// of those, rays that were blocked
+	uint64_t hits = 0;				// blocked rays resolved by the cached occluder
+
+	~OccluderCache() { flush(); }
+	void flush();
+};
+static std::atomic<uint64_t> occluderLookups(0), occluderBlocked(0), occluderHits(0);
+static thread_local OccluderCache occluderCache;
+
+void OccluderCache::flush()
+{
+	occluderLookups += lookups;
+	occluderBlocked += blocked;
+	occluderHits += hits;
+	lookups = blocked = hits = 0;
+}
+
+// true if obj intersects the segment that starts at ray.p and has squared length dist2
+static bool blocksSegment(SceneObject* obj, const Ray& ray, float dist2)
+{
+	glm::vec3 p;
+	glm::vec3 n;
+	if (!obj->castShadows || !obj->intersect(ray, p, n))
+		return false;
+	glm::vec3 diff = p - ray.p;
+	return glm::dot(diff, diff) < dist2;
+}
+
+// Same as above but only tests the given objects (e.g. the shadow casters of one light).
+// With a light index the calling thread's last occluder for that light is tried first.
+bool ofApp::isClearLineOfSight(const glm::vec3& pos1, const glm::vec3& pos2, const vector<SceneObject*>& objects,
+	int lightIndex)
 {
 	// Calculate square distance from pos1 to pos2
 	glm::vec3 posDiff = pos2 - pos1;
@@ -292,36 +1567,307 @@ bool ofApp::isClearLineOfSight(const glm::vec3& pos1, const glm::vec3& pos2)
 
 	// Create ray from pos1 to pos2
 	Ray ray = Ray(pos1, glm::normalize(pos2 - pos1));
-	glm::vec3 p;
-	glm::vec3 n;
 
-	// for each object in the scene
-	for (int i = 0; i < scene.size(); i++) {
-		// if ray intersects object
-		if (scene[i]->intersect(ray, p, n))
+	SceneObject* last = NULL;
+	OccluderCache& cache = occluderCache;
+	if (lightIndex >= 0)
+	{
+		if (cache.generation != sceneGeneration || cache.last.size() != lights.size())
+		{
+			cache.last.assign(lights.size(), NULL);
+			cache.generation = sceneGeneration;
+		}
+		cache.lookups++;
+		last = cache.last[lightIndex];
+		if (last != NULL && blocksSegment(last, ray, posDist2))
 		{
-			// Calculate square distance from pos1 to intersection point
-			glm::vec3 diff = p - pos1;
-			float dist2 = glm::dot(diff, diff);
+			cache.blocked++;
+			cache.hits++;
+			DirtyRegions::record(last);
+			return false;
+		}
+	}
+
+	SceneObject* blocker = NULL;
+	if (lightIndex >= 0 && lightIndex < casterFlags.size())
+	{
+		// the light's casters, unbounded ones (planes) first, then the hierarchy
+		const vector<bool>& include = casterFlags[lightIndex];
+		for (auto obj : sceneBVH.others)
+			if (blocker == NULL && obj != last && include[obj->sceneIndex] && blocksSegment(obj, ray, posDist2))
+				blocker = obj;
+		if (blocker == NULL)
+			blocker = sceneBVH.occluder(ray, sqrt(posDist2), include, last);
+	}
+	else
+	{
+		// for each object in the list
+		for (int i = 0; i < objects.size() && blocker == NULL; i++)
+			// If the object is between pos1 and pos2, line of sight is blocked
+			if (objects[i] != last && blocksSegment(objects[i], ray, posDist2))
+				blocker = objects[i];
+	}
+	if (blocker == NULL)
+		return true; // no object is between pos1 and pos2
+
+	if (lightIndex >= 0)
+	{
+		cache.blocked++;
+		cache.last[lightIndex] = blocker;
+	}
+	DirtyRegions::record(blocker);
+	return false;
+}
 
-			// If distance from pos1 to intersection point to less than distance from pos1 to pos2
-			if (dist2 < posDist2)
-				return false; // then object is between pos1 and pos2, so line of sight is blocked
+void ofApp::resetOccluderStats()
+{
+	occluderCache.lookups = occluderCache.blocked = occluderCache.hits = 0;
+	occluderLookups = occluderBlocked = occluderHits = 0;
+}
+
+void ofApp::printOccluderStats()
+{
+	occluderCache.flush();
+	uint64_t blocked = occluderBlocked;
+	if (blocked == 0)
+		return;
+	cout << "Occluder cache: " << occluderLookups << " shadow rays, " << blocked << " blocked, "
+		 << 100.0 * occluderHits / blocked << "% of blocked rays resolved by the cached occluder" << endl;
+}
+
+/*
+ * Classify the scene objects into potential shadow casters for every light.
+ * Must be called again whenever objects, lights or the render camera move,
+ * after updateSceneBVH(): receivers are looked up and shadow rays traced
+ * through the hierarchy.
+ */
+void ofApp::buildShadowCasters()
+{
+	sceneGeneration++;	// cached occluders may point at removed objects
+	// the path tracer gets here without prepareRender(), casterFlags need the numbers
+	for (size_t k = 0; k < scene.size(); k++)
+		scene[k]->sceneIndex = k;
+	shadowCasters.assign(lights.size(), vector<SceneObject*>());
+	casterFlags.assign(lights.size(), vector<bool>(scene.size(), false));
+	for (int i = 0; i < lights.size(); i++)
+	{
+		for (size_t k = 0; k < scene.size(); k++)
+		{
+			SceneObject* obj = scene[k];
+			if (!obj->castShadows)
+				continue;
+			Plane* plane = dynamic_cast<Plane*>(obj);
+			bool caster = plane != NULL ? canPlaneShadow(plane, lights[i]) : canObjectShadow(obj, lights[i]);
+			if (caster)
+			{
+				shadowCasters[i].push_back(obj);
+				casterFlags[i][k] = true;
+			}
 		}
 	}
-	return true; // no object is between pos1 and pos2
+}
+
+// An infinite plane is opaque, so every shading point reachable from the
+// camera is on the camera's side of it.  If the whole light is on that side
+// too, no shadow ray can cross the plane.
+bool ofApp::canPlaneShadow(Plane* plane, Light* light)
+{
+	glm::vec3 bmin, bmax;
+	light->getBounds(bmin, bmax);
+	float camSide = glm::dot(renderCam.position - plane->position, plane->normal);
+	for (int c = 0; c < 8; c++)
+	{
+		glm::vec3 corner((c & 1) ? bmax.x : bmin.x, (c & 2) ? bmax.y : bmin.y, (c & 4) ? bmax.z : bmin.z);
+		float lightSide = glm::dot(corner - plane->position, plane->normal);
+		if (lightSide * camSide <= 0)
+			return true;
+	}
+	return false;
+}
+
+// Bounding cone test: the shadow of a bounded object from a point light lies
+// in the cone from the light through the object's bounding sphere, beyond the
+// object.  If no shadow receiver reaches into that cone the object can be skipped.
+// Unbounded receivers (planes) are tried first since they usually reach it,
+// then sceneBVH skips every subtree whose bounding sphere misses the cone.
+bool ofApp::canObjectShadow(SceneObject* caster, Light* light)
+{
+	glm::vec3 bmin, bmax;
+	if (light->isArea() || !caster->getBounds(bmin, bmax))
+		return true;	// conservative for area lights and unbounded objects
+
+	glm::vec3 center = 0.5f * (bmin + bmax);
+	float radius = 0.5f * glm::length(bmax - bmin);
+	glm::vec3 axis = center - light->position;
+	float dist = glm::length(axis);
+	if (dist <= radius)
+		return true;	// light inside the bounds
+	axis /= dist;
+	float sinA = radius / dist;
+	float cosA = sqrt(1 - sinA * sinA);
+	float nearDist = dist - radius;	// shadows start behind the near side of the object
+
+	// sphere / cone overlap for the bounding sphere of a box, grown by a
+	// factor; false if the sphere is entirely between light and caster
+	auto inCone = [&](const glm::vec3& rmin, const glm::vec3& rmax, float grow) {
+		glm::vec3 v = 0.5f * (rmin + rmax) - light->position;
+		float r = 0.5f * glm::length(rmax - rmin) * grow;
+		float along = glm::dot(v, axis);
+		if (along + r < nearDist)
+			return false;
+		float perp = glm::length(v - along * axis);
+		return perp * cosA - along * sinA <= r;
+	};
+	auto skip = [&](SceneObject* recv) {
+		return !recv->receiveShadows || (recv == caster && caster->isConvex());
+	};
+
+	for (auto recv : sceneBVH.others)
+	{
+		if (skip(recv))
+			continue;
+		glm::vec3 rmin, rmax;
+		Plane* plane = dynamic_cast<Plane*>(recv);
+		if (plane != NULL)
+		{
+			// the plane reaches into the cone if some cone direction heads towards it
+			float side = glm::dot(light->position - plane->position, plane->normal);
+			float toward = side > 0 ? -glm::dot(axis, plane->normal) : glm::dot(axis, plane->normal);
+			if (toward > -sinA)
+				return true;
+		}
+		else if (!recv->getBounds(rmin, rmax) || inCone(rmin, rmax, 1))
+			return true;
+	}
+
+	// the bounding sphere of anything below a node has its center in the node's
+	// box and at most the same radius, so twice the node's sphere holds them all
+	// and a miss rules out the subtree
+	const vector<SceneNode>& nodes = sceneBVH.nodes;
+	int stack[64];		// median splits keep the depth at log2(objects)
+	int top = 0;
+	if (!nodes.empty())
+		stack[top++] = 0;
+	while (top > 0)
+	{
+		const SceneNode& node = nodes[stack[--top]];
+		if (!inCone(node.bmin, node.bmax, node.object < 0 ? 2 : 1))
+			continue;
+		if (node.object < 0)
+		{
+			// the child closer to the cone's axis first, it more likely holds a receiver
+			auto offAxis = [&](const SceneNode& child) {
+				glm::vec3 v = 0.5f * (child.bmin + child.bmax) - light->position;
+				return glm::length(v - glm::dot(v, axis) * axis);
+			};
+			bool leftFirst = offAxis(nodes[node.left]) <= offAxis(nodes[node.right]);
+			stack[top++] = leftFirst ? node.right : node.left;
+			stack[top++] = leftFirst ? node.left : node.right;
+		}
+		else if (!skip(sceneBVH.objects[node.object]))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Compute how much of every light is visible from a surface point
+ *
+ * @param const glm::vec3& p - surface point
+ * @param const glm::vec3& norm - surface normal at p
+ * @param SceneObject* receiver - object hit at p, NULL if unknown
+ * @param int x, y - pixel, selects the shadow sample pattern
+ * @param vector<float>& visibility - output, one value in [0, 1] per light
+ */
+void ofApp::lightVisibility(const glm::vec3& p, const glm::vec3& norm, SceneObject* receiver,
+	int x, int y, vector<float>& visibility)
+{
+	// move intersection point a tiny distance from the surface
+	glm::vec3 pos = p + norm * 0.01;
+	auto visible = [&](int i) {
+		if (receiver != NULL && !receiver->receiveShadows)
+			return 1.0f;
+		// a point light behind the surface cannot light it (this is also the
+		// only way a convex object shadows itself, see canObjectShadow)
+		if (!lights[i]->isArea() && glm::dot(lights[i]->position - pos, norm) <= 0)
+			return 0.0f;
+		if (lights[i]->isArea())
+			return areaLightVisibility(lights[i], i, pos, x, y);
+		return isClearLineOfSight(lights[i]->position, pos, getShadowCasters(i), i) ? 1.0f : 0.0f;
+	};
+
+	visibility.assign(lights.size(), 0);
+	if (lightMode == LIGHTS_SAMPLE)
+	{
+		// pick lightSamples lights by importance; the weight 1 / (k * pdf) keeps
+		// the sum an unbiased estimate of the loop over all lights
+		int k = lightSamples;
+		glm::vec3 n = glm::normalize(norm);
+		vector<int> chosen;
+		for (int j = 0; j < k; j++)
+		{
+			float pdf;
+			int i = lightBVH.sample(pos, n, Sampler(SAMPLER_SOBOL, x, y, j, 0x5bd1e995).get1D(), pdf);
+			if (i < 0)
+				break;
+			if (visibility[i] == 0)
+				chosen.push_back(i);
+			visibility[i] += 1 / (k * pdf);
+		}
+		for (int i : chosen)
+			visibility[i] *= visible(i);
+	}
+	else if (lightMode == LIGHTS_CULL)
+	{
+		vector<int> culled;
+		lightBVH.cull(pos, intensity, lightCullThreshold, culled);
+		for (int i : culled)
+			visibility[i] = visible(i);
+	}
+	else
+	{
+		for (int i = 0; i < lights.size(); i++)
+			visibility[i] = visible(i);
+	}
+}
+
+// Adaptive soft shadow: trace a few shadow rays to points on the light, and
+// only when they disagree (penumbra) keep sampling up to shadowSamplesMax.
+// Fully lit and fully shadowed points stop after shadowSamplesMin rays.
+float ofApp::areaLightVisibility(Light* light, int lightIndex, const glm::vec3& pos, int x, int y)
+{
+	int minSamples = shadowSamplesMin;
+	int maxSamples = std::max((int)shadowSamplesMax, minSamples);
+	int visible = 0;
+	int n = 0;
+	shadowLookups++;
+	for (; n < maxSamples; n++)
+	{
+		if (n == minSamples && (visible == 0 || visible == n))
+			break;		// all samples agree, not in a penumbra
+		// the sample pattern is fixed per pixel, light and sample number
+		Sampler sampler(SAMPLER_SOBOL, x, y, n, lightIndex);
+		if (isClearLineOfSight(light->samplePoint(sampler.get2D()), pos, getShadowCasters(lightIndex), lightIndex))
+			visible++;
+	}
+	shadowRays += n;
+	return (float)visible / n;
 }
 
 // Lambertian Shading: L = d * (I/r^2) * max(0, n dot l)
-ofColor ofApp::lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse)
+ofColor ofApp::lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse,
+	const vector<float>& visibility)
 {
-	ofColor L = ofColor::black;
+	// summed in floats, an ofColor would clamp every light at 255 before the
+	// falloff and bias the sampled lights' 1 / pdf weights
+	glm::vec3 L(0, 0, 0);
+	glm::vec3 d(diffuse.r, diffuse.g, diffuse.b);
 	// move intersection point a tiny distance from the surface
 	glm::vec3 pos = p + norm * 0.01;
 	for (int i = 0; i < lights.size(); i++)
 	{
 		// if closest object to camera/image is not blocked from light source
-		if (isClearLineOfSight(lights[i]->position, pos))
+		if (visibility[i] > 0)
 		{
 			glm::vec3 object2Light = lights[i]->position - pos;
 			// create ray from intersection point to light source
@@ -334,27 +1880,29 @@ ofColor ofApp::lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor
 				diffuseDot = 0;
 
 			// calculate the Lambertian shading
-			ofColor Ld = diffuse * diffuseDot * intensity;
+			glm::vec3 Ld = d * diffuseDot * intensity * visibility[i];
 			// Scale by distance from light source to intersection point
-			//cout << "dist2 " << glm::dot(object2Light, object2Light) << endl;
-			Ld = Ld / (0.01 * glm::dot(object2Light, object2Light));
+			Ld = Ld / (0.01f * glm::dot(object2Light, object2Light));
 			L = L + Ld;
 		}
 	}
-	return L;
+	L = glm::min(L, glm::vec3(255, 255, 255));
+	return ofColor(L.x, L.y, L.z);
 }
 
 // Phong Shading: s * (I/r^2) * max(0, n dot h) ^ power
 ofColor ofApp::phong(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse,
-	const ofColor specular, float power)
+	const ofColor specular, float power, const vector<float>& visibility)
 {
-	ofColor L = ofColor::black;
+	// summed in floats like lambert()
+	glm::vec3 L(0, 0, 0);
+	glm::vec3 s(specular.r, specular.g, specular.b);
 	// move intersection point a tiny distance from the surface
 	glm::vec3 pos = p + norm * 0.01;
 	for (int i = 0; i < lights.size(); i++)
 	{
 		// if closest object to camera/image is not blocked from light source
-		if (isClearLineOfSight(lights[i]->position, pos))
+		if (visibility[i] > 0)
 		{
 			glm::vec3 object2Light = lights[i]->position - pos;
 			// create ray from intersection point to light source
@@ -373,15 +1921,15 @@ ofColor ofApp::phong(const glm::vec3& p, const glm::vec3& norm, const ofColor di
 				specularDot = 0;
 
 			// calculate the Phong shading
-			ofColor Ls = specular * glm::pow(specularDot, power) * intensity;
+			glm::vec3 Ls = s * glm::pow(specularDot, power) * intensity * visibility[i];
 			// Scale by distance from light source to intersection point
-			//cout << "dist2 " << glm::dot(object2Light, object2Light) << endl;
-			Ls = Ls / (0.01 * glm::dot(object2Light, object2Light));
+			Ls = Ls / (0.01f * glm::dot(object2Light, object2Light));
 			L = L + Ls;
 			
 		}
 	}
-	return L;
+	L = glm::min(L, glm::vec3(255, 255, 255));
+	return ofColor(L.x, L.y, L.z);
 }
 
 //--------------------------------------------------------------
@@ -400,6 +1948,9 @@ void ofApp::keyReleased(int key) {
 	case 'F':
 	case 'b':
 		break;
+	case 'd':
+		denoiseCompare();
+		break;
 	case 'f':
 		ofToggleFullscreen();
 		break;
@@ -409,6 +1960,44 @@ void ofApp::keyReleased(int key) {
 	case 'i':
 		drawImage();
 		break;
+	case 'u':
+		// only what changed since the last 'i', else everything
+		if (!redrawDirty())
+			drawImage(false);
+		break;
+	case 'o':
+		previewImage();
+		break;
+	case 'g':
+		renderToFile(posterFile, posterWidth, posterHeight);
+		break;
+	case 'w':
+		renderDistributed();
+		break;
+	case 'e':
+		if (renderServer.isRunning()) renderServer.stop();
+		else renderServer.start(serverPort);
+		break;
+	case 'a':
+		startSequence();
+		break;
+	case 's':
+		// binary copy of the text scene file, loads much faster
+		if (!sceneFile.empty() && ofToLower(ofFilePath::getFileExt(sceneFile)) == "scn")
+		{
+			SceneFile desc;
+			string binaryFile = sceneFile + "b";
+			if (desc.load(sceneFile) && desc.saveBinary(binaryFile))
+				cout << "Wrote " << binaryFile << endl;
+		}
+		break;
+	case 'p':
+		if (pathTracer.isRunning()) pathTracer.stop();
+		else startPathTrace();
+		break;
+	case 'v':
+		bShowImage = !bShowImage;
+		break;
 	case 'n':
 		scene.push_back(new Sphere(glm::vec3(0, 0, 0), 1.0, ofColor::violet));
 		break;
@@ -416,6 +2005,9 @@ void ofApp::keyReleased(int key) {
 		rayTrace();
 		cout << "done..." << endl;
 		break;
+	case 'l':
+		lightSelectionError();
+		break;
 	case 'm':
 		break;
 	case OF_KEY_F1:
@@ -477,5 +2069,14 @@ void ofApp::gotMessage(ofMessage msg){
 
 //--------------------------------------------------------------
 void ofApp::dragEvent(ofDragInfo dragInfo){ 
-
+	// the first scene file dropped on the window replaces the scene
+	for (auto& file : dragInfo.files)
+	{
+		string ext = ofToLower(ofFilePath::getFileExt(file));
+		if (ext == "scn" || ext == "scnb")
+		{
+			loadScene(file);
+			return;
+		}
+	}
 }
@@ -3,6 +3,19 @@
 #include "ofMain.h"
 #include "glm/gtx/intersect.hpp"
 #include "ofxGui.h"
+#include "pathtracer.h"
+#include "lightbvh.h"
+#include "material.h"
+#include "imagewriter.h"
+#include "aov.h"
+#include "scenefile.h"
+#include "scenebvh.h"
+#include "animation.h"
+#include "checkpoint.h"
+#include "distributed.h"
+#include "renderserver.h"
+#include "dirtyregion.h"
+#include "tilecache.h"
 
 //  General Purpose Ray class 
 //
@@ -18,27 +31,56 @@ public:
 	glm::vec3 p, d;
 };
 
+struct PrimaryHit;
+
 //  Base class for any renderable object in the scene
 //
 class SceneObject {
 public:
+	virtual ~SceneObject() {}
 	virtual void draw() = 0;    // pure virtual funcs - must be overloaded
 	virtual bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) { cout << "SceneObject::intersect" << endl; return false; }
+	// same, but also return the material at the hit (meshes may have one per triangle)
+	// and the primitive (triangle) that was hit, -1 for objects made of one surface
+	virtual bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal, uint16_t& material, int& primitive) {
+		material = materialId;
+		primitive = -1;
+		return intersect(ray, point, normal);
+	}
+	// intersect many rays, updating hits[i] where this object is closer than the
+	// current hit; objects that page in their data override this to group rays
+	virtual void intersectBatch(const vector<Ray>& rays, vector<PrimaryHit>& hits);
 
 	// any data common to all scene objects goes here
 	glm::vec3 position = glm::vec3(0, 0, 0);
-
-	// material properties (we will ultimately replace this with a Material class - TBD)
+	int sceneIndex = -1;		// index in ofApp::scene as of the last prepareRender()
+	// move the object so position is p (objects stored in world space move their data too)
+	virtual void setPosition(const glm::vec3& p) { position = p; }
+	// true for objects that should always get rays in batches (see intersectBatch)
+	virtual bool wantsBatches() { return false; }
+
+	// axis aligned bounds, returns false for unbounded objects (e.g. infinite planes)
+	virtual bool getBounds(glm::vec3& bmin, glm::vec3& bmax) { return false; }
+	// a convex object can only shadow itself on the side facing away from the light
+	virtual bool isConvex() { return false; }
+	// texture coordinates of a surface point on a primitive returned by intersect(),
+	// and how many uv units one world unit spans there
+	virtual bool getUV(const glm::vec3& point, int primitive, glm::vec2& uv, float& uvPerUnit) { return false; }
+
+	// material properties, index into the global material table
 	//
-	ofColor diffuseColor = ofColor::grey;    // default colors - can be changed.
-	ofColor specularColor = ofColor::lightGray;
+	uint16_t materialId = 0;
+	Material& getMaterial() { return materials[materialId]; }
+
+	bool castShadows = true;		// false = never blocks shadow rays
+	bool receiveShadows = true;		// false = always lit, no shadow rays traced
 };
 
 //  General purpose sphere  (assume parametric)
 //
 class Sphere : public SceneObject {
 public:
-	Sphere(glm::vec3 p, float r, ofColor diffuse = ofColor::lightGray) { position = p; radius = r; diffuseColor = diffuse; }
+	Sphere(glm::vec3 p, float r, ofColor diffuse = ofColor::lightGray) { position = p; radius = r; materialId = materials.fromColor(diffuse); }
 	Sphere() {}
 	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) {
 		bool ret = glm::intersectRaySphere(ray.p, ray.d, position, radius, point, normal);
@@ -50,6 +92,12 @@ public:
 	void draw() {
 		ofDrawSphere(position, radius);
 	}
+	bool getBounds(glm::vec3& bmin, glm::vec3& bmax) {
+		bmin = position - glm::vec3(radius, radius, radius);
+		bmax = position + glm::vec3(radius, radius, radius);
+		return true;
+	}
+	bool isConvex() { return true; }
 
 	float radius = 1.0;
 };
@@ -62,12 +110,13 @@ public:
 		position = p; normal = n;
 		width = w;
 		height = h;
-		diffuseColor = diffuse;
+		materialId = materials.fromColor(diffuse);
 		plane.rotateDeg(90, 1, 0, 0);
 	}
 	Plane() { }
 	glm::vec3 normal = glm::vec3(0, 1, 0);
 	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal);
+	bool getUV(const glm::vec3& point, int primitive, glm::vec2& uv, float& uvPerUnit);	// planar mapping, 1 uv unit per world unit
 	void draw() {
 		plane.setPosition(position);
 		plane.setWidth(width);
@@ -162,6 +211,78 @@ public:
 	void draw() {
 		ofDrawSphere(position, 0.1);
 	}
+
+	// point on the light to aim a shadow ray at, xi in [0, 1]^2
+	virtual glm::vec3 samplePoint(const glm::vec2& xi) { return position; }
+	virtual bool isArea() { return false; }
+	bool getBounds(glm::vec3& bmin, glm::vec3& bmax) { bmin = bmax = position; return true; }
+};
+
+//  Spherical area light, casts soft shadows
+//
+class SphereLight : public Light
+{
+public:
+	float radius;
+
+	SphereLight(glm::vec3 position, float radius, float intensity) : Light(position, intensity)
+	{
+		this->radius = radius;
+	}
+	void draw() {
+		ofDrawSphere(position, radius);
+	}
+	// uniform point on the sphere surface
+	glm::vec3 samplePoint(const glm::vec2& xi) {
+		float z = 1 - 2 * xi.x;
+		float r = sqrt(std::max(0.0f, 1 - z * z));
+		float phi = 2 * PI * xi.y;
+		return position + radius * glm::vec3(r * cos(phi), z, r * sin(phi));
+	}
+	bool isArea() { return true; }
+	bool getBounds(glm::vec3& bmin, glm::vec3& bmax) {
+		bmin = position - glm::vec3(radius, radius, radius);
+		bmax = position + glm::vec3(radius, radius, radius);
+		return true;
+	}
+};
+
+//  Rectangular area light spanned by two edge vectors centered on position
+//
+class RectLight : public Light
+{
+public:
+	glm::vec3 uEdge, vEdge;
+
+	RectLight(glm::vec3 position, glm::vec3 uEdge, glm::vec3 vEdge, float intensity) : Light(position, intensity)
+	{
+		this->uEdge = uEdge;
+		this->vEdge = vEdge;
+	}
+	void draw() {
+		glm::vec3 c0 = position - 0.5f * uEdge - 0.5f * vEdge;
+		ofDrawTriangle(c0, c0 + uEdge, c0 + uEdge + vEdge);
+		ofDrawTriangle(c0, c0 + uEdge + vEdge, c0 + vEdge);
+	}
+	glm::vec3 samplePoint(const glm::vec2& xi) {
+		return position + (xi.x - 0.5f) * uEdge + (xi.y - 0.5f) * vEdge;
+	}
+	bool isArea() { return true; }
+	bool getBounds(glm::vec3& bmin, glm::vec3& bmax) {
+		glm::vec3 half = 0.5f * (glm::abs(uEdge) + glm::abs(vEdge));
+		bmin = position - half;
+		bmax = position + half;
+		return true;
+	}
+};
+
+//  Result of a primary ray, kept so shading can be batched by material
+//
+struct PrimaryHit {
+	glm::vec3 pos, norm;
+	SceneObject* object = NULL;		// NULL = background
+	uint16_t material = 0;
+	int primitive = -1;				// triangle of a mesh, for texture coordinates
 };
 
 class ofApp : public ofBaseApp{
@@ -186,13 +307,94 @@ class ofApp : public ofBaseApp{
 		void rayTrace() {}  // you implement this for the project
 		void drawGrid();
 		void drawAxis(glm::vec3 position);
-		void drawImage();
+		// scenes come from .scn/.scnb files (command line, drag and drop) or the built in one
+		void buildDefaultScene();
+		bool loadScene(const string& fname);
+		void clearScene();
+		void checkSceneReload();
+		uint64_t fileStamp(const string& fname);
+		string sceneFile;				// empty = built in scene
+		uint64_t sceneStamp = 0;		// modification time of sceneFile when it was loaded
+		float lastReloadCheck = 0;
+		ofxToggle bHotReload;
+
+		void drawImage(bool save = true, bool reuseHits = false);	// reuseHits = shade the last primary hits again
+		bool redrawDirty();				// re-trace only what changed since drawImage, false if it can't
+		DirtyRegions dirtyRegions;
+		void prepareRender();
+		void updateSceneBVH();
+
+		// long renders checkpoint their progress and resume after being killed
+		uint64_t sceneHash();
+		void hashObject(uint64_t& h, SceneObject* obj);
+		static void hashMaterial(uint64_t& h, const Material& m);
+		static void hashFile(uint64_t& h, const string& fname);	// name and contents of a mesh or texture file
+		string checkpointFile(const string& kind, uint64_t hash);
+		ofxToggle bCheckpoint;
+		float checkpointSeconds = 30;
+		SceneBVH sceneBVH;				// bounded objects, refit every render
+		bool sceneBVHDirty = true;		// rebuild it, objects were added or removed
+
+		// keyframe animation from the scene file, rendered to numbered frames
+		void startSequence();
+		void renderSequenceFrame();
+		Animation animation;
+		int sequenceFrame = -1;			// next frame to render, -1 = not rendering a sequence
+		int framesReused = 0;
+		uint64_t sequenceStart = 0;
+		void printRenderStats();
+
+		// very large renders go straight to disk a strip at a time
+		void renderToFile(const string& fname, int width, int height, int stripRows = 64);
+		string posterFile = "poster.tif";
+		int posterWidth = 32768;
+		int posterHeight = 21846;		// the view plane is 3:2
+		void renderRegion(int x0, int y0, int x1, int y1, vector<unsigned char>& rgb);
+		void renderTile(int x0, int y0, int x1, int y1, vector<unsigned char>& rgb);	// renderRegion through tileCache
+
+		// tiles of renderToFile and renderDistributed are kept on disk and reused
+		// by later renders whose inputs for the tile are the same
+		bool useTileCache();
+		TileCache tileCache;
+		ofxToggle bTileCache;
+		string tileCacheDir = "tilecache";
+
+		// final renders split into tiles over worker processes, see RenderCoordinator
+		void renderDistributed();
+		RenderSettings getRenderSettings();
+		void applyRenderSettings(const RenderSettings& s);
+		int renderPort = 7878;
+		int localWorkers = -1;			// workers started on this machine, -1 = one per core
+		string distributedFile = "distributed.png";
+
+		// scene kept loaded and rendered on request from other programs, see RenderServer
+		RenderServer renderServer = RenderServer(this);
+		int serverPort = 7879;
+		bool bServe = false;			// start the server with the app (--server port)
 
 
 
 		bool bHide = true;
 		bool bShowImage = false;
 
+		// viewport drawing: all spheres in one instanced draw call, and objects
+		// outside theCam's frustum skipped
+		//
+		void setupViewportDrawing();
+		void drawSpheres(const vector<Sphere*>& spheres);
+		bool inFrustum(const glm::mat4& viewProjection, SceneObject* obj);
+
+		// simplified meshes for the viewport and the low resolution preview render;
+		// drawImage() and the path tracer always use full detail
+		//
+		void selectMeshLods(const glm::vec3& eye, float pixelsPerRadian, bool forRender);
+		void previewImage();
+		int previewScale = 4;				// preview is 1/previewScale of the image size
+		ofVboMesh sphereMesh;				// unit sphere
+		ofShader instanceShader;
+		vector<glm::vec4> sphereInstances;	// center, radius
+		vector<glm::vec4> sphereColors;
+
 		ofEasyCam mainCam;
 		ofCamera topCam;
 		ofCamera sideCam;
@@ -210,12 +412,80 @@ class ofApp : public ofBaseApp{
 		int imageWidth = 1200;
 		int imageHeight = 800;
 		char* imageFile;
-		ofColor lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse);
+		AsyncImageSaver imageSaver;		// images are encoded while the next render runs
+		ofxIntSlider pngLevel;			// 0 = uncompressed
+		ofxToggle bAovs;				// write the AOV passes of drawImage
+		AovBuffer aovs;
+		string aovFile = "aovs.exr";	// .exr or .pfm
+		ofColor lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse,
+						const vector<float>& visibility);
 		ofColor phong(const glm::vec3 &p, const glm::vec3& norm, const ofColor diffuse,
-					  const ofColor specular, float power);
+					  const ofColor specular, float power, const vector<float>& visibility);
 		ofxFloatSlider intensity, power;
+		ofxFloatSlider ptThreshold;
+		ofxIntSlider ptMaxDepth;
+		ofxIntSlider samplerType;	// 0 = white noise, 1 = Sobol, 2 = blue noise
+		ofxToggle bDenoise;
 		ofxPanel gui;
 		float ambientIntensity;
 		SceneObject* findIntersection(const Ray& ray, glm::vec3& intersectPos, glm::vec3& intersectNorm);
+		SceneObject* findIntersection(const Ray& ray, PrimaryHit& hit);
+		void findIntersections(const vector<Ray>& rays, vector<PrimaryHit>& hits);	// closest hit of many rays
+		ofColor shade(const Ray& ray, const PrimaryHit& hit, const Material& mat, int x, int y,
+					  vector<float>& visibility, int depth = 0, ShadeComponents* parts = NULL);
+		vector<PrimaryHit> primaryHits;		// one per pixel of the last drawImage, row 0 at the bottom
+		glm::vec3 surfaceDiffuse(const PrimaryHit& hit, const Material& mat, const glm::vec3& dir, float width);
+		float pixelSpread();				// footprint of a pixel per unit of distance from the camera
+		ofxFloatSlider textureCacheMB;
+		int maxReflectionDepth = 2;
 		bool isClearLineOfSight(const glm::vec3& pos1, const glm::vec3& pos2);
+		// with a light index, objects must be getShadowCasters(lightIndex); they are then found through sceneBVH
+		bool isClearLineOfSight(const glm::vec3& pos1, const glm::vec3& pos2, const vector<SceneObject*>& objects,
+								int lightIndex = -1);
+		void resetOccluderStats();
+		void printOccluderStats();
+		int sceneGeneration = 0;	// bumped whenever cached scene pointers may be stale
+
+		// per light lists of the objects that can possibly shadow something
+		//
+		void buildShadowCasters();
+		bool canPlaneShadow(Plane* plane, Light* light);
+		bool canObjectShadow(SceneObject* caster, Light* light);
+		vector<vector<SceneObject*>> shadowCasters;	// indexed like lights
+		vector<vector<bool>> casterFlags;			// same, [light][sceneIndex], for shadow rays through sceneBVH
+		const vector<SceneObject*>& getShadowCasters(int lightIndex) {
+			return lightIndex < shadowCasters.size() ? shadowCasters[lightIndex] : scene;
+		}
+
+		// fraction of each light visible from a surface point, computed once per hit
+		// and shared by lambert() and phong()
+		//
+		void lightVisibility(const glm::vec3& p, const glm::vec3& norm, SceneObject* receiver,
+							 int x, int y, vector<float>& visibility);
+		float areaLightVisibility(Light* light, int lightIndex, const glm::vec3& pos, int x, int y);
+		ofxIntSlider shadowSamplesMin, shadowSamplesMax;
+		uint64_t shadowLookups = 0;		// area light visibility queries in the last render
+		uint64_t shadowRays = 0;		// shadow rays spent on them
+
+		// light hierarchy for scenes with many lights: evaluate all lights, a few
+		// stochastically chosen important ones, or only those above a threshold
+		//
+		void lightSelectionError();
+		LightBVH lightBVH;
+		ofxIntSlider lightMode;			// LightSelection
+		ofxIntSlider lightSamples;		// lights chosen per hit in LIGHTS_SAMPLE mode
+		ofxFloatSlider lightCullThreshold;
+
+		// progressive path tracing, one pass per frame in update()
+		//
+		void startPathTrace();
+		PathTracer pathTracer = PathTracer(this);
+		char* pathTraceFile;
+
+		// edge-aware denoising of the rendered image, guided by the primary hits
+		//
+		void denoiseCompare();
+		Denoiser denoiser;
+		GBuffer gbuffer;
+		vector<glm::vec3> colorBuffer;	// float copy of the rendered image, row 0 at the bottom
 };
\ No newline at end of file
@@ -0,0 +1,416 @@
+#include <thread>
+#include "pathtracer.h"
+#include "ofApp.h"
+#include "texture.h"
+#include "clustermesh.h"
+
+// relative luminance of a linear color
+static float luminance(const glm::vec3& c)
+{
+	return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+/*
+ * Clear the accumulation buffers and split the image into tiles
+ *
+ * @param int width - image width in pixels
+ * @param int height - image height in pixels
+ */
+void PathTracer::start(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	accum.assign(width * height, glm::vec3(0, 0, 0));
+	lumSum2.assign(width * height, 0);
+	gbuffer.allocate(width, height);
+
+	tiles.clear();
+	for (int y = 0; y < height; y += tileSize)
+		for (int x = 0; x < width; x += tileSize)
+		{
+			PathTile tile;
+			tile.x0 = x;
+			tile.y0 = y;
+			tile.x1 = std::min(x + tileSize, width);
+			tile.y1 = std::min(y + tileSize, height);
+			tiles.push_back(tile);
+		}
+
+	app->updateSceneBVH();
+	app->buildShadowCasters();
+	app->resetOccluderStats();
+	materials.loadTextures();
+	textures.setMemoryCap((size_t)(app->textureCacheMB * 1024 * 1024));
+	textures.resetStats();
+	ClusteredMesh::resetStats();
+	pass = 0;
+	samplesTaken = 0;
+	startTime = ofGetElapsedTimeMillis();
+	running = true;
+
+	// pick up where an earlier run of the same render was killed
+	checkpoint.close();
+	if (app->bCheckpoint)
+	{
+		uint64_t hash = app->sceneHash();
+		float settings[] = { threshold };
+		int modes[] = { maxDepth, samplerType, tileSize, minSamples, maxSamples };
+		hashValue(hash, settings);
+		hashValue(hash, modes);
+		if (checkpoint.open(app->checkpointFile("pathtrace", hash), hash, snapshotBytes()) && checkpoint.current() != NULL)
+		{
+			restoreSnapshot(checkpoint.current());
+			cout << "Resuming from checkpoint at pass " << pass << endl;
+		}
+	}
+	cout << "Path tracing " << width << "x" << height << " in " << tiles.size() << " tiles" << endl;
+}
+
+/*
+ * Add one sample to every pixel of every active tile.  Tiles whose error
+ * estimate drops below the threshold are retired afterwards.
+ *
+ * @return bool - true if there is still work left, false when all tiles have converged
+ */
+bool PathTracer::renderPass()
+{
+	if (!running)
+		return false;
+
+	activeTiles.clear();
+	for (size_t i = 0; i < tiles.size(); i++)
+		if (tiles[i].active)
+			activeTiles.push_back(i);
+
+	if (activeTiles.empty())
+	{
+		running = false;
+		if (checkpoint.isOpen())
+			checkpoint.remove();		// finished, nothing to resume
+		printStats();
+		return false;
+	}
+
+	// worker threads pull tiles from a shared counter until the pass is done
+	int n = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+	nextTile = 0;
+	auto worker = [this]() {
+		int i;
+		while ((i = nextTile++) < (int)activeTiles.size())
+			renderTile(tiles[activeTiles[i]]);
+	};
+	vector<std::thread> threads;
+	for (int t = 1; t < n; t++)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (auto& t : threads)
+		t.join();
+
+	// retire converged tiles so the next pass only samples noisy regions
+	for (int i : activeTiles)
+	{
+		PathTile& tile = tiles[i];
+		samplesTaken += (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+		tile.error = tileError(tile);
+		if ((tile.samples >= minSamples && tile.error < threshold) || tile.samples >= maxSamples)
+			tile.active = false;
+	}
+	pass++;
+	if (checkpoint.isOpen() && checkpoint.due(app->checkpointSeconds))
+	{
+		saveSnapshot(checkpoint.next());
+		checkpoint.commit();
+	}
+	return true;
+}
+
+// take one jittered sample for every pixel in the tile
+void PathTracer::renderTile(PathTile& tile)
+{
+	for (int y = tile.y0; y < tile.y1; y++)
+		for (int x = tile.x0; x < tile.x1; x++)
+		{
+			int i = y * width + x;
+			if (tile.samples == 0)
+				recordPrimaryHit(x, y);
+			Sampler sampler(samplerType, x, y, tile.samples);
+			glm::vec2 jitter = sampler.get2D();
+			float u = (x + jitter.x) / width;
+			float v = (y + jitter.y) / height;
+
+			glm::vec3 L = tracePath(app->renderCam.getRay(u, v), sampler);
+			float lum = luminance(L);
+			accum[i] += L;
+			lumSum2[i] += lum * lum;
+		}
+	tile.samples++;
+}
+
+// per tile part of a snapshot
+struct TileState {
+	int32_t samples;
+	float error;
+	int32_t active;
+};
+
+size_t PathTracer::snapshotBytes()
+{
+	return sizeof(int32_t) + sizeof(uint64_t) + tiles.size() * sizeof(TileState)
+		+ accum.size() * sizeof(glm::vec3) + lumSum2.size() * sizeof(float);
+}
+
+void PathTracer::saveSnapshot(char* p)
+{
+	int32_t passes = pass;
+	memcpy(p, &passes, sizeof(int32_t));
+	p += sizeof(int32_t);
+	memcpy(p, &samplesTaken, sizeof(uint64_t));
+	p += sizeof(uint64_t);
+	for (auto& tile : tiles)
+	{
+		TileState state = { tile.samples, tile.error, tile.active };
+		memcpy(p, &state, sizeof(TileState));
+		p += sizeof(TileState);
+	}
+	memcpy(p, accum.data(), accum.size() * sizeof(glm::vec3));
+	p += accum.size() * sizeof(glm::vec3);
+	memcpy(p, lumSum2.data(), lumSum2.size() * sizeof(float));
+}
+
+// The sampler sequence of a pixel only depends on its tile's sample count,
+// so the restored render continues exactly as if it had never stopped.  The
+// guide buffer is not saved, it is traced again for the tiles already started.
+void PathTracer::restoreSnapshot(const char* p)
+{
+	int32_t passes;
+	memcpy(&passes, p, sizeof(int32_t));
+	pass = passes;
+	p += sizeof(int32_t);
+	memcpy(&samplesTaken, p, sizeof(uint64_t));
+	p += sizeof(uint64_t);
+	for (auto& tile : tiles)
+	{
+		TileState state;
+		memcpy(&state, p, sizeof(TileState));
+		p += sizeof(TileState);
+		tile.samples = state.samples;
+		tile.error = state.error;
+		tile.active = state.active != 0;
+	}
+	memcpy(accum.data(), p, accum.size() * sizeof(glm::vec3));
+	p += accum.size() * sizeof(glm::vec3);
+	memcpy(lumSum2.data(), p, lumSum2.size() * sizeof(float));
+
+	for (auto& tile : tiles)
+		if (tile.samples > 0)
+			for (int y = tile.y0; y < tile.y1; y++)
+				for (int x = tile.x0; x < tile.x1; x++)
+					recordPrimaryHit(x, y);
+}
+
+// store the guide buffer values of the surface seen through the pixel center
+void PathTracer::recordPrimaryHit(int x, int y)
+{
+	Ray ray = app->renderCam.getRay((x + 0.5f) / width, (y + 0.5f) / height);
+	PrimaryHit hit;
+	if (app->findIntersection(ray, hit) == NULL)
+		return;
+	glm::vec3 n = glm::normalize(hit.norm);
+	if (glm::dot(n, ray.d) > 0)
+		n = -n;
+	glm::vec3 p = hit.pos;
+	glm::vec3 albedo = app->surfaceDiffuse(hit, materials[hit.material], ray.d, glm::length(p - ray.p) * app->pixelSpread());
+	gbuffer.set(y * width + x, n, glm::length(p - ray.p), albedo);
+}
+
+/*
+ * Trace one path through the scene and return its radiance estimate
+ *
+ * @param Ray ray - camera ray
+ * @param Sampler& sampler - sample sequence for this pixel and sample index
+ * @return glm::vec3 - radiance in [0, 1] color units
+ */
+glm::vec3 PathTracer::tracePath(Ray ray, Sampler& sampler)
+{
+	glm::vec3 L(0, 0, 0);
+	glm::vec3 throughput(1, 1, 1);
+	// ray cone for texture filtering: width at the ray origin and growth per unit distance
+	float coneWidth = 0;
+	float coneSpread = app->pixelSpread();
+
+	for (int depth = 0; depth < maxDepth; depth++)
+	{
+		PrimaryHit hit;
+		if (app->findIntersection(ray, hit) == NULL)
+			break;
+		glm::vec3 p = hit.pos;
+		glm::vec3 n = hit.norm;
+		coneWidth += coneSpread * glm::length(p - ray.p);
+
+		// mesh normals are not unit length, and surfaces are two sided
+		n = glm::normalize(n);
+		if (glm::dot(n, ray.d) > 0)
+			n = -n;
+
+		const Material& mat = materials[hit.material];
+		glm::vec3 diffuse = app->surfaceDiffuse(hit, mat, ray.d, coneWidth);
+		glm::vec3 specular = glm::vec3(mat.specular.r, mat.specular.g, mat.specular.b) / 255.0f;
+		float exponent = mat.exponent > 0 ? mat.exponent : (float)app->power;
+
+		// next event estimation: the point lights can only be reached this way
+		L += throughput * (1 - mat.reflectivity) * directLight(p, n, -ray.d, diffuse, specular, exponent, sampler);
+
+		// Russian roulette after the first few bounces
+		if (depth >= 2)
+		{
+			float q = glm::clamp(std::max(throughput.x, std::max(throughput.y, throughput.z)), 0.05f, 0.95f);
+			if (sampler.get1D() > q)
+				break;
+			throughput /= q;
+		}
+
+		// reflective materials mirror the path with probability reflectivity
+		if (mat.reflectivity > 0 && sampler.get1D() < mat.reflectivity)
+		{
+			ray = Ray(p + n * 0.01, ray.d - 2 * glm::dot(ray.d, n) * n);
+			continue;
+		}
+
+		// cosine weighted direction on the hemisphere around n; the cosine
+		// and 1/pi of the lambertian BRDF cancel with the pdf, leaving the albedo
+		glm::vec2 xi = sampler.get2D();
+		float phi = 2 * PI * xi.x;
+		float r = sqrt(xi.y);
+		glm::vec3 t = fabs(n.x) > 0.9 ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+		glm::vec3 b1 = glm::normalize(glm::cross(t, n));
+		glm::vec3 b2 = glm::cross(n, b1);
+		glm::vec3 dir = b1 * (r * cos(phi)) + b2 * (r * sin(phi)) + n * sqrt(1 - xi.y);
+
+		throughput *= diffuse;
+		ray = Ray(p + n * 0.01, dir);
+		coneSpread = 0.5f;		// a diffuse bounce blurs whatever it sees next
+	}
+	return L;
+}
+
+// Lambert and Blinn-Phong contribution of all lights, same model as ofApp::lambert/phong.
+// Area lights are sampled at one random point per path, which is shaded like a point
+// light there; that averages to a soft shadow and the area's spread of directions.
+glm::vec3 PathTracer::directLight(const glm::vec3& p, const glm::vec3& norm, const glm::vec3& view,
+								  const glm::vec3& diffuse, const glm::vec3& specular, float exponent, Sampler& sampler)
+{
+	glm::vec3 L(0, 0, 0);
+	glm::vec3 pos = p + norm * 0.01;
+	float intensity = app->intensity;
+	for (size_t i = 0; i < app->lights.size(); i++)
+	{
+		glm::vec3 lightPos = app->lights[i]->position;
+		if (app->lights[i]->isArea())
+			lightPos = app->lights[i]->samplePoint(sampler.get2D());
+		if (glm::dot(lightPos - pos, norm) <= 0 ||
+			!app->isClearLineOfSight(lightPos, pos, app->getShadowCasters(i), i))
+			continue;
+		glm::vec3 object2Light = lightPos - pos;
+		glm::vec3 l = glm::normalize(object2Light);
+		float falloff = intensity / (0.01 * glm::dot(object2Light, object2Light));
+
+		float diffuseDot = std::max(0.0f, glm::dot(l, norm));
+		float specularDot = std::max(0.0f, glm::dot(glm::normalize(view + l), norm));
+		L += (diffuse * diffuseDot + specular * glm::pow(specularDot, exponent)) * falloff;
+	}
+	return L;
+}
+
+// relative standard error of the tile's mean luminance
+float PathTracer::tileError(const PathTile& tile)
+{
+	int n = tile.samples;
+	if (n < 2)
+		return 1;
+	float sumMean = 0;
+	float sumVar = 0;
+	for (int y = tile.y0; y < tile.y1; y++)
+		for (int x = tile.x0; x < tile.x1; x++)
+		{
+			int i = y * width + x;
+			float mean = luminance(accum[i]) / n;
+			float var = std::max(0.0f, lumSum2[i] / n - mean * mean) * n / (n - 1);
+			sumMean += mean;
+			sumVar += var / n;	// variance of the mean
+		}
+	int count = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+	// the floor keeps almost black tiles from never converging
+	return sqrt(sumVar / count) / std::max(sumMean / count, 0.02f);
+}
+
+/*
+ * Render with exactly spp samples in every pixel, ignoring the convergence test
+ *
+ * @param int width - image width in pixels
+ * @param int height - image height in pixels
+ * @param int spp - samples per pixel
+ */
+void PathTracer::renderSamples(int width, int height, int spp)
+{
+	int savedMin = minSamples;
+	int savedMax = maxSamples;
+	minSamples = maxSamples = spp;
+	start(width, height);
+	while (renderPass())
+		;
+	minSamples = savedMin;
+	maxSamples = savedMax;
+}
+
+void PathTracer::getEstimate(vector<glm::vec3>& color)
+{
+	color.assign(width * height, glm::vec3(0, 0, 0));
+	for (auto& tile : tiles)
+	{
+		if (tile.samples == 0)
+			continue;
+		for (int y = tile.y0; y < tile.y1; y++)
+			for (int x = tile.x0; x < tile.x1; x++)
+				color[y * width + x] = accum[y * width + x] / (float)tile.samples;
+	}
+}
+
+/*
+ * Copy the current estimate into an 8 bit image (flipped so row 0 is the top)
+ *
+ * @param ofImage& image - allocated image of the same size as the path tracer
+ */
+void PathTracer::toImage(ofImage& image)
+{
+	if (image.getWidth() != width || image.getHeight() != height)
+		image.allocate(width, height, OF_IMAGE_COLOR);	// e.g. a preview was shown
+	for (auto& tile : tiles)
+	{
+		if (tile.samples == 0)
+			continue;
+		float scale = 255.0f / tile.samples;
+		for (int y = tile.y0; y < tile.y1; y++)
+			for (int x = tile.x0; x < tile.x1; x++)
+			{
+				glm::vec3 c = glm::min(accum[y * width + x] * scale, glm::vec3(255, 255, 255));
+				image.setColor(x, height - y - 1, ofColor(c.x, c.y, c.z));
+			}
+	}
+	image.update();
+}
+
+void PathTracer::printStats()
+{
+	int retired = 0;
+	for (auto& tile : tiles)
+		if (!tile.active)
+			retired++;
+	float seconds = (ofGetElapsedTimeMillis() - startTime) / 1000.0;
+	cout << "Path trace pass " << pass << ": " << retired << "/" << tiles.size() << " tiles converged, "
+		 << samplesTaken << " samples (" << (float)samplesTaken / (width * height) << " spp avg) in "
+		 << seconds << " s" << endl;
+	app->printOccluderStats();
+	textures.printStats();
+	ClusteredMesh::printStats();
+	ClusteredMesh::resetStats();	// report page-ins per interval, not cumulative
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include "ofMain.h"
+#include "denoise.h"
+#include "sampler.h"
+#include "checkpoint.h"
+
+class ofApp;
+class Ray;
+
+//  A square block of pixels that the path tracer samples as a unit.
+//  A tile stays active until its estimated error falls below the
+//  convergence threshold, then it is retired and receives no more samples.
+//
+struct PathTile {
+	int x0, y0, x1, y1;		// pixel bounds [x0, x1) x [y0, y1)
+	int samples = 0;		// samples per pixel taken so far
+	float error = 1;		// relative error estimate of the tile's mean
+	bool active = true;		// false once converged (retired)
+};
+
+//  Progressive Monte Carlo path tracer
+//
+//  Uses the same scene (SceneObject::intersect), lights and shadow test as the
+//  Whitted-style drawImage(), but adds diffuse interreflection.  Each call to
+//  renderPass() adds one sample to every pixel in the active tiles, so the
+//  image can be displayed while it converges.
+//
+class PathTracer {
+public:
+	PathTracer(ofApp* app) { this->app = app; }
+
+	void start(int width, int height);	// clear the accumulation buffer and activate all tiles
+	bool renderPass();					// add one sample to each active pixel, return false when done
+	void renderSamples(int width, int height, int spp);	// render synchronously with a fixed sample count
+	void getEstimate(vector<glm::vec3>& color);	// current mean radiance per pixel
+	void toImage(ofImage& image);		// write the current estimate into an 8 bit image
+	bool isRunning() { return running; }
+	void stop() { running = false; }
+	void printStats();
+
+	int tileSize = 16;			// tile edge length in pixels
+	int minSamples = 8;			// samples before a tile may be retired
+	int maxSamples = 1024;		// a tile is retired after this many samples regardless of error
+	int maxDepth = 5;			// maximum number of bounces per path
+	float threshold = 0.02;		// relative error at which a tile is considered converged
+	int numThreads = 0;			// 0 = use all hardware threads
+	SamplerType samplerType = SAMPLER_SOBOL;
+
+	int width = 0, height = 0;
+	int pass = 0;				// number of completed passes
+	vector<PathTile> tiles;
+
+	// float accumulation buffers, one entry per pixel, row 0 is the bottom of the image
+	vector<glm::vec3> accum;	// sum of radiance samples
+	vector<float> lumSum2;		// sum of squared luminance, used for the variance estimate
+	GBuffer gbuffer;			// primary hit normal/depth/albedo for the denoiser
+
+protected:
+	void renderTile(PathTile& tile);
+	void recordPrimaryHit(int x, int y);
+	glm::vec3 tracePath(Ray ray, Sampler& sampler);
+	glm::vec3 directLight(const glm::vec3& p, const glm::vec3& norm, const glm::vec3& view,
+						  const glm::vec3& diffuse, const glm::vec3& specular, float exponent, Sampler& sampler);
+	float tileError(const PathTile& tile);
+
+	// checkpoint: pass counters, tile states (the sample index of a tile is
+	// all the sampler state there is) and the accumulation buffers
+	size_t snapshotBytes();
+	void saveSnapshot(char* p);
+	void restoreSnapshot(const char* p);
+	RenderCheckpoint checkpoint;
+
+	ofApp* app;
+	bool running = false;
+	std::atomic<int> nextTile;
+	vector<int> activeTiles;	// indices of tiles sampled this pass
+	uint64_t samplesTaken = 0;
+	uint64_t startTime = 0;
+};
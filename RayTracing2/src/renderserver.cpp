@@ -0,0 +1,154 @@
+#include "renderserver.h"
+#include "ofApp.h"
+
+/*
+ * Start accepting clients, from this machine only: requests are not
+ * authenticated and can load any scene file
+ *
+ * @param int port - TCP port to listen on
+ * @return bool - false if the port can't be used
+ */
+bool RenderServer::start(int port)
+{
+	if (!listener.listen(port, "127.0.0.1"))
+		return false;
+	hitsValid = false;
+	requests = 0;
+	cout << "Render server listening on port " << port << " (localhost)" << endl;
+	return true;
+}
+
+void RenderServer::stop()
+{
+	for (auto& client : clients)
+		client.close();
+	clients.clear();
+	listener.close();
+	cout << "Render server stopped after " << requests << " requests" << endl;
+}
+
+// accept new clients and answer one waiting request of each, the rest wait
+// for the next frame so a busy client can't keep the window from redrawing
+void RenderServer::poll()
+{
+	if (!isRunning())
+		return;
+	for (MessageSocket s = listener.accept(0); s.isOpen(); s = listener.accept(0))
+	{
+		s.setTimeout(clientTimeout);		// receive() runs on the UI thread
+		clients.push_back(s);
+	}
+	if (clients.empty())
+		return;
+
+	vector<MessageSocket*> sockets;
+	vector<bool> ready;
+	for (auto& client : clients)
+		sockets.push_back(&client);
+	waitReadable(sockets, 0, ready);
+	for (size_t i = 0; i < clients.size(); i++)
+		if (ready[i] && !handleRequest(clients[i]))
+			clients[i].close();
+	clients.erase(std::remove_if(clients.begin(), clients.end(),
+		[](const MessageSocket& s) { return !s.isOpen(); }), clients.end());
+}
+
+bool RenderServer::reply(MessageSocket& client, const string& error)
+{
+	if (error.empty())
+		return client.send(SERVER_OK, NULL, 0);
+	MessageWriter out;
+	out.putString(error);
+	return client.send(SERVER_ERROR, out.data);
+}
+
+// receive and answer one request, false if the client is gone
+bool RenderServer::handleRequest(MessageSocket& client)
+{
+	uint32_t type;
+	vector<char> payload;
+	if (!client.receive(type, payload, maxRequest))
+		return false;
+	requests++;
+	MessageReader in(payload);
+
+	switch (type)
+	{
+	case SERVER_LOAD:
+	{
+		string fname;
+		if (!in.getString(fname))
+			return false;
+		hitsValid = false;
+		return reply(client, app->loadScene(fname) ? "" : "could not load " + fname);
+	}
+	case SERVER_SETTINGS:
+	{
+		RenderSettings s;
+		if (!in.get(s) || s.width <= 0 || s.height <= 0)
+			return reply(client, "bad settings");
+		// the primary hits only depend on the image size and camera
+		RenderSettings old = app->getRenderSettings();
+		if (s.width != old.width || s.height != old.height || s.cameraPos != old.cameraPos || s.viewZ != old.viewZ
+			|| s.viewMin != old.viewMin || s.viewMax != old.viewMax)
+			hitsValid = false;
+		app->applyRenderSettings(s);
+		app->previewCam.setPosition(app->renderCam.position);
+		return reply(client, "");
+	}
+	case SERVER_GET_SETTINGS:
+	{
+		RenderSettings s = app->getRenderSettings();
+		return client.send(SERVER_SETTINGS, &s, sizeof(s));
+	}
+	case SERVER_MOVE_OBJECT:
+	{
+		int32_t index;
+		glm::vec3 position;
+		if (!in.get(index) || !in.get(position) || index < 0 || index >= app->scene.size())
+			return reply(client, "no such object");
+		app->scene[index]->setPosition(position);		// the hierarchy is refit before the next render
+		hitsValid = false;
+		return reply(client, "");
+	}
+	case SERVER_SET_MATERIAL:
+	{
+		int32_t index, material;
+		if (!in.get(index) || !in.get(material) || index < 0 || index >= app->scene.size())
+			return reply(client, "no such object");
+		if (material < 0 || material >= materials.size())
+			return reply(client, "no such material");
+		app->scene[index]->materialId = material;
+		hitsValid = false;		// the hits carry their material
+		return reply(client, "");
+	}
+	case SERVER_SET_LIGHT:
+	{
+		int32_t index;
+		glm::vec3 position;
+		if (!in.get(index) || !in.get(position) || index < 0 || index >= app->lights.size())
+			return reply(client, "no such light");
+		app->lights[index]->setPosition(position);
+		return reply(client, "");
+	}
+	case SERVER_RENDER:
+	{
+		uint64_t start = ofGetElapsedTimeMillis();
+		app->pathTracer.stop();
+		if (!app->redrawDirty())
+			app->drawImage(false, hitsValid);
+		hitsValid = true;
+		app->bShowImage = true;
+
+		const ofPixels& pixels = app->image.getPixels();
+		MessageWriter out;
+		out.put((int32_t)pixels.getWidth());
+		out.put((int32_t)pixels.getHeight());
+		out.put((float)(ofGetElapsedTimeMillis() - start));
+		out.putBytes(pixels.getData(), (size_t)pixels.getWidth() * pixels.getHeight() * 3);
+		return client.send(SERVER_IMAGE, out.data);
+	}
+	default:
+		return reply(client, "unknown request " + ofToString(type));
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "ofMain.h"
+#include "socketio.h"
+
+class ofApp;
+
+//  Requests a client sends the render server, and the replies.  Every
+//  request gets exactly one reply, SERVER_OK or SERVER_ERROR (a message)
+//  unless noted.
+//
+enum ServerMessage : uint32_t {
+	SERVER_LOAD = 100,		// scene file name
+	SERVER_SETTINGS,		// RenderSettings (image size, camera, slider values)
+	SERVER_GET_SETTINGS,	// nothing, replied to with SERVER_SETTINGS
+	SERVER_MOVE_OBJECT,		// int32 object index, vec3 position
+	SERVER_SET_MATERIAL,	// int32 object index, int32 material index
+	SERVER_SET_LIGHT,		// int32 light index, vec3 position; brightness is the intensity
+							// slider of SERVER_SETTINGS, lambert/phong use no per light value
+	SERVER_RENDER,			// nothing, replied to with SERVER_IMAGE
+	SERVER_IMAGE,			// int32 width, height, float milliseconds, rgb rows top down
+	SERVER_OK,
+	SERVER_ERROR			// message
+};
+
+//  Keeps the app's scene resident and renders it on request, so a client
+//  that changes the camera, moves objects or tweaks settings only waits for
+//  the trace itself, not for the app to start and the scene to load.
+//
+//  Clients connect over TCP (MessageSocket) on the loopback interface only,
+//  since requests are not authenticated, and may stay connected across any
+//  number of requests.  Requests are handled from update() between
+//  frames, one per client and frame, so the window keeps showing the last
+//  image; a client that stalls in the middle of a request or sends an
+//  oversized one is dropped.  After object edits
+//  only the pixels they can reach are re-traced (ofApp::redrawDirty); edits
+//  that leave the primary rays alone (lights, shading settings) re-shade the
+//  primary hits of the last render instead of tracing them again.
+//
+class RenderServer {
+public:
+	RenderServer(ofApp* app) : app(app) {}
+
+	bool start(int port);
+	void stop();
+	void poll();		// handle at most one waiting request per client, called every frame
+	bool isRunning() const { return listener.isOpen(); }
+
+	float clientTimeout = 2;				// seconds a started request may take to arrive
+	static const size_t maxRequest = 1 << 16;	// requests are a file name or settings at most
+
+protected:
+	bool handleRequest(MessageSocket& client);
+	bool reply(MessageSocket& client, const string& error);	// SERVER_OK if error is empty
+
+	ofApp* app;
+	MessageListener listener;
+	vector<MessageSocket> clients;
+	bool hitsValid = false;			// the app's primary hits match its camera and geometry
+	int requests = 0;
+};
@@ -0,0 +1,160 @@
+#include "sampler.h"
+
+namespace sampling {
+
+	uint32_t sobolDirections[4][32];
+
+	// fill the direction numbers from the Joe & Kuo primitive polynomials
+	// (s = degree, a = coefficients, m = initial direction numbers)
+	static void initDirections(uint32_t* v, int s, int a, const uint32_t* m)
+	{
+		for (int i = 0; i < 32; i++)
+		{
+			if (i < s)
+				v[i] = m[i] << (31 - i);
+			else
+			{
+				v[i] = v[i - s] ^ (v[i - s] >> s);
+				for (int k = 1; k < s; k++)
+					v[i] ^= ((a >> (s - 1 - k)) & 1) * v[i - k];
+			}
+		}
+	}
+
+	static bool initSobol()
+	{
+		// dimension 0 is the van der Corput sequence
+		for (int i = 0; i < 32; i++)
+			sobolDirections[0][i] = 1u << (31 - i);
+		const uint32_t m1[] = { 1 };
+		const uint32_t m2[] = { 1, 3 };
+		const uint32_t m3[] = { 1, 3, 1 };
+		initDirections(sobolDirections[1], 1, 0, m1);
+		initDirections(sobolDirections[2], 2, 1, m2);
+		initDirections(sobolDirections[3], 3, 1, m3);
+		return true;
+	}
+	static bool sobolReady = initSobol();
+
+	/*
+	 * Generate a toroidal blue noise tile with the void-and-cluster method (Ulichney 1993)
+	 *
+	 * @param int n - tile edge length
+	 * @return vector<float> - rank of every pixel divided by n*n
+	 */
+	static vector<float> voidAndCluster(int n)
+	{
+		const int size = n * n;
+		const float sigma = 1.5;
+
+		// toroidal gaussian energy kernel, indexed by wrapped offset
+		vector<float> kernel(size);
+		for (int dy = 0; dy < n; dy++)
+			for (int dx = 0; dx < n; dx++)
+			{
+				int wx = std::min(dx, n - dx);
+				int wy = std::min(dy, n - dy);
+				kernel[dy * n + dx] = exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+			}
+
+		vector<char> pattern(size, 0);
+		vector<float> energy(size, 0);
+		auto splat = [&](int p, float sign) {
+			int px = p % n, py = p / n;
+			for (int y = 0; y < n; y++)
+				for (int x = 0; x < n; x++)
+					energy[y * n + x] += sign * kernel[((y - py + n) % n) * n + (x - px + n) % n];
+		};
+		// tightest cluster = set pixel with most energy, largest void = empty pixel with least
+		auto tightestCluster = [&]() {
+			int best = -1;
+			for (int i = 0; i < size; i++)
+				if (pattern[i] && (best < 0 || energy[i] > energy[best]))
+					best = i;
+			return best;
+		};
+		auto largestVoid = [&]() {
+			int best = -1;
+			for (int i = 0; i < size; i++)
+				if (!pattern[i] && (best < 0 || energy[i] < energy[best]))
+					best = i;
+			return best;
+		};
+
+		// initial pattern: 10% random points, relaxed until stable
+		uint32_t state = 1;
+		int ones = size / 10;
+		for (int placed = 0; placed < ones; )
+		{
+			state = hash(state);
+			int p = state % size;
+			if (!pattern[p])
+			{
+				pattern[p] = 1;
+				splat(p, 1);
+				placed++;
+			}
+		}
+		for (int iter = 0; iter < size; iter++)
+		{
+			int cluster = tightestCluster();
+			pattern[cluster] = 0;
+			splat(cluster, -1);
+			int hole = largestVoid();
+			pattern[hole] = 1;
+			splat(hole, 1);
+			if (hole == cluster)
+				break;
+		}
+		vector<char> initial = pattern;
+		vector<float> initialEnergy = energy;
+
+		vector<int> rank(size, 0);
+		// phase 1: remove points of the initial pattern from the tightest clusters
+		for (int r = ones - 1; r >= 0; r--)
+		{
+			int cluster = tightestCluster();
+			pattern[cluster] = 0;
+			splat(cluster, -1);
+			rank[cluster] = r;
+		}
+		// phases 2 and 3: fill the largest voids until the tile is full
+		pattern = initial;
+		energy = initialEnergy;
+		for (int r = ones; r < size; r++)
+		{
+			int hole = largestVoid();
+			pattern[hole] = 1;
+			splat(hole, 1);
+			rank[hole] = r;
+		}
+
+		vector<float> tile(size);
+		for (int i = 0; i < size; i++)
+			tile[i] = (rank[i] + 0.5f) / size;
+		return tile;
+	}
+
+	// the tile is generated on first use and cached in the data folder
+	const vector<float>& blueNoiseTile()
+	{
+		static vector<float> tile = []() {
+			const int n = BLUE_NOISE_SIZE;
+			string fname = ofToDataPath("bluenoise" + ofToString(n) + ".bin");
+			ofFile file(fname, ofFile::ReadOnly, true);
+			if (file.exists() && file.getSize() == n * n * sizeof(float))
+			{
+				ofBuffer buff = file.readToBuffer();
+				vector<float> t(n * n);
+				memcpy(t.data(), buff.getData(), n * n * sizeof(float));
+				return t;
+			}
+			cout << "Generating " << n << "x" << n << " blue noise tile" << endl;
+			vector<float> t = voidAndCluster(n);
+			ofFile out(fname, ofFile::WriteOnly, true);
+			out.writeFromBuffer(ofBuffer((const char*)t.data(), t.size() * sizeof(float)));
+			return t;
+		}();
+		return tile;
+	}
+}
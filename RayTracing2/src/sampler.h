@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "ofMain.h"
+
+//  Sample sequences for the stochastic parts of the renderer
+//
+//  A Sampler is created on the stack for one (pixel, sample index) pair and
+//  hands out the next dimensions of that sample with get1D()/get2D().  Every
+//  value is a pure function of (pixel, sample index, dimension, seed), so
+//  renders are identical no matter how the pixels are spread over threads.
+//
+//    WHITE      - hashed uniform random numbers (reference)
+//    SOBOL      - 4D Sobol points with hash based Owen scrambling (Burley 2020);
+//                 consecutive get2D() calls walk through dimensions 0-1 and 2-3
+//                 of one point, higher dimensions are padded with
+//                 independently shuffled and scrambled 4D points
+//    BLUE_NOISE - a void-and-cluster blue noise tile, offset per dimension and
+//                 advanced per sample with the golden ratio
+//
+enum SamplerType { SAMPLER_WHITE = 0, SAMPLER_SOBOL = 1, SAMPLER_BLUE_NOISE = 2 };
+
+namespace sampling {
+
+	// 32 bit integer hash (lowbias32)
+	inline uint32_t hash(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352d;
+		x ^= x >> 15;
+		x *= 0x846ca68b;
+		x ^= x >> 16;
+		return x;
+	}
+
+	inline uint32_t hashCombine(uint32_t seed, uint32_t v)
+	{
+		return seed ^ (v + (seed << 6) + (seed >> 2));
+	}
+
+	inline uint32_t reverseBits(uint32_t x)
+	{
+		x = (x << 16) | (x >> 16);
+		x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+		x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+		x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+		x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+		return x;
+	}
+
+	// Laine-Karras style permutation, only lower bits affect higher bits
+	inline uint32_t laineKarras(uint32_t x, uint32_t seed)
+	{
+		x += seed;
+		x ^= x * 0x6c50b47c;
+		x ^= x * 0xb82f1e52;
+		x ^= x * 0xc7afe638;
+		x ^= x * 0x8d22f6e6;
+		return x;
+	}
+
+	// Owen scramble of a 32 bit fixed point value
+	inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+	{
+		return reverseBits(laineKarras(reverseBits(x), seed));
+	}
+
+	// Sobol direction numbers for dimensions 0-3 (Joe & Kuo), filled in sampler.cpp
+	extern uint32_t sobolDirections[4][32];
+
+	inline uint32_t sobol(uint32_t index, int dim)
+	{
+		uint32_t x = 0;
+		for (int bit = 0; index != 0; bit++, index >>= 1)
+			if (index & 1)
+				x ^= sobolDirections[dim][bit];
+		return x;
+	}
+
+	inline float toFloat(uint32_t x)
+	{
+		return (x >> 8) * (1.0f / 16777216.0f);
+	}
+
+	// blue noise tile, BLUE_NOISE_SIZE^2 ranks normalized to [0, 1)
+	const int BLUE_NOISE_SIZE = 64;
+	const vector<float>& blueNoiseTile();
+}
+
+class Sampler {
+public:
+	Sampler(SamplerType type, int x, int y, uint32_t sampleIndex, uint32_t seed = 0) {
+		this->type = type;
+		this->x = x;
+		this->y = y;
+		index = sampleIndex;
+		pixelSeed = sampling::hash(sampling::hashCombine(seed, sampling::hash(x * 73856093u ^ y * 19349663u)));
+	}
+
+	// next dimension of this sample, in [0, 1)
+	float get1D() {
+		return get2D().x;
+	}
+
+	// next two dimensions of this sample, in [0, 1)^2
+	glm::vec2 get2D() {
+		uint32_t d = dim++;
+		switch (type) {
+		case SAMPLER_SOBOL: {
+			// pairs 2k and 2k+1 are dimensions 0-1 and 2-3 of the same 4D point,
+			// each group of four gets its own shuffle of the sample order
+			uint32_t group = d / 2, first = (d & 1) * 2;
+			uint32_t groupSeed = sampling::hash(sampling::hashCombine(pixelSeed, group));
+			uint32_t i = sampling::nestedUniformScramble(index, groupSeed);
+			uint32_t s0 = sampling::nestedUniformScramble(sampling::sobol(i, first), sampling::hashCombine(groupSeed, first + 1));
+			uint32_t s1 = sampling::nestedUniformScramble(sampling::sobol(i, first + 1), sampling::hashCombine(groupSeed, first + 2));
+			return glm::vec2(sampling::toFloat(s0), sampling::toFloat(s1));
+		}
+		case SAMPLER_BLUE_NOISE: {
+			// toroidally shifted tile per dimension, golden ratio sequence over samples
+			const vector<float>& tile = sampling::blueNoiseTile();
+			const int n = sampling::BLUE_NOISE_SIZE;
+			uint32_t h = sampling::hash(d * 2 + 1);
+			int ix = (x + (h & 0xffff)) & (n - 1);
+			int iy = (y + (h >> 16)) & (n - 1);
+			int jx = (ix + n / 2) & (n - 1);
+			int jy = (iy + n / 3) & (n - 1);
+			float a = tile[iy * n + ix] + index * 0.61803398875f;
+			float b = tile[jy * n + jx] + index * 0.75487766625f;
+			return glm::vec2(a - floor(a), b - floor(b));
+		}
+		default: {
+			uint32_t h = sampling::hash(sampling::hashCombine(sampling::hashCombine(pixelSeed, index), d));
+			return glm::vec2(sampling::toFloat(h), sampling::toFloat(sampling::hash(h)));
+		}
+		}
+	}
+
+protected:
+	SamplerType type;
+	int x, y;
+	uint32_t index;			// sample index within the pixel
+	uint32_t pixelSeed;
+	uint32_t dim = 0;		// next 2D dimension pair
+};
@@ -0,0 +1,211 @@
+#include <cfloat>
+#include "scenebvh.h"
+#include "ofApp.h"
+
+/*
+ * Build the hierarchy by recursive median splits along the longest axis
+ *
+ * @param const vector<SceneObject*>& scene - all scene objects, the ones that
+ *        can't go in the tree end up in others
+ */
+void SceneBVH::build(const vector<SceneObject*>& scene)
+{
+	nodes.clear();
+	objects.clear();
+	others.clear();
+	omin.clear();
+	omax.clear();
+	for (auto obj : scene)
+	{
+		glm::vec3 bmin, bmax;
+		if (!obj->wantsBatches() && obj->getBounds(bmin, bmax))
+		{
+			objects.push_back(obj);
+			omin.push_back(bmin);
+			omax.push_back(bmax);
+		}
+		else
+			others.push_back(obj);
+	}
+	if (objects.empty())
+		return;
+
+	vector<int> ids(objects.size());
+	for (size_t i = 0; i < ids.size(); i++)
+		ids[i] = i;
+	nodes.reserve(2 * objects.size());
+	buildNode(ids, 0, ids.size());
+}
+
+// build the node for objects ids[begin, end) and return its index
+int SceneBVH::buildNode(vector<int>& ids, int begin, int end)
+{
+	int index = nodes.size();
+	nodes.push_back(SceneNode());
+
+	SceneNode node;
+	node.bmin = omin[ids[begin]];
+	node.bmax = omax[ids[begin]];
+	glm::vec3 cmin = (omin[ids[begin]] + omax[ids[begin]]) * 0.5f;
+	glm::vec3 cmax = cmin;
+	for (int i = begin; i < end; i++)
+	{
+		int id = ids[i];
+		node.bmin = glm::min(node.bmin, omin[id]);
+		node.bmax = glm::max(node.bmax, omax[id]);
+		glm::vec3 c = (omin[id] + omax[id]) * 0.5f;
+		cmin = glm::min(cmin, c);
+		cmax = glm::max(cmax, c);
+	}
+
+	if (end - begin == 1)
+		node.object = ids[begin];
+	else
+	{
+		// split at the median centroid along the longest axis
+		glm::vec3 extent = cmax - cmin;
+		int axis = 0;
+		if (extent.y > extent[axis]) axis = 1;
+		if (extent.z > extent[axis]) axis = 2;
+		int mid = (begin + end) / 2;
+		std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end, [&](int a, int b) {
+			return omin[a][axis] + omax[a][axis] < omin[b][axis] + omax[b][axis];
+		});
+		node.left = buildNode(ids, begin, mid);
+		node.right = buildNode(ids, mid, end);
+	}
+	nodes[index] = node;
+	return index;
+}
+
+// Children always come after their parent, so one backwards pass over the
+// nodes sees both children of a node before the node itself.
+void SceneBVH::refit()
+{
+	for (int i = nodes.size() - 1; i >= 0; i--)
+	{
+		SceneNode& node = nodes[i];
+		if (node.object >= 0)
+			objects[node.object]->getBounds(node.bmin, node.bmax);
+		else
+		{
+			node.bmin = glm::min(nodes[node.left].bmin, nodes[node.right].bmin);
+			node.bmax = glm::max(nodes[node.left].bmax, nodes[node.right].bmax);
+		}
+	}
+}
+
+// slab test, returns the ray parameter where the box is entered (or
+// FLT_MAX if it is missed or starts beyond tMax)
+static float enterBox(const glm::vec3& bmin, const glm::vec3& bmax, const glm::vec3& origin, const glm::vec3& invDir, float tMax)
+{
+	glm::vec3 t0 = (bmin - origin) * invDir;
+	glm::vec3 t1 = (bmax - origin) * invDir;
+	glm::vec3 tNear = glm::min(t0, t1), tFar = glm::max(t0, t1);
+	float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+	float exit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+	return enter <= exit && enter <= tMax ? enter : FLT_MAX;
+}
+
+/*
+ * Find the closest object in the tree hit by a ray, visiting the nearer
+ * child first and skipping boxes that start beyond the best hit so far
+ *
+ * @param const Ray& ray - the ray
+ * @param PrimaryHit& hit - closest hit so far (object NULL = none), updated if an object is closer
+ */
+void SceneBVH::intersect(const Ray& ray, PrimaryHit& hit) const
+{
+	if (nodes.empty())
+		return;
+	glm::vec3 invDir = 1.0f / ray.d;
+	float dirLength = glm::length(ray.d);
+	float tBest = hit.object != NULL ? glm::length(hit.pos - ray.p) / dirLength : FLT_MAX;
+
+	glm::vec3 p, n;
+	uint16_t m;
+	int prim;
+	int stack[64];
+	int top = 0;
+	if (enterBox(nodes[0].bmin, nodes[0].bmax, ray.p, invDir, tBest) < FLT_MAX)
+		stack[top++] = 0;
+	while (top > 0)
+	{
+		const SceneNode& node = nodes[stack[--top]];
+		if (node.object >= 0)
+		{
+			SceneObject* obj = objects[node.object];
+			if (obj->intersect(ray, p, n, m, prim))
+			{
+				float t = glm::length(p - ray.p) / dirLength;
+				if (t < tBest)
+				{
+					tBest = t;
+					hit.object = obj;
+					hit.pos = p;
+					hit.norm = n;
+					hit.material = m;
+					hit.primitive = prim;
+				}
+			}
+			continue;
+		}
+		// median splits keep the depth (and the stack) at log2(objects)
+		float tl = enterBox(nodes[node.left].bmin, nodes[node.left].bmax, ray.p, invDir, tBest);
+		float tr = enterBox(nodes[node.right].bmin, nodes[node.right].bmax, ray.p, invDir, tBest);
+		if (tl < tr)
+		{
+			if (tr < FLT_MAX) stack[top++] = node.right;
+			stack[top++] = node.left;		// popped first
+		}
+		else
+		{
+			if (tl < FLT_MAX) stack[top++] = node.left;
+			if (tr < FLT_MAX) stack[top++] = node.right;
+		}
+	}
+}
+
+/*
+ * Find an object in the tree that blocks a segment.  Any blocker will do
+ * for a shadow ray, so the first one found ends the search.
+ *
+ * @param const Ray& ray - segment start and unit direction
+ * @param float length - segment length
+ * @param const vector<bool>& include - objects to test, indexed by sceneIndex
+ * @param SceneObject* skip - object the caller already tested, or NULL
+ * @return SceneObject* - a blocking object, NULL if the segment is clear
+ */
+SceneObject* SceneBVH::occluder(const Ray& ray, float length, const vector<bool>& include, SceneObject* skip) const
+{
+	if (nodes.empty())
+		return NULL;
+	glm::vec3 invDir = 1.0f / ray.d;
+	glm::vec3 p, n;
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const SceneNode& node = nodes[stack[--top]];
+		if (enterBox(node.bmin, node.bmax, ray.p, invDir, length) == FLT_MAX)
+			continue;
+		if (node.object < 0)
+		{
+			stack[top++] = node.left;
+			stack[top++] = node.right;
+			continue;
+		}
+		SceneObject* obj = objects[node.object];
+		if (obj == skip || !obj->castShadows || obj->sceneIndex < 0 || obj->sceneIndex >= (int)include.size()
+			|| !include[obj->sceneIndex])
+			continue;
+		if (obj->intersect(ray, p, n))
+		{
+			glm::vec3 diff = p - ray.p;
+			if (glm::dot(diff, diff) < length * length)
+				return obj;
+		}
+	}
+	return NULL;
+}
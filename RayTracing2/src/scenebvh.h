@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+#include "ofMain.h"
+
+class SceneObject;
+class Ray;
+struct PrimaryHit;
+
+//  Node of the scene hierarchy.  Interior nodes bound their children,
+//  leaves hold a single object.
+//
+struct SceneNode {
+	glm::vec3 bmin, bmax;
+	int left = -1;			// child node indices, -1 for a leaf
+	int right = -1;
+	int object = -1;		// index into the object list for a leaf
+};
+
+//  Bounding volume hierarchy over the bounded scene objects
+//
+//  Rays only test the objects whose bounds they cross instead of every
+//  object in the scene.  When objects move the tree is refit (bounds
+//  recomputed bottom up, topology kept) instead of rebuilt, which is what
+//  an animation needs from frame to frame.  Unbounded objects (planes) and
+//  objects that page in their data and want rays in batches (clustered
+//  meshes) are kept out of the tree and tested separately by the caller.
+//
+class SceneBVH {
+public:
+	void build(const vector<SceneObject*>& objects);
+	void refit();		// recompute the bounds after objects moved
+
+	// closest hit of a ray with the objects in the tree, updates hit if closer
+	void intersect(const Ray& ray, PrimaryHit& hit) const;
+	// any object in the tree blocking a shadow ray segment, NULL if it is clear
+	SceneObject* occluder(const Ray& ray, float length, const vector<bool>& include, SceneObject* skip) const;
+
+	int numObjects() const { return objects.size(); }
+
+	vector<SceneNode> nodes;			// nodes[0] is the root, children after their parents
+	vector<SceneObject*> objects;		// objects in the tree, leaves index this
+	vector<SceneObject*> others;		// everything else, for the caller to test
+
+protected:
+	int buildNode(vector<int>& ids, int begin, int end);
+
+	vector<glm::vec3> omin, omax;		// per object bounds used during build
+};
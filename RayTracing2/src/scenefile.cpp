@@ -0,0 +1,548 @@
+#include <fstream>
+#include <cstdlib>
+#include "scenefile.h"
+
+static const char binaryMagic[4] = { 'R', 'S', 'B', '1' };
+static const uint32_t binaryVersion = 3;	// 2 added keyframes, 3 mesh flags
+
+//  Cursor over one line of a text scene file.  Tokens are read in place, no
+//  copies of the line are made, so large files parse at close to disk speed.
+//
+struct LineReader {
+	const char* p;
+	const char* end;		// end of the line
+
+	void skipSpace() { while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++; }
+	bool atEnd() { skipSpace(); return p >= end; }
+	bool word(string& w) {
+		skipSpace();
+		const char* start = p;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+			p++;
+		w.assign(start, p);
+		return p > start;
+	}
+	bool number(float& f) {
+		if (atEnd())
+			return false;
+		char* after;
+		f = strtof(p, &after);
+		if (after == p || after > end)
+			return false;
+		p = after;
+		return true;
+	}
+	bool vec3(glm::vec3& v) { return number(v.x) && number(v.y) && number(v.z); }
+};
+
+// [0, 1] color as read from the file
+static ofColor toColor(const glm::vec3& c)
+{
+	glm::vec3 v = glm::clamp(c, 0.0f, 1.0f) * 255.0f;
+	return ofColor(v.x, v.y, v.z);
+}
+
+// frame file names are printed with the pattern, so it may hold nothing but
+// "%%" and exactly one integer conversion like %d or %04d
+static bool validFramePattern(const string& pattern)
+{
+	int conversions = 0;
+	for (size_t i = 0; i < pattern.size(); i++)
+	{
+		if (pattern[i] != '%')
+			continue;
+		if (++i < pattern.size() && pattern[i] == '%')
+			continue;
+		while (i < pattern.size() && strchr("-+ 0#", pattern[i]) != NULL)
+			i++;
+		while (i < pattern.size() && isdigit((unsigned char)pattern[i]))
+			i++;
+		if (i >= pattern.size() || (pattern[i] != 'd' && pattern[i] != 'i'))
+			return false;
+		conversions++;
+	}
+	return conversions == 1;
+}
+
+void SceneFile::clear()
+{
+	*this = SceneFile();
+}
+
+int SceneFile::findMaterial(const string& name)
+{
+	auto it = materialNames.find(name);
+	return it == materialNames.end() ? -2 : it->second;
+}
+
+/*
+ * Read a scene file, replacing the contents of this description
+ *
+ * @param const string& fname - .scn text or .scnb binary file, relative to the data folder
+ * @return bool - false if the file can't be read or has errors (reported on cout)
+ */
+bool SceneFile::load(const string& fname)
+{
+	clear();
+	fileName = fname;
+	std::ifstream in(ofToDataPath(fname), std::ios::binary | std::ios::ate);
+	if (!in)
+	{
+		cout << "could not open scene file " << fname << endl;
+		return false;
+	}
+	vector<char> data((size_t)in.tellg() + 1, 0);	// zero terminated for strtof
+	in.seekg(0);
+	in.read(data.data(), data.size() - 1);
+
+	if (data.size() > 4 && memcmp(data.data(), binaryMagic, 4) == 0)
+		return loadBinary(data);
+	return parseText(data.data(), data.size() - 1);
+}
+
+bool SceneFile::parseText(const char* text, size_t size)
+{
+	const char* end = text + size;
+	int lineNumber = 0;
+	string keyword, token;
+	auto fail = [&](const string& message) {
+		cout << fileName << ":" << lineNumber << ": " << message << endl;
+		return false;
+	};
+
+	// what a key statement animates, -1 = nothing yet
+	int32_t keyTarget = -1, keyIndex = -1;
+
+	for (const char* p = text; p < end; )
+	{
+		const char* eol = (const char*)memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		LineReader line = { p, eol };
+		p = eol + 1;
+		lineNumber++;
+
+		if (!line.word(keyword) || keyword[0] == '#')
+			continue;
+
+		// optional trailing material name, -1 = default
+		int material = -1;
+		auto readMaterial = [&]() {
+			if (!line.word(token))
+				return true;
+			material = findMaterial(token);
+			return material != -2;
+		};
+
+		if (keyword == "sphere")
+		{
+			SphereRec s;
+			if (!line.vec3(s.center) || !line.number(s.radius))
+				return fail("sphere needs x y z radius");
+			if (!readMaterial())
+				return fail("unknown material " + token);
+			s.material = material;
+			spheres.push_back(s);
+			keyTarget = KEY_SPHERE;
+			keyIndex = spheres.size() - 1;
+		}
+		else if (keyword == "plane")
+		{
+			PlaneRec pl;
+			if (!line.vec3(pl.point) || !line.vec3(pl.normal))
+				return fail("plane needs x y z nx ny nz");
+			if (!readMaterial())
+				return fail("unknown material " + token);
+			pl.normal = glm::normalize(pl.normal);
+			pl.material = material;
+			planes.push_back(pl);
+			keyTarget = KEY_PLANE;
+			keyIndex = planes.size() - 1;
+		}
+		else if (keyword == "light" || keyword == "spherelight" || keyword == "rectlight")
+		{
+			LightRec l = {};
+			l.type = keyword == "light" ? LIGHT_POINT : keyword == "spherelight" ? LIGHT_SPHERE : LIGHT_RECT;
+			bool ok = line.vec3(l.position);
+			if (l.type == LIGHT_SPHERE)
+				ok = ok && line.number(l.radius);
+			else if (l.type == LIGHT_RECT)
+				ok = ok && line.vec3(l.u) && line.vec3(l.v);
+			if (!ok || !line.number(l.intensity))
+				return fail(keyword + " has missing or bad values");
+			lights.push_back(l);
+			keyTarget = KEY_LIGHT;
+			keyIndex = lights.size() - 1;
+		}
+		else if (keyword == "material")
+		{
+			Material m;
+			if (!line.word(m.name))
+				return fail("material needs a name");
+			while (line.word(token))
+			{
+				glm::vec3 c;
+				float f;
+				if (token == "diffuse" && line.vec3(c))
+					m.diffuse = toColor(c);
+				else if (token == "specular" && line.vec3(c))
+					m.specular = toColor(c);
+				else if (token == "exponent" && line.number(f))
+					m.exponent = f;
+				else if (token == "reflectivity" && line.number(f))
+					m.reflectivity = f;
+				else if (token == "scale" && line.number(f))
+					m.textureScale = f;
+				else if (token == "map" && line.word(m.diffuseMap))
+					continue;
+				else
+					return fail("bad material property " + token);
+			}
+			materialNames[m.name] = materials.size();
+			materials.push_back(m);
+		}
+		else if (keyword == "mtllib")
+		{
+			if (!line.word(token))
+				return fail("mtllib needs a file name");
+			// next to the scene file if it is there
+			string nextTo = ofFilePath::join(ofFilePath::getEnclosingDirectory(fileName), token);
+			if (ofFile::doesFileExist(nextTo))
+				token = nextTo;
+			MaterialTable table;
+			map<string, uint16_t> byName;
+			if (!table.loadMtl(token, byName))
+				return fail("could not load " + token);
+			for (size_t i = 1; i < table.size(); i++)
+			{
+				materialNames[table[i].name] = materials.size();
+				materials.push_back(table[i]);
+			}
+		}
+		else if (keyword == "mesh")
+		{
+			MeshRec m;
+			m.kind = MESH_OBJ;
+			glm::vec3 at;
+			if (!line.word(m.file) || !line.vec3(at))
+				return fail("mesh needs file x y z");
+			while (line.word(token))
+			{
+				if (token == "packnormals")
+					m.flags |= MESH_PACK_NORMALS;
+				else if (token == "compact")
+					m.flags |= MESH_COMPACT;
+				else if (token == "nolod")
+					m.flags |= MESH_NO_LOD;
+				else if (material == -1 && (material = findMaterial(token)) != -2)
+					continue;
+				else
+					return fail("unknown material or mesh option " + token);
+			}
+			m.transform = glm::translate(glm::mat4(1), at);
+			m.material = material;
+			meshes.push_back(m);
+			keyTarget = KEY_MESH;
+			keyIndex = meshes.size() - 1;
+		}
+		else if (keyword == "instance")
+		{
+			MeshRec m;
+			m.kind = MESH_INSTANCE;
+			if (!line.word(m.file))
+				return fail("instance needs a file");
+			glm::vec3 at(0), axis(0, 1, 0);
+			float angle = 0, scale = 1;
+			while (line.word(token))
+			{
+				bool ok = true;
+				if (token == "at")
+					ok = line.vec3(at);
+				else if (token == "rotate")
+					ok = line.number(angle) && line.vec3(axis);
+				else if (token == "scale")
+					ok = line.number(scale);
+				else if (token == "material")
+					ok = line.word(token) && (material = findMaterial(token)) != -2;
+				else if (token == "packnormals")
+					m.flags |= MESH_PACK_NORMALS;
+				else if (token == "compact")
+					m.flags |= MESH_COMPACT;
+				else if (token == "nolod")
+					m.flags |= MESH_NO_LOD;
+				else
+					ok = false;
+				if (!ok)
+					return fail("bad instance option " + token);
+			}
+			// scale, then rotate, then move into place
+			m.transform = glm::translate(glm::mat4(1), at);
+			if (angle != 0)
+				m.transform = glm::rotate(m.transform, glm::radians(angle), glm::normalize(axis));
+			m.transform = glm::scale(m.transform, glm::vec3(scale));
+			m.material = material;
+			meshes.push_back(m);
+			keyTarget = KEY_MESH;
+			keyIndex = meshes.size() - 1;
+		}
+		else if (keyword == "clustered")
+		{
+			MeshRec m;
+			m.kind = MESH_CLUSTERED;
+			if (!line.word(m.file))
+				return fail("clustered needs a file");
+			m.transform = glm::mat4(1);
+			m.material = -1;
+			meshes.push_back(m);
+			keyTarget = KEY_MESH;
+			keyIndex = meshes.size() - 1;
+		}
+		else if (keyword == "camera")
+		{
+			if (!line.vec3(cameraPos))
+				return fail("camera needs x y z");
+			hasCamera = true;
+			keyTarget = KEY_CAMERA;
+			keyIndex = 0;
+		}
+		else if (keyword == "view")
+		{
+			if (!line.number(viewZ) || !line.number(viewMin.x) || !line.number(viewMin.y)
+				|| !line.number(viewMax.x) || !line.number(viewMax.y))
+				return fail("view needs z minx miny maxx maxy");
+			hasCamera = true;
+		}
+		else if (keyword == "image")
+		{
+			float w, h;
+			if (!line.number(w) || !line.number(h) || w < 1 || h < 1)
+				return fail("image needs width height");
+			width = w;
+			height = h;
+		}
+		else if (keyword == "key")
+		{
+			KeyRec k;
+			if (keyTarget < 0)
+				return fail("key before any object, light or camera");
+			if (!line.number(k.time) || !line.vec3(k.position))
+				return fail("key needs time x y z");
+			k.target = keyTarget;
+			k.index = keyIndex;
+			keys.push_back(k);
+		}
+		else if (keyword == "animation")
+		{
+			if (!line.number(animStart) || !line.number(animEnd) || !line.number(fps) || fps <= 0 || animEnd < animStart)
+				return fail("animation needs start end fps");
+			line.word(framePattern);
+			if (!validFramePattern(framePattern))
+				return fail("frame pattern needs exactly one %d and no other % conversion");
+		}
+		else if (keyword == "ambient")
+		{
+			if (!line.number(ambient))
+				return fail("ambient needs a value");
+		}
+		else
+			return fail("unknown statement " + keyword);
+
+		if (!line.atEnd())
+			return fail("extra values after " + keyword);
+	}
+	return true;
+}
+
+// binary helpers: POD values, length prefixed strings and raw arrays
+static void putString(std::ofstream& out, const string& s)
+{
+	uint32_t n = s.size();
+	out.write((const char*)&n, 4);
+	out.write(s.data(), n);
+}
+
+template<typename T> static void putArray(std::ofstream& out, const vector<T>& v)
+{
+	uint32_t n = v.size();
+	out.write((const char*)&n, 4);
+	out.write((const char*)v.data(), n * sizeof(T));
+}
+
+//  Bounds checked reader over the bytes of a binary scene file
+//
+struct BinaryReader {
+	const char* p;
+	const char* end;
+	bool ok = true;
+
+	template<typename T> void get(T& v) {
+		if (end - p < (ptrdiff_t)sizeof(T)) { ok = false; return; }
+		memcpy(&v, p, sizeof(T));
+		p += sizeof(T);
+	}
+	void getString(string& s) {
+		uint32_t n = 0;
+		get(n);
+		if (!ok || end - p < (ptrdiff_t)n) { ok = false; return; }
+		s.assign(p, n);
+		p += n;
+	}
+	template<typename T> void getArray(vector<T>& v) {
+		uint32_t n = 0;
+		get(n);
+		if (!ok || (size_t)(end - p) / sizeof(T) < n) { ok = false; return; }
+		v.resize(n);
+		memcpy(v.data(), p, n * sizeof(T));
+		p += n * sizeof(T);
+	}
+};
+
+/*
+ * Write this scene in the binary form
+ *
+ * @param const string& fname - output file, relative to the data folder
+ * @return bool - false if the file could not be written
+ */
+bool SceneFile::saveBinary(const string& fname) const
+{
+	std::ofstream out(ofToDataPath(fname), std::ios::binary);
+	if (!out)
+		return false;
+	out.write(binaryMagic, 4);
+	out.write((const char*)&binaryVersion, 4);
+
+	int32_t camera = hasCamera;
+	out.write((const char*)&camera, 4);
+	out.write((const char*)&cameraPos, sizeof(cameraPos));
+	out.write((const char*)&viewZ, 4);
+	out.write((const char*)&viewMin, sizeof(viewMin));
+	out.write((const char*)&viewMax, sizeof(viewMax));
+	out.write((const char*)&width, 4);
+	out.write((const char*)&height, 4);
+	out.write((const char*)&ambient, 4);
+
+	uint32_t n = materials.size();
+	out.write((const char*)&n, 4);
+	for (auto& m : materials)
+	{
+		putString(out, m.name);
+		unsigned char colors[6] = { m.diffuse.r, m.diffuse.g, m.diffuse.b, m.specular.r, m.specular.g, m.specular.b };
+		out.write((const char*)colors, 6);
+		out.write((const char*)&m.exponent, 4);
+		out.write((const char*)&m.reflectivity, 4);
+		putString(out, m.diffuseMap);
+		out.write((const char*)&m.textureScale, 4);
+	}
+
+	putArray(out, spheres);
+	putArray(out, planes);
+	putArray(out, lights);
+
+	n = meshes.size();
+	out.write((const char*)&n, 4);
+	for (auto& m : meshes)
+	{
+		putString(out, m.file);
+		out.write((const char*)&m.kind, 4);
+		out.write((const char*)&m.transform, sizeof(m.transform));
+		out.write((const char*)&m.material, 4);
+		out.write((const char*)&m.flags, 4);
+	}
+
+	out.write((const char*)&animStart, 4);
+	out.write((const char*)&animEnd, 4);
+	out.write((const char*)&fps, 4);
+	putString(out, framePattern);
+	putArray(out, keys);
+	return (bool)out;
+}
+
+bool SceneFile::loadBinary(const vector<char>& data)
+{
+	BinaryReader in = { data.data() + 4, data.data() + data.size() - 1 };
+	uint32_t version = 0;
+	in.get(version);
+	if (version < 1 || version > binaryVersion)
+	{
+		cout << fileName << ": unsupported binary scene version " << version << endl;
+		return false;
+	}
+
+	int32_t camera = 0;
+	in.get(camera);
+	hasCamera = camera != 0;
+	in.get(cameraPos);
+	in.get(viewZ);
+	in.get(viewMin);
+	in.get(viewMax);
+	in.get(width);
+	in.get(height);
+	in.get(ambient);
+
+	uint32_t n = 0;
+	in.get(n);
+	for (uint32_t i = 0; i < n && in.ok; i++)
+	{
+		Material m;
+		in.getString(m.name);
+		unsigned char colors[6];
+		in.get(colors);
+		m.diffuse = ofColor(colors[0], colors[1], colors[2]);
+		m.specular = ofColor(colors[3], colors[4], colors[5]);
+		in.get(m.exponent);
+		in.get(m.reflectivity);
+		in.getString(m.diffuseMap);
+		in.get(m.textureScale);
+		materials.push_back(m);
+	}
+
+	in.getArray(spheres);
+	in.getArray(planes);
+	in.getArray(lights);
+
+	n = 0;
+	in.get(n);
+	for (uint32_t i = 0; i < n && in.ok; i++)
+	{
+		MeshRec m;
+		in.getString(m.file);
+		in.get(m.kind);
+		in.get(m.transform);
+		in.get(m.material);
+		if (version >= 3)
+			in.get(m.flags);
+		meshes.push_back(m);
+	}
+	if (version >= 2)
+	{
+		in.get(animStart);
+		in.get(animEnd);
+		in.get(fps);
+		in.getString(framePattern);
+		in.getArray(keys);
+	}
+
+	if (!in.ok)
+	{
+		cout << fileName << ": truncated binary scene file" << endl;
+		return false;
+	}
+	// material references must be in range
+	int numMaterials = materials.size();
+	auto bad = [&](int32_t m) { return m < -1 || m >= numMaterials; };
+	for (auto& s : spheres) if (bad(s.material)) in.ok = false;
+	for (auto& p : planes) if (bad(p.material)) in.ok = false;
+	for (auto& m : meshes) if (bad(m.material)) in.ok = false;
+	size_t counts[] = { spheres.size(), planes.size(), meshes.size(), lights.size(), 1 };
+	for (auto& k : keys)
+		if (k.target < KEY_SPHERE || k.target > KEY_CAMERA || k.index < 0 || k.index >= (int)counts[k.target])
+			in.ok = false;
+	if (!in.ok)
+		cout << fileName << ": bad material or key index in binary scene file" << endl;
+	else if (!validFramePattern(framePattern))
+	{
+		cout << fileName << ": bad frame pattern " << framePattern << " in binary scene file" << endl;
+		return false;
+	}
+	return in.ok;
+}
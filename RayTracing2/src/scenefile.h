@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "ofMain.h"
+#include "material.h"
+
+//  Parsed contents of a scene file, kept as plain records so a scene can be
+//  checked completely before it replaces the current one, and written back
+//  out in the binary form.
+//
+//  Text form (.scn), one statement per line, # starts a comment:
+//
+//    camera x y z                       render camera position
+//    view z minx miny maxx maxy         view plane depth and extent
+//    image width height                 render size in pixels
+//    ambient a
+//    mtllib file.mtl                    add every material of a .mtl file
+//    material name [diffuse r g b] [specular r g b] [exponent e]
+//             [reflectivity k] [map file] [scale s]      colors in [0, 1]
+//    sphere x y z radius [name]         [name] is a material, default if omitted
+//    plane x y z nx ny nz [name]
+//    mesh file.obj x y z [name] [packnormals] [compact] [nolod]
+//                                       world space copy of an .obj file, "pyramid" = built in mesh
+//    instance file.obj [at x y z] [rotate deg ax ay az] [scale s] [material name] [packnormals] [compact] [nolod]
+//                                       packnormals stores the vertex normals octahedral encoded
+//                                       (4 instead of 12 bytes each), compact also quantizes the
+//                                       vertices (see Mesh::compact), nolod never builds levels
+//                                       of detail for the viewport and preview; for instances in
+//                                       the geometry all instances of the file share
+//    clustered file.clm                 out of core mesh from ClusteredMesh::build
+//    light x y z intensity
+//    spherelight x y z radius intensity
+//    rectlight x y z ux uy uz vx vy vz intensity
+//    animation start end fps [pattern]  sequence length in seconds, frame file printf pattern
+//                                       with one integer conversion, e.g. frame_%04d.png
+//    key time x y z                     position at time (seconds) of the object, light or
+//                                       camera on the closest statement above
+//
+//  Files are looked up next to the scene file first, then in the data folder.
+//
+//  Binary form (.scnb): the same records, with the sphere, plane and light
+//  arrays stored as raw little endian structs so they load with one read each.
+//
+class SceneFile {
+public:
+	enum LightType : int32_t { LIGHT_POINT, LIGHT_SPHERE, LIGHT_RECT };
+	enum MeshKind : int32_t { MESH_OBJ, MESH_INSTANCE, MESH_CLUSTERED };
+	enum MeshFlags : int32_t { MESH_PACK_NORMALS = 1, MESH_COMPACT = 2, MESH_NO_LOD = 4 };
+
+	// material is an index into materials, -1 = the default material
+	struct SphereRec { glm::vec3 center; float radius; int32_t material; };
+	struct PlaneRec { glm::vec3 point, normal; int32_t material; };
+	struct LightRec { int32_t type; glm::vec3 position, u, v; float radius, intensity; };
+	struct MeshRec { string file; int32_t kind; glm::mat4 transform; int32_t material; int32_t flags = 0; };
+	enum KeyTarget : int32_t { KEY_SPHERE, KEY_PLANE, KEY_MESH, KEY_LIGHT, KEY_CAMERA };
+	struct KeyRec { int32_t target; int32_t index; float time; glm::vec3 position; };	// index into the target's records
+
+	bool load(const string& fname);				// text or binary, chosen by the file contents
+	bool saveBinary(const string& fname) const;
+	void clear();
+
+	bool hasCamera = false;
+	glm::vec3 cameraPos = glm::vec3(0, 0, 10);
+	float viewZ = 5;
+	glm::vec2 viewMin = glm::vec2(-3, -2), viewMax = glm::vec2(3, 2);
+	int width = 0, height = 0;			// 0 = keep the current image size
+	float ambient = 0.1;
+
+	vector<Material> materials;
+	vector<SphereRec> spheres;
+	vector<PlaneRec> planes;
+	vector<LightRec> lights;
+	vector<MeshRec> meshes;
+	vector<KeyRec> keys;
+	float animStart = 0, animEnd = 0, fps = 24;
+	string framePattern = "frame_%04d.png";
+
+protected:
+	bool parseText(const char* text, size_t size);
+	bool loadBinary(const vector<char>& data);
+	int findMaterial(const string& name);
+
+	string fileName;
+	map<string, int> materialNames;
+};
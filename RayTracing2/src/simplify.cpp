@@ -0,0 +1,184 @@
+#include <queue>
+#include "simplify.h"
+
+// plane n.x + d = 0 with unit n contributes (n, d)(n, d)^T
+void Quadric::addPlane(const glm::vec3& n, float d)
+{
+	a[0] += n.x * n.x; a[1] += n.x * n.y; a[2] += n.x * n.z; a[3] += n.x * d;
+	a[4] += n.y * n.y; a[5] += n.y * n.z; a[6] += n.y * d;
+	a[7] += n.z * n.z; a[8] += n.z * d;
+	a[9] += d * d;
+}
+
+double Quadric::error(const glm::vec3& v) const
+{
+	double x = v.x, y = v.y, z = v.z;
+	return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+		+ a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+		+ a[7] * z * z + 2 * a[8] * z
+		+ a[9];
+}
+
+// solve the 3x3 system A v = -b by Cramer's rule
+bool Quadric::minimum(glm::vec3& v) const
+{
+	double det = a[0] * (a[4] * a[7] - a[5] * a[5]) - a[1] * (a[1] * a[7] - a[5] * a[2]) + a[2] * (a[1] * a[5] - a[4] * a[2]);
+	if (fabs(det) < 1e-12)
+		return false;
+	double bx = -a[3], by = -a[6], bz = -a[8];
+	double dx = bx * (a[4] * a[7] - a[5] * a[5]) - a[1] * (by * a[7] - a[5] * bz) + a[2] * (by * a[5] - a[4] * bz);
+	double dy = a[0] * (by * a[7] - bz * a[5]) - bx * (a[1] * a[7] - a[5] * a[2]) + a[2] * (a[1] * bz - by * a[2]);
+	double dz = a[0] * (a[4] * bz - a[5] * by) - a[1] * (a[1] * bz - by * a[2]) + bx * (a[1] * a[5] - a[4] * a[2]);
+	v = glm::vec3(dx / det, dy / det, dz / det);
+	return true;
+}
+
+// candidate collapse of edge (v0, v1), stale once either vertex changed
+struct Collapse {
+	double cost;
+	int v0, v1;
+	int version0, version1;
+	glm::vec3 target;
+	bool operator<(const Collapse& o) const { return cost > o.cost; }	// cheapest on top
+};
+
+float simplifyMesh(vector<glm::vec3>& verts, vector<glm::ivec3>& tris, vector<int>& triSource, int targetTriangles)
+{
+	int nv = verts.size();
+	vector<Quadric> quadric(nv);
+	vector<vector<int>> vertTris(nv);
+	vector<bool> triDead(tris.size(), false);
+	vector<int> version(nv, 0);
+
+	for (size_t t = 0; t < tris.size(); t++)
+	{
+		glm::vec3 v0 = verts[tris[t][0]], v1 = verts[tris[t][1]], v2 = verts[tris[t][2]];
+		glm::vec3 n = glm::cross(v1 - v0, v2 - v0);
+		if (glm::length(n) > 0)
+		{
+			n = glm::normalize(n);
+			for (int k = 0; k < 3; k++)
+				quadric[tris[t][k]].addPlane(n, -glm::dot(n, v0));
+		}
+		for (int k = 0; k < 3; k++)
+			vertTris[tris[t][k]].push_back(t);
+	}
+
+	std::priority_queue<Collapse> heap;
+	auto pushEdge = [&](int a, int b) {
+		Quadric q = quadric[a];
+		q.add(quadric[b]);
+		Collapse c;
+		c.v0 = a;
+		c.v1 = b;
+		c.version0 = version[a];
+		c.version1 = version[b];
+		// optimal point if there is a well conditioned one near the edge, else
+		// the best of the ends and the midpoint
+		glm::vec3 mid = (verts[a] + verts[b]) * 0.5f;
+		if (!q.minimum(c.target) || glm::length(c.target - mid) > glm::length(verts[b] - verts[a]))
+		{
+			c.target = mid;
+			if (q.error(verts[a]) < q.error(c.target)) c.target = verts[a];
+			if (q.error(verts[b]) < q.error(c.target)) c.target = verts[b];
+		}
+		c.cost = std::max(0.0, q.error(c.target));
+		heap.push(c);
+	};
+	for (auto& tri : tris)
+		for (int k = 0; k < 3; k++)
+			if (tri[k] < tri[(k + 1) % 3])
+				pushEdge(tri[k], tri[(k + 1) % 3]);
+
+	// would moving vertex v to p flip any of its triangles (other than the ones the collapse removes)?
+	auto flips = [&](int v, int other, const glm::vec3& p) {
+		for (int t : vertTris[v])
+		{
+			if (triDead[t])
+				continue;
+			glm::ivec3 tri = tris[t];
+			if (tri[0] == other || tri[1] == other || tri[2] == other)
+				continue;
+			glm::vec3 before = glm::cross(verts[tri[1]] - verts[tri[0]], verts[tri[2]] - verts[tri[0]]);
+			glm::vec3 moved[3];
+			for (int k = 0; k < 3; k++)
+				moved[k] = tri[k] == v ? p : verts[tri[k]];
+			glm::vec3 after = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+			if (glm::dot(before, after) <= 0)
+				return true;
+		}
+		return false;
+	};
+
+	int live = tris.size();
+	double maxCost = 0;
+	while (live > targetTriangles && !heap.empty())
+	{
+		Collapse c = heap.top();
+		heap.pop();
+		if (c.version0 != version[c.v0] || c.version1 != version[c.v1])
+			continue;	// an end point moved since this was computed
+		if (flips(c.v0, c.v1, c.target) || flips(c.v1, c.v0, c.target))
+			continue;
+
+		// move v0 to the target and hand v1's triangles to it
+		int keep = c.v0, gone = c.v1;
+		verts[keep] = c.target;
+		quadric[keep].add(quadric[gone]);
+		for (int t : vertTris[gone])
+		{
+			if (triDead[t])
+				continue;
+			glm::ivec3& tri = tris[t];
+			if (tri[0] == keep || tri[1] == keep || tri[2] == keep)
+			{
+				triDead[t] = true;
+				live--;
+				continue;
+			}
+			for (int k = 0; k < 3; k++)
+				if (tri[k] == gone)
+					tri[k] = keep;
+			vertTris[keep].push_back(t);
+		}
+		vertTris[gone].clear();
+		version[gone] = -1;		// never matches again
+		version[keep]++;
+		maxCost = std::max(maxCost, c.cost);
+
+		// drop dead triangles from keep's list and queue its new edges
+		vector<int>& around = vertTris[keep];
+		around.erase(std::remove_if(around.begin(), around.end(), [&](int t) { return triDead[t]; }), around.end());
+		for (int t : around)
+			for (int k = 0; k < 3; k++)
+				if (tris[t][k] != keep)
+					pushEdge(keep, tris[t][k]);
+	}
+
+	// compact the surviving vertices and triangles
+	vector<int> remap(nv, -1);
+	vector<glm::vec3> outVerts;
+	vector<glm::ivec3> outTris;
+	triSource.clear();
+	for (size_t t = 0; t < tris.size(); t++)
+	{
+		if (triDead[t])
+			continue;
+		glm::ivec3 tri;
+		for (int k = 0; k < 3; k++)
+		{
+			int v = tris[t][k];
+			if (remap[v] < 0)
+			{
+				remap[v] = outVerts.size();
+				outVerts.push_back(verts[v]);
+			}
+			tri[k] = remap[v];
+		}
+		outTris.push_back(tri);
+		triSource.push_back(t);
+	}
+	verts.swap(outVerts);
+	tris.swap(outTris);
+	return sqrt(maxCost);
+}
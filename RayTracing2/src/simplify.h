@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include "ofMain.h"
+
+using namespace std;
+
+//  Error quadric of Garland and Heckbert: the sum of squared distances to a
+//  set of planes, stored as the upper triangle of a symmetric 4x4 matrix
+//
+struct Quadric {
+	double a[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+	void addPlane(const glm::vec3& n, float d);
+	void add(const Quadric& q) { for (int i = 0; i < 10; i++) a[i] += q.a[i]; }
+	double error(const glm::vec3& v) const;
+	bool minimum(glm::vec3& v) const;		// point of least error, false if the quadric is singular
+};
+
+/*
+ * Simplify a triangle mesh by quadric error edge collapses until at most
+ * targetTriangles remain (or no collapse is possible without flipping a face)
+ *
+ * @param vector<glm::vec3>& verts - vertices, replaced by the simplified ones
+ * @param vector<glm::ivec3>& tris - triangles, replaced by the simplified ones
+ * @param vector<int>& triSource - output, original triangle index of each remaining triangle
+ * @param int targetTriangles - triangle budget
+ * @return float - largest distance error of any collapse (world units)
+ */
+float simplifyMesh(vector<glm::vec3>& verts, vector<glm::ivec3>& tris, vector<int>& triSource, int targetTriangles);
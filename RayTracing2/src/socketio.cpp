@@ -0,0 +1,227 @@
+#include "socketio.h"
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef int socklen_t;
+#define poll WSAPoll
+#define closeSocket closesocket
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#define closeSocket ::close
+#endif
+
+// a peer that went away must show up as a failed send, not kill the process
+#ifdef MSG_NOSIGNAL
+static const int sendFlags = MSG_NOSIGNAL;
+#else
+static const int sendFlags = 0;
+#endif
+
+static void initSockets()
+{
+#ifdef _WIN32
+	static bool done = false;
+	if (!done)
+	{
+		WSADATA wsa;
+		WSAStartup(MAKEWORD(2, 2), &wsa);
+		done = true;
+	}
+#endif
+}
+
+// messages are small and latency matters more than packet count
+static void configureSocket(intptr_t fd)
+{
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&one, sizeof(one));
+#endif
+}
+
+/*
+ * Connect to a listening MessageListener
+ *
+ * @param const string& host - host name or address
+ * @param int port - TCP port
+ * @return bool - false if no connection could be made
+ */
+bool MessageSocket::connect(const string& host, int port)
+{
+	initSockets();
+	close();
+	addrinfo hints, *found = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), ofToString(port).c_str(), &hints, &found) != 0)
+	{
+		cout << "unknown host " << host << endl;
+		return false;
+	}
+	for (addrinfo* a = found; a != NULL && fd < 0; a = a->ai_next)
+	{
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd >= 0 && ::connect(fd, a->ai_addr, a->ai_addrlen) != 0)
+			close();
+	}
+	freeaddrinfo(found);
+	if (fd < 0)
+		return false;
+	configureSocket(fd);
+	return true;
+}
+
+bool MessageSocket::sendAll(const void* data, size_t size)
+{
+	const char* p = (const char*)data;
+	while (size > 0)
+	{
+		int n = ::send(fd, p, (int)std::min(size, (size_t)1 << 20), sendFlags);
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool MessageSocket::receiveAll(void* data, size_t size)
+{
+	char* p = (char*)data;
+	while (size > 0)
+	{
+		int n = ::recv(fd, p, (int)std::min(size, (size_t)1 << 20), 0);
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+// A message is its type and payload size (uint32 each) followed by the payload
+bool MessageSocket::send(uint32_t type, const void* data, size_t size)
+{
+	if (fd < 0 || size > maxMessage)
+		return false;
+	uint32_t header[2] = { type, (uint32_t)size };
+	return sendAll(header, sizeof(header)) && sendAll(data, size);
+}
+
+bool MessageSocket::receive(uint32_t& type, vector<char>& payload, size_t maxSize)
+{
+	uint32_t header[2];
+	if (fd < 0 || !receiveAll(header, sizeof(header)) || header[1] > std::min(maxSize, maxMessage))
+		return false;
+	type = header[0];
+	payload.resize(header[1]);
+	return receiveAll(payload.data(), payload.size());
+}
+
+bool MessageSocket::readable(int timeoutMs)
+{
+	vector<bool> ready;
+	waitReadable({ this }, timeoutMs, ready);
+	return ready[0];
+}
+
+void MessageSocket::setTimeout(float seconds)
+{
+#ifdef _WIN32
+	DWORD ms = (DWORD)(seconds * 1000);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&ms, sizeof(ms));
+#else
+	timeval tv;
+	tv.tv_sec = (long)seconds;
+	tv.tv_usec = (long)((seconds - tv.tv_sec) * 1000000);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+}
+
+void MessageSocket::close()
+{
+	if (fd >= 0)
+		closeSocket(fd);
+	fd = -1;
+}
+
+/*
+ * Listen for connections on a port
+ *
+ * @param int port - TCP port
+ * @param const string& address - IPv4 address of the interface, e.g. "127.0.0.1"
+ *        for local clients only; empty = every interface
+ * @return bool - false if the port can't be bound (e.g. it is in use)
+ */
+bool MessageListener::listen(int port, const string& address)
+{
+	initSockets();
+	close();
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (!address.empty() && inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+	{
+		cout << "bad listen address " << address << endl;
+		return false;
+	}
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return false;
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+	if (::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(fd, 64) != 0)
+	{
+		cout << "could not listen on port " << port << endl;
+		close();
+		return false;
+	}
+	return true;
+}
+
+MessageSocket MessageListener::accept(int timeoutMs)
+{
+	MessageSocket listening(fd);
+	if (fd < 0 || !listening.readable(timeoutMs))
+		return MessageSocket();
+	intptr_t client = ::accept(fd, NULL, NULL);
+	if (client < 0)
+		return MessageSocket();
+	configureSocket(client);
+	return MessageSocket(client);
+}
+
+void MessageListener::close()
+{
+	if (fd >= 0)
+		closeSocket(fd);
+	fd = -1;
+}
+
+void waitReadable(const vector<MessageSocket*>& sockets, int timeoutMs, vector<bool>& ready)
+{
+	vector<pollfd> fds(sockets.size());
+	for (size_t i = 0; i < sockets.size(); i++)
+	{
+		fds[i].fd = sockets[i]->handle();
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+	ready.assign(sockets.size(), false);
+	if (poll(fds.data(), fds.size(), timeoutMs) <= 0)
+		return;
+	// errors and hangups count as readable, receive() then reports them
+	for (size_t i = 0; i < sockets.size(); i++)
+		ready[i] = fds[i].fd >= 0 && (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include "ofMain.h"
+
+//  Blocking TCP connection that sends and receives whole messages, a type
+//  and a payload, so neither side has to deal with partial reads.  Used
+//  between the render coordinator and its workers and by the render server;
+//  on one machine the peers talk over the loopback interface.
+//
+//  Payloads are raw little endian values, like the binary scene files.
+//
+class MessageSocket {
+public:
+	MessageSocket() {}
+	explicit MessageSocket(intptr_t fd) : fd(fd) {}
+
+	bool connect(const string& host, int port);
+	bool send(uint32_t type, const void* data, size_t size);
+	bool send(uint32_t type, const vector<char>& payload) { return send(type, payload.data(), payload.size()); }
+	// false on error, a closed connection or a payload larger than maxSize
+	bool receive(uint32_t& type, vector<char>& payload, size_t maxSize = maxMessage);
+	bool readable(int timeoutMs);		// true if a message (or the end of the connection) is waiting
+	void setTimeout(float seconds);		// receive() fails after this long without data, 0 = never
+	void close();
+
+	bool isOpen() const { return fd >= 0; }
+	intptr_t handle() const { return fd; }
+
+	static const size_t maxMessage = 1 << 30;
+
+protected:
+	bool sendAll(const void* data, size_t size);
+	bool receiveAll(void* data, size_t size);
+
+	intptr_t fd = -1;
+};
+
+//  Listening socket for MessageSocket connections
+//
+class MessageListener {
+public:
+	~MessageListener() { close(); }
+
+	// address = interface to accept connections on, empty = every interface
+	bool listen(int port, const string& address = "");
+	// wait up to timeoutMs for a connection, returns a closed socket if there was none
+	MessageSocket accept(int timeoutMs);
+	void close();
+
+	bool isOpen() const { return fd >= 0; }
+
+protected:
+	intptr_t fd = -1;
+};
+
+// wait up to timeoutMs until one of the sockets is readable, ready[i] tells which
+void waitReadable(const vector<MessageSocket*>& sockets, int timeoutMs, vector<bool>& ready);
+
+//  Builds a message payload out of plain values and strings
+//
+class MessageWriter {
+public:
+	template<typename T> void put(const T& v) { putBytes(&v, sizeof(T)); }
+	void putBytes(const void* p, size_t size) { data.insert(data.end(), (const char*)p, (const char*)p + size); }
+	void putString(const string& s) { put((uint32_t)s.size()); putBytes(s.data(), s.size()); }
+
+	vector<char> data;
+};
+
+//  Reads the values back; every get fails (returns false) once the payload runs short
+//
+class MessageReader {
+public:
+	MessageReader(const vector<char>& data) : data(data) {}
+
+	template<typename T> bool get(T& v) { return getBytes(&v, sizeof(T)); }
+	bool getBytes(void* p, size_t size) {
+		if (size > data.size() - pos)
+			return false;
+		memcpy(p, data.data() + pos, size);
+		pos += size;
+		return true;
+	}
+	bool getString(string& s) {
+		uint32_t size;
+		if (!get(size) || size > data.size() - pos)
+			return false;
+		s.assign(data.data() + pos, size);
+		pos += size;
+		return true;
+	}
+	size_t remaining() const { return data.size() - pos; }
+
+protected:
+	const vector<char>& data;
+	size_t pos = 0;
+};
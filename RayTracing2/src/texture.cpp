@@ -0,0 +1,281 @@
+#include "texture.h"
+
+TextureCache textures;
+
+// tile file header, followed by the tiles of each level in row order
+struct TileFileHeader {
+	char magic[4];
+	int32_t width, height, levels, tileSize;
+	uint64_t sourceSize;	// size of the source image, to notice when it changes
+};
+
+static const char tileFileMagic[4] = { 'T', 'X', 'C', '1' };
+
+/*
+ * Register an image as a texture, building its tiled mip pyramid on first use
+ *
+ * @param const string& fname - image file
+ * @return int - texture id for sample(), -1 if the image could not be loaded
+ */
+int TextureCache::load(const string& fname)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = byName.find(fname);
+	if (found != byName.end())
+		return found->second;
+
+	std::unique_ptr<Texture> tex(new Texture());
+	tex->source = fname;
+	string dir = ofToDataPath("texcache");
+	ofDirectory::createDirectory(dir, false, true);
+	tex->tileFile = ofFilePath::join(dir, ofFilePath::getBaseName(fname) + "_"
+		+ ofToHex((uint32_t)std::hash<string>()(ofToDataPath(fname, true))) + ".tiles");
+
+	if (!openTileFile(*tex) && (!buildTileFile(*tex) || !openTileFile(*tex)))
+	{
+		byName[fname] = -1;
+		return -1;
+	}
+	int id = textures.size();
+	textures.push_back(std::move(tex));
+	byName[fname] = id;
+	return id;
+}
+
+// read the header of an existing tile file; false if missing or stale
+bool TextureCache::openTileFile(Texture& tex)
+{
+	if (!ofFile::doesFileExist(tex.tileFile, false))
+		return false;
+	tex.stream.close();
+	tex.stream.clear();
+	tex.stream.open(tex.tileFile, std::ios::binary);
+	TileFileHeader header;
+	if (!tex.stream.read((char*)&header, sizeof(header)) || memcmp(header.magic, tileFileMagic, 4) != 0
+		|| header.tileSize != TILE_SIZE || header.sourceSize != ofFile(tex.source).getSize())
+	{
+		tex.stream.close();
+		return false;
+	}
+
+	tex.width = header.width;
+	tex.height = header.height;
+	tex.levels = header.levels;
+	tex.levelWidth.resize(tex.levels);
+	tex.levelHeight.resize(tex.levels);
+	tex.tilesX.resize(tex.levels);
+	tex.tilesY.resize(tex.levels);
+	tex.levelOffset.resize(tex.levels);
+	uint64_t offset = sizeof(header);
+	uint64_t tileBytes = TILE_SIZE * TILE_SIZE * 3;
+	for (int l = 0; l < tex.levels; l++)
+	{
+		tex.levelWidth[l] = std::max(1, tex.width >> l);
+		tex.levelHeight[l] = std::max(1, tex.height >> l);
+		tex.tilesX[l] = (tex.levelWidth[l] + TILE_SIZE - 1) / TILE_SIZE;
+		tex.tilesY[l] = (tex.levelHeight[l] + TILE_SIZE - 1) / TILE_SIZE;
+		tex.levelOffset[l] = offset;
+		offset += tileBytes * tex.tilesX[l] * tex.tilesY[l];
+	}
+	return true;
+}
+
+// Decode the source image once, box filter it down to 1x1 and write every
+// level as tiles.  Only two levels are held in memory at a time and both are
+// released when the file is written.
+bool TextureCache::buildTileFile(Texture& tex)
+{
+	ofPixels pix;
+	if (!ofLoadImage(pix, tex.source))
+	{
+		cout << "could not load texture " << tex.source << endl;
+		return false;
+	}
+	pix.setImageType(OF_IMAGE_COLOR);
+	float startTime = ofGetElapsedTimef();
+
+	int w = pix.getWidth();
+	int h = pix.getHeight();
+	vector<unsigned char> level(pix.getData(), pix.getData() + w * h * 3);
+	pix.clear();
+
+	TileFileHeader header;
+	memcpy(header.magic, tileFileMagic, 4);
+	header.width = w;
+	header.height = h;
+	header.levels = 1 + (int)floor(log2(std::max(w, h)));
+	header.tileSize = TILE_SIZE;
+	header.sourceSize = ofFile(tex.source).getSize();
+
+	std::ofstream out(tex.tileFile, std::ios::binary);
+	out.write((const char*)&header, sizeof(header));
+	vector<unsigned char> tile(TILE_SIZE * TILE_SIZE * 3);
+	for (int l = 0; l < header.levels; l++)
+	{
+		// texels past the edge of the image repeat it, like sample() does
+		for (int ty = 0; ty < (h + TILE_SIZE - 1) / TILE_SIZE; ty++)
+			for (int tx = 0; tx < (w + TILE_SIZE - 1) / TILE_SIZE; tx++)
+			{
+				for (int j = 0; j < TILE_SIZE; j++)
+					for (int i = 0; i < TILE_SIZE; i++)
+					{
+						int x = (tx * TILE_SIZE + i) % w;
+						int y = (ty * TILE_SIZE + j) % h;
+						memcpy(&tile[(j * TILE_SIZE + i) * 3], &level[(y * w + x) * 3], 3);
+					}
+				out.write((const char*)tile.data(), tile.size());
+			}
+
+		// 2x2 box filter to the next level
+		int nw = std::max(1, w / 2);
+		int nh = std::max(1, h / 2);
+		vector<unsigned char> next(nw * nh * 3);
+		for (int y = 0; y < nh; y++)
+			for (int x = 0; x < nw; x++)
+			{
+				int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+				int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+				for (int c = 0; c < 3; c++)
+					next[(y * nw + x) * 3 + c] = (level[(y0 * w + x0) * 3 + c] + level[(y0 * w + x1) * 3 + c]
+						+ level[(y1 * w + x0) * 3 + c] + level[(y1 * w + x1) * 3 + c] + 2) / 4;
+			}
+		level.swap(next);
+		w = nw;
+		h = nh;
+	}
+	if (!out)
+	{
+		cout << "could not write texture cache " << tex.tileFile << endl;
+		return false;
+	}
+	cout << "built " << header.levels << " level texture cache for " << tex.source << " ("
+		<< header.width << "x" << header.height << ") in " << ofGetElapsedTimef() - startTime << " seconds" << endl;
+	return true;
+}
+
+// return a tile from the cache, reading it from the tile file on a miss
+std::shared_ptr<const TextureTile> TextureCache::getTile(int texId, int level, int tx, int ty)
+{
+	uint64_t key = ((uint64_t)texId << 48) | ((uint64_t)level << 40) | ((uint64_t)ty << 20) | (uint64_t)tx;
+	std::lock_guard<std::mutex> lock(mutex);
+	lookups++;
+	auto found = tiles.find(key);
+	if (found != tiles.end())
+	{
+		lru.splice(lru.begin(), lru, found->second.second);
+		return found->second.first;
+	}
+
+	misses++;
+	Texture& tex = *textures[texId];
+	std::shared_ptr<TextureTile> tile(new TextureTile());
+	size_t tileBytes = TILE_SIZE * TILE_SIZE * 3;
+	tile->texels.resize(tileBytes);
+	tex.stream.clear();
+	tex.stream.seekg(tex.levelOffset[level] + tileBytes * ((uint64_t)ty * tex.tilesX[level] + tx));
+	tex.stream.read((char*)tile->texels.data(), tileBytes);
+
+	lru.push_front(key);
+	tiles[key] = CacheEntry(tile, lru.begin());
+	residentBytes += tileBytes;
+
+	// evict least recently used tiles; ones still being sampled by another
+	// thread stay alive through their shared_ptr until it is done
+	while (residentBytes > memoryCap && lru.size() > 1)
+	{
+		tiles.erase(lru.back());
+		lru.pop_back();
+		residentBytes -= tileBytes;
+		evictions++;
+	}
+	return tile;
+}
+
+// bilinear filtered texel lookup at one mip level, uv repeats
+glm::vec3 TextureCache::bilinear(int texId, int level, float u, float v)
+{
+	Texture& tex = *textures[texId];
+	int w = tex.levelWidth[level];
+	int h = tex.levelHeight[level];
+	float x = (u - floor(u)) * w - 0.5f;
+	float y = (v - floor(v)) * h - 0.5f;
+	int x0 = (int)floor(x);
+	int y0 = (int)floor(y);
+	float fx = x - x0;
+	float fy = y - y0;
+
+	// the four texels are usually in the same tile, only look it up once
+	std::shared_ptr<const TextureTile> tile;
+	int lastTx = -1, lastTy = -1;
+	glm::vec3 texel[4];
+	for (int k = 0; k < 4; k++)
+	{
+		int ix = ((x0 + (k & 1)) % w + w) % w;
+		int iy = ((y0 + (k >> 1)) % h + h) % h;
+		int tx = ix / TILE_SIZE, ty = iy / TILE_SIZE;
+		if (tx != lastTx || ty != lastTy)
+		{
+			tile = getTile(texId, level, tx, ty);
+			lastTx = tx;
+			lastTy = ty;
+		}
+		const unsigned char* t = &tile->texels[((iy % TILE_SIZE) * TILE_SIZE + ix % TILE_SIZE) * 3];
+		texel[k] = glm::vec3(t[0], t[1], t[2]);
+	}
+	glm::vec3 top = texel[0] * (1 - fx) + texel[1] * fx;
+	glm::vec3 bottom = texel[2] * (1 - fx) + texel[3] * fx;
+	return (top * (1 - fy) + bottom * fy) / 255.0f;
+}
+
+/*
+ * Trilinear texture lookup with the mip level chosen from the ray footprint
+ *
+ * @param int texId - id returned by load()
+ * @param const glm::vec2& uv - texture coordinates, repeating outside [0, 1)
+ * @param float footprint - size of the pixel's footprint on the surface in uv units
+ * @return glm::vec3 - color in [0, 1]
+ */
+glm::vec3 TextureCache::sample(int texId, const glm::vec2& uv, float footprint)
+{
+	Texture& tex = *textures[texId];
+	// one texel of level l covers 2^l texels of level 0
+	float lod = log2(std::max(footprint * std::max(tex.width, tex.height), 1.0f));
+	lod = std::min(lod, (float)(tex.levels - 1));
+	int l0 = (int)lod;
+	float f = lod - l0;
+	glm::vec3 c = bilinear(texId, l0, uv.x, uv.y);
+	if (f > 0 && l0 + 1 < tex.levels)
+		c = c * (1 - f) + bilinear(texId, l0 + 1, uv.x, uv.y) * f;
+	return c;
+}
+
+// shrink or grow the cache, evicting tiles right away if it is over the new cap
+void TextureCache::setMemoryCap(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	memoryCap = bytes;
+	size_t tileBytes = TILE_SIZE * TILE_SIZE * 3;
+	while (residentBytes > memoryCap && !lru.empty())
+	{
+		tiles.erase(lru.back());
+		lru.pop_back();
+		residentBytes -= tileBytes;
+		evictions++;
+	}
+}
+
+void TextureCache::resetStats()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	lookups = misses = evictions = 0;
+}
+
+void TextureCache::printStats()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (lookups == 0)
+		return;
+	cout << "texture tiles: " << lookups << " lookups, " << 100.0 * (lookups - misses) / lookups << "% hits, "
+		<< misses << " loaded, " << evictions << " evicted, " << residentBytes / (1024.0 * 1024.0) << " of "
+		<< memoryCap / (1024.0 * 1024.0) << " MB resident" << endl;
+}
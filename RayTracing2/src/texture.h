@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include "ofMain.h"
+
+//  One square block of RGB8 texels of one mip level
+//
+struct TextureTile {
+	vector<unsigned char> texels;	// tileSize * tileSize * 3 bytes
+};
+
+//  A texture stored as a tiled mip pyramid in a cache file on disk.
+//  Only the header lives in memory; tiles are paged in by TextureCache.
+//
+struct Texture {
+	string source;					// original image file
+	string tileFile;				// tiled mip pyramid built from source
+	int width = 0, height = 0;		// level 0 size in texels
+	int levels = 0;
+	vector<int> levelWidth, levelHeight, tilesX, tilesY;
+	vector<uint64_t> levelOffset;	// byte offset of each level's first tile in tileFile
+	std::ifstream stream;
+};
+
+//  Texture manager with an LRU cache of decoded tiles
+//
+//  The first time an image is referenced its mip pyramid is built and written
+//  to data/texcache as fixed size tiles, after which the decoded image is
+//  released.  Rendering then pages in only the tiles that rays actually
+//  touch, at the mip level matching the ray footprint, and evicts the least
+//  recently used tiles once the memory cap is reached.
+//
+class TextureCache {
+public:
+	int load(const string& fname);		// texture id, or -1 if the image can't be read
+
+	// trilinear filtered color in [0, 1]; uv repeats, footprint is the
+	// size of the pixel on the surface in uv units
+	glm::vec3 sample(int texId, const glm::vec2& uv, float footprint);
+
+	void setMemoryCap(size_t bytes);
+	void resetStats();
+	void printStats();
+
+	static const int TILE_SIZE = 64;
+	size_t memoryCap = 256 * 1024 * 1024;
+
+protected:
+	bool buildTileFile(Texture& tex);
+	bool openTileFile(Texture& tex);
+	std::shared_ptr<const TextureTile> getTile(int texId, int level, int tx, int ty);
+	glm::vec3 bilinear(int texId, int level, float u, float v);
+
+	vector<std::unique_ptr<Texture>> textures;
+	unordered_map<string, int> byName;
+
+	// LRU list of tile keys, most recently used at the front
+	typedef std::pair<std::shared_ptr<const TextureTile>, list<uint64_t>::iterator> CacheEntry;
+	list<uint64_t> lru;
+	unordered_map<uint64_t, CacheEntry> tiles;
+	size_t residentBytes = 0;
+	std::mutex mutex;
+
+	uint64_t lookups = 0, misses = 0, evictions = 0;
+};
+
+extern TextureCache textures;		// the scene's textures
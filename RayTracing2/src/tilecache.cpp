@@ -0,0 +1,338 @@
+#include <fstream>
+#include <filesystem>
+#include <functional>
+#include <typeinfo>
+#include "tilecache.h"
+#include "ofApp.h"
+
+static const char tileMagic[4] = { 'R', 'T', 'C', '1' };
+static const uint32_t keyVersion = 2;		// bump when the shading changes, old tiles then never match
+
+/*
+ * Open (and create) the cache directory and list the tiles already in it
+ *
+ * @param const string& dirName - directory, relative to the data folder
+ * @return bool - false if the directory can't be created
+ */
+bool TileCache::open(const string& dirName)
+{
+	namespace fs = std::filesystem;
+	dir.clear();
+	entries.clear();
+	totalBytes = 0;
+	std::error_code error;
+	fs::path root(ofToDataPath(dirName));
+	fs::create_directories(root, error);
+	if (!fs::is_directory(root, error))
+	{
+		cout << "could not create tile cache " << dirName << endl;
+		return false;
+	}
+
+	vector<std::pair<fs::file_time_type, Entry>> found;
+	for (auto& file : fs::directory_iterator(root, error))
+	{
+		if (file.path().extension() != ".tile")
+			continue;
+		Entry e;
+		e.path = file.path().string();
+		e.bytes = file.file_size(error);
+		found.push_back(std::make_pair(file.last_write_time(error), e));
+	}
+	std::sort(found.begin(), found.end(), [](const std::pair<fs::file_time_type, Entry>& a, const std::pair<fs::file_time_type, Entry>& b) {
+		return a.first < b.first;
+	});
+	for (auto& f : found)
+	{
+		entries.push_back(f.second);
+		totalBytes += f.second.bytes;
+	}
+	dir = root.string();
+	evict();
+	return true;
+}
+
+string TileCache::path(uint64_t key) const
+{
+	return (std::filesystem::path(dir) / (ofToHex(key) + ".tile")).string();
+}
+
+typedef std::function<bool(const glm::vec3&, const glm::vec3&)> BoxTest;
+
+// objects whose bounds pass a test, unbounded ones if they pass their own test
+static void collect(const SceneBVH& bvh, const BoxTest& overlaps, const std::function<bool(SceneObject*)>& unboundedTest,
+					vector<SceneObject*>& out, bool& unbounded)
+{
+	vector<int> stack;
+	if (!bvh.nodes.empty())
+		stack.push_back(0);
+	while (!stack.empty())
+	{
+		const SceneNode& node = bvh.nodes[stack.back()];
+		stack.pop_back();
+		if (!overlaps(node.bmin, node.bmax))
+			continue;
+		if (node.object >= 0)
+			out.push_back(bvh.objects[node.object]);
+		else
+		{
+			stack.push_back(node.left);
+			stack.push_back(node.right);
+		}
+	}
+	for (auto obj : bvh.others)
+	{
+		glm::vec3 bmin, bmax;
+		if (!obj->getBounds(bmin, bmax))
+		{
+			if (unboundedTest(obj))
+			{
+				out.push_back(obj);
+				unbounded = true;
+			}
+		}
+		else if (overlaps(bmin, bmax))
+			out.push_back(obj);
+	}
+}
+
+/*
+ * Hash of everything tile [x0, x1) x [y0, y1) of the current render depends on
+ *
+ * @param ofApp* app - the app, after prepareRender()
+ * @param int x0, y0, x1, y1 - tile rectangle in pixels, rows counted from the top
+ * @return uint64_t - cache key
+ */
+uint64_t TileCache::key(ofApp* app, int x0, int y0, int x1, int y1)
+{
+	uint64_t h = hashSeed;
+	hashValue(h, keyVersion);
+	RenderSettings settings = app->getRenderSettings();
+	hashValue(h, settings);
+	int32_t rect[4] = { x0, y0, x1, y1 };
+	hashValue(h, rect);
+	for (auto light : app->lights)
+	{
+		glm::vec3 bmin, bmax;
+		light->getBounds(bmin, bmax);
+		hashBytes(h, typeid(*light).name(), strlen(typeid(*light).name()));
+		hashValue(h, light->position);
+		hashValue(h, light->intensity);
+		hashValue(h, bmin);
+		hashValue(h, bmax);
+	}
+
+	// frustum through the tile, a pixel wider on every side; pixel (x, y) is
+	// sampled at u = x / width, v = y / height with y counted from the bottom
+	RenderCam& cam = app->renderCam;
+	int width = app->imageWidth, height = app->imageHeight;
+	float u0 = (x0 - 1.0f) / width, u1 = (float)x1 / width;
+	float v0 = (height - y1 - 1.0f) / height, v1 = (float)(height - y0) / height;
+	glm::vec3 corners[4] = { cam.view.toWorld(u0, v0), cam.view.toWorld(u1, v0), cam.view.toWorld(u1, v1), cam.view.toWorld(u0, v1) };
+	glm::vec3 center = (corners[0] + corners[1] + corners[2] + corners[3]) * 0.25f;
+	glm::vec3 normals[4];		// pointing into the frustum
+	for (int i = 0; i < 4; i++)
+	{
+		normals[i] = glm::cross(corners[i] - cam.position, corners[(i + 1) % 4] - cam.position);
+		if (glm::dot(normals[i], center - cam.position) < 0)
+			normals[i] = -normals[i];
+	}
+	auto inFrustum = [&](const glm::vec3& bmin, const glm::vec3& bmax) {
+		for (auto& n : normals)
+		{
+			glm::vec3 far(n.x > 0 ? bmax.x : bmin.x, n.y > 0 ? bmax.y : bmin.y, n.z > 0 ? bmax.z : bmin.z);
+			if (glm::dot(n, far - cam.position) < 0)
+				return false;
+		}
+		return true;
+	};
+	// an infinite plane is out of view if the camera and every edge of the
+	// frustum point away from it
+	auto planeInFrustum = [&](SceneObject* obj) {
+		Plane* plane = dynamic_cast<Plane*>(obj);
+		if (plane == NULL)
+			return true;
+		float side = glm::dot(cam.position - plane->position, plane->normal);
+		for (auto& c : corners)
+			if (glm::dot(c - cam.position, plane->normal) * side < 0)
+				return true;
+		return side == 0;
+	};
+	vector<SceneObject*> objects;
+	bool unbounded = false;
+	collect(app->sceneBVH, inFrustum, planeInFrustum, objects, unbounded);
+
+	// meshes can have a material per triangle, so they depend on the whole table
+	bool allMaterials = false, reflective = false;
+	auto simple = [](SceneObject* obj) { return dynamic_cast<Sphere*>(obj) != NULL || dynamic_cast<Plane*>(obj) != NULL; };
+	for (auto obj : objects)
+	{
+		if (simple(obj))
+			reflective = reflective || materials[obj->materialId].reflectivity > 0;
+		else
+			allMaterials = true;
+	}
+	if (allMaterials)
+		for (auto& m : materials.materials)
+			reflective = reflective || m.reflectivity > 0;
+
+	if (reflective && app->maxReflectionDepth > 0)
+	{
+		// a mirror can show anything
+		objects = app->scene;
+		allMaterials = true;
+	}
+	else if (unbounded)
+	{
+		// receivers reach to the horizon, any caster may shadow them
+		for (auto obj : app->scene)
+			if (obj->castShadows)
+				objects.push_back(obj);
+	}
+	else if (!objects.empty())
+	{
+		// shadow rays stay inside the box around the receivers and the light
+		glm::vec3 rmin, rmax;
+		objects[0]->getBounds(rmin, rmax);
+		for (auto obj : objects)
+		{
+			glm::vec3 bmin, bmax;
+			obj->getBounds(bmin, bmax);
+			rmin = glm::min(rmin, bmin);
+			rmax = glm::max(rmax, bmax);
+		}
+		size_t visible = objects.size();
+		bool unused = false;
+		for (auto light : app->lights)
+		{
+			glm::vec3 lmin, lmax;
+			light->getBounds(lmin, lmax);
+			glm::vec3 umin = glm::min(rmin, lmin), umax = glm::max(rmax, lmax);
+			collect(app->sceneBVH, [&](const glm::vec3& bmin, const glm::vec3& bmax) {
+				return bmin.x <= umax.x && bmin.y <= umax.y && bmin.z <= umax.z
+					&& umin.x <= bmax.x && umin.y <= bmax.y && umin.z <= bmax.z;
+			}, [](SceneObject*) { return true; }, objects, unused);
+		}
+		for (size_t i = visible; i < objects.size(); i++)
+			allMaterials = allMaterials || !simple(objects[i]);
+	}
+
+	// in scene order, so the key doesn't depend on the shape of the hierarchy
+	std::sort(objects.begin(), objects.end(), [](SceneObject* a, SceneObject* b) { return a->sceneIndex < b->sceneIndex; });
+	objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+	for (auto obj : objects)
+	{
+		app->hashObject(h, obj);
+		if (!allMaterials)
+			ofApp::hashMaterial(h, materials[obj->materialId]);
+	}
+	if (allMaterials)
+		for (auto& m : materials.materials)
+			ofApp::hashMaterial(h, m);
+	return h;
+}
+
+/*
+ * Read a tile from the cache
+ *
+ * @param uint64_t key - from key()
+ * @param int width, height - tile size in pixels
+ * @param vector<unsigned char>& rgb - the pixels, top row first
+ * @return bool - false if the tile is not in the cache
+ */
+bool TileCache::load(uint64_t key, int width, int height, vector<unsigned char>& rgb)
+{
+	if (!isOpen())
+		return false;
+	std::ifstream in(path(key), std::ios::binary);
+	Header header;
+	rgb.resize((size_t)width * height * 3);
+	if (!in || !in.read((char*)&header, sizeof(header)) || memcmp(header.magic, tileMagic, 4) != 0
+		|| header.width != width || header.height != height || header.key != key
+		|| !in.read((char*)rgb.data(), rgb.size()))
+	{
+		misses++;
+		return false;
+	}
+	hits++;
+	// a reused tile becomes the newest, on disk too for the next open(), so
+	// eviction drops the tiles that have gone longest without being used
+	string fname = path(key);
+	std::error_code error;
+	std::filesystem::last_write_time(fname, std::filesystem::file_time_type::clock::now(), error);
+	auto used = std::find_if(entries.begin(), entries.end(), [&](const Entry& e) { return e.path == fname; });
+	if (used != entries.end())
+	{
+		Entry e = *used;
+		entries.erase(used);
+		entries.push_back(e);
+	}
+	return true;
+}
+
+void TileCache::store(uint64_t key, int width, int height, const vector<unsigned char>& rgb)
+{
+	if (!isOpen())
+		return;
+	namespace fs = std::filesystem;
+	string fname = path(key);
+	string temp = fname + "." + ofToHex(ofGetSystemTimeMicros()) + ".tmp";
+	{
+		std::ofstream out(temp, std::ios::binary);
+		Header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, tileMagic, 4);
+		header.width = width;
+		header.height = height;
+		header.key = key;
+		out.write((const char*)&header, sizeof(header));
+		out.write((const char*)rgb.data(), rgb.size());
+		if (!out)
+		{
+			out.close();
+			fs::remove(temp);
+			return;
+		}
+	}
+	std::error_code error;
+	fs::rename(temp, fname, error);
+	if (error)
+	{
+		fs::remove(temp, error);
+		return;
+	}
+	// a tile stored again (e.g. by two workers) replaces its old entry, so
+	// it is counted once and only evicted when it is the oldest
+	auto old = std::find_if(entries.begin(), entries.end(), [&](const Entry& e) { return e.path == fname; });
+	if (old != entries.end())
+	{
+		totalBytes -= std::min(totalBytes, old->bytes);
+		entries.erase(old);
+	}
+	Entry e;
+	e.path = fname;
+	e.bytes = sizeof(Header) + rgb.size();
+	entries.push_back(e);
+	totalBytes += e.bytes;
+	evict();
+}
+
+// delete the least recently used tiles until the cache fits in maxBytes
+void TileCache::evict()
+{
+	std::error_code error;
+	while (totalBytes > maxBytes && !entries.empty())
+	{
+		std::filesystem::remove(entries.front().path, error);
+		totalBytes -= std::min(totalBytes, entries.front().bytes);
+		entries.pop_front();
+	}
+}
+
+void TileCache::printStats()
+{
+	if (hits + misses == 0)
+		return;
+	cout << "Tile cache: " << hits << " of " << hits + misses << " tiles reused, "
+		<< entries.size() << " tiles (" << totalBytes / (1024 * 1024) << " MB) on disk" << endl;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstdint>
+#include "ofMain.h"
+
+class ofApp;
+
+//  Rendered tiles kept on disk across runs, one file per tile named by a
+//  hash of everything the tile's pixels depend on, so a render of a scene
+//  that only changed in places loads the unchanged tiles instead of
+//  tracing them.
+//
+//  The key covers the render settings and camera, the tile's rectangle,
+//  every light, and the objects the tile can see: those whose bounds meet
+//  the tile's view frustum (found through the scene hierarchy).  Objects
+//  outside the frustum still matter when they shadow what the tile sees,
+//  so the casters inside the box around the visible objects and each light
+//  are added too; an infinite plane in view brings in every caster, and a
+//  reflective surface in view brings in the whole scene.
+//
+//  Tiles are written to a temporary file and renamed, so parallel or killed
+//  renders never leave half a tile.  The least recently used tiles are
+//  deleted once the cache grows past maxBytes.
+//
+class TileCache {
+public:
+	bool open(const string& dir);		// relative to the data folder, created if needed
+	bool isOpen() const { return !dir.empty(); }
+
+	// key of tile [x0, x1) x [y0, y1) (rows from the top) of the app's current
+	// render; needs prepareRender() for the scene hierarchy
+	uint64_t key(ofApp* app, int x0, int y0, int x1, int y1);
+	bool load(uint64_t key, int width, int height, vector<unsigned char>& rgb);
+	void store(uint64_t key, int width, int height, const vector<unsigned char>& rgb);
+
+	void resetStats() { hits = misses = 0; }
+	void printStats();
+
+	uint64_t maxBytes = 2048ull << 20;
+	int hits = 0, misses = 0;
+
+protected:
+	struct Header {
+		char magic[4];
+		int32_t width, height;
+		uint64_t key;
+	};
+	struct Entry { string path; uint64_t bytes; };
+
+	string path(uint64_t key) const;
+	void evict();
+
+	string dir;
+	std::deque<Entry> entries;		// least recently used first
+	uint64_t totalBytes = 0;
+};